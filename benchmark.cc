@@ -18,14 +18,22 @@ public:
     YCSBench(MyOption opt) : opt_(opt) {
         clients_.resize(opt_.client_num);
 
+        // connect all clients together, the server sets their connections up in parallel
+        std::vector<std::thread> connect_threads;
         for(int i = 0; i < opt_.client_num; i++) {
-            clients_[i].reset(NewClient(opt, i + 1));
-            clients_[i]->Connect();
+            connect_threads.emplace_back([this, opt, i]() {
+                clients_[i].reset(NewClient(opt, i + 1));
+                clients_[i]->Connect();
+            });
+        }
+        for(auto & th : connect_threads) {
+            th.join();
         }
 
         init_keys_.reserve(8 * 1024 * 1024);
         ops_.reserve(8 * 1024 * 1024);
         keys_.reserve(8 * 1024 * 1024);
+        scan_lens_.reserve(8 * 1024 * 1024);
     }
 
     void Start() {
@@ -53,20 +61,19 @@ public:
         if(loadonly == false) {
             // start the query against the kvstore
             std::vector<uint64_t> latencys;
-            steady_clock::time_point start, end;
             if(opt_.lat_mode) {
                 latencys.resize(opt_.opnum);
-            } else {
-                start = steady_clock::now();
             }
+            steady_clock::time_point start = steady_clock::now();
 
             piece = opt_.opnum / opt_.client_num;
+            auto run = opt_.async_mode ? &YCSBench::AsyncRun : &YCSBench::Run;
             for(int i = 0; i < opt_.client_num; i++) {
                 int end = i * piece + std::min(piece, opt_.opnum - i * piece);
                 if(queryonly == true)
-                    client_threads.emplace_back(&YCSBench::Run, this, i, i * piece, end, std::ref(latencys));
+                    client_threads.emplace_back(run, this, i, i * piece, end, std::ref(latencys));
                 else 
-                    client_threads[i] = std::move(std::thread(&YCSBench::Run, this, i, i * piece, end, std::ref(latencys)));
+                    client_threads[i] = std::move(std::thread(run, this, i, i * piece, end, std::ref(latencys)));
             }
             for(int i = 0; i < opt_.client_num; i++) {
                 client_threads[i].join();
@@ -74,6 +81,8 @@ public:
             std::cerr << "Finish Quering" << std::endl;
 
             // ends measuring and print the results
+            auto elapse_time = duration_cast<milliseconds>(steady_clock::now() - start);
+            std::cout << "IOPS: " << (double)opt_.opnum / elapse_time.count() << " Kops/s" << std::endl;
             if(opt_.lat_mode) {
                 std::sort(latencys.begin(), latencys.end());
                 double lat50, lat90, lat99, lat999, lat9999;
@@ -89,14 +98,14 @@ public:
                         << "99\% latency:\t" << lat99 / 1000  << std::endl
                         << "999\% latency:\t" << lat999 / 1000  << std::endl
                         << "9999\% latency:\t" << lat9999 / 1000<< std::endl;
-            } else {
-                auto end = steady_clock::now();
-                auto elapse_time = duration_cast<milliseconds>(end - start);
-                std::cout << "IOPS: " << (double)opt_.opnum / elapse_time.count() << " Kops/s" << std::endl;
             }
         }
 
         for(int i = 0; i < opt_.client_num; i++) {
+            if(HasIdled(clients_[i]->Stats())) {
+                std::string who = "client " + std::to_string(i + 1);
+                clients_[i]->Stats().Print(stderr, who.c_str());
+            }
             clients_[i]->SendClose();
         }
     }
@@ -116,6 +125,7 @@ private:
         std::string read("READ");
         std::string update("UPDATE");
         std::string remove("DELETE");
+        std::string scan("SCAN");
 
         if(queryonly == false) {
             while (true) {
@@ -143,6 +153,8 @@ private:
                 infile_txn >> op >> key;
                 if(!infile_txn.good()) break;
 
+                int scan_len = 0;
+
                 if (op.compare(insert) == 0) {
                     ops_.push_back(Operation::PUT);
                 } else if (op.compare(read) == 0) {
@@ -151,11 +163,15 @@ private:
                     ops_.push_back(Operation::UPDATE);
                 } else if(op.compare(remove) == 0) {
                     ops_.push_back(Operation::DELETE);
+                } else if(op.compare(scan) == 0) { // YCSB-E, the number of entries follows the key
+                    infile_txn >> scan_len;
+                    ops_.push_back(Operation::SCAN);
                 } else {
                     std::cout << "UNRECOGNIZED CMD!\n";
                     return;
                 }
                 keys_.push_back(key);
+                scan_lens_.push_back(scan_len);
             }
         }
         infile_txn.close();
@@ -163,10 +179,79 @@ private:
 
     static void Populate(YCSBench * bc, int client_id, int start, int end) {
         auto & c = bc->clients_[client_id];
+        // a value may be posted zero-copy, keep it until its request left the window
+        std::vector<std::string> values(bc->opt_.window + 1);
         for(int i = start; i < end; i++) {
-            std::string value = BuildValue(bc->opt_.valsize, bc->init_keys_[i]);
-            c->SendPut(bc->init_keys_[i].c_str(), value.c_str());
+            std::string & value = values[i % values.size()];
+            value = BuildValue(bc->opt_.valsize, bc->init_keys_[i]);
+            // combined puts are only acknowledged with their group, waiting for each one defeats it
+            if(bc->opt_.async_mode || bc->opt_.combine > 1)
+                c->AsyncPut(bc->init_keys_[i].c_str(), value.c_str());
+            else
+                c->SendPut(bc->init_keys_[i].c_str(), value.c_str());
         }
+        c->Drain();
+    }
+
+    // keep opt_.window requests in flight, the latency of a request is measured from submit to reply
+    static void AsyncRun(YCSBench * bc, int client_id, int start, int end, std::vector<uint64_t> & times) {
+        auto & c = bc->clients_[client_id];
+        bool lat_mode = bc->opt_.lat_mode;
+        // a value may be posted zero-copy, keep it until its request left the window
+        std::vector<std::string> values(bc->opt_.window + 1);
+
+        for(int i = start; i < end; i++) {
+            std::string & key = bc->keys_[i];
+            std::string & value = values[i % values.size()];
+            steady_clock::time_point submit_time;
+            if(lat_mode) 
+                submit_time = steady_clock::now();
+            auto done = [&times, i, lat_mode, submit_time](bool, std::string *) {
+                if(lat_mode) {
+                    times[i] = duration_cast<nanoseconds>(steady_clock::now() - submit_time).count();
+                }
+            };
+
+            switch(bc->ops_[i]) {
+                case PUT: {
+                    value = key + BuildValue(bc->opt_.valsize, key);
+                    c->AsyncPut(key.c_str(), value.c_str(), done);
+                    break;
+                }
+                case UPDATE: {
+                    value = BuildValue(bc->opt_.valsize, key);
+                    c->AsyncUpdate(key.c_str(), value.c_str(), done);
+                    break;
+                } 
+                case GET: {
+                    c->AsyncGet(key.c_str(), [done](bool ok, std::string * val) {
+                        assert(ok == true);
+                        done(ok, val);
+                    });
+                    break;
+                }
+                case DELETE: {
+                    c->AsyncDelete(key.c_str(), [done](bool ok, std::string * val) {
+                        assert(ok == true);
+                        done(ok, val);
+                    });
+                    break;
+                }
+                case SCAN: {
+                    c->AsyncScan(key, "", bc->scan_lens_[i], [done](bool ok, ScanEntries *) {
+                        assert(ok == true);
+                        done(ok, nullptr);
+                    });
+                    break;
+                }
+                default: {
+                    std::cout << "UNRECOGNIZED CMD!\n";
+                    break;
+                }
+            }
+            c->Poll();
+        }
+        c->Drain();
     }
 
     static void Run(YCSBench * bc, int client_id, int start, int end, std::vector<uint64_t> & times) {
@@ -201,6 +286,12 @@ private:
                     assert(found == true);
                     break;
                 }
+                case SCAN: {
+                    ScanEntries entries;
+                    bool ok = c->SendScan(key, "", bc->scan_lens_[i], &entries);
+                    assert(ok == true);
+                    break;
+                }
                 default: {
                     std::cout << "UNRECOGNIZED CMD!\n";
                     break;
@@ -222,6 +313,7 @@ private:
     std::vector<std::string> init_keys_;
     std::vector<std::string> keys_;
     std::vector<Operation> ops_;
+    std::vector<int> scan_lens_; // entries a scan asks for, by operation
 };
 
 int main(int argc, char ** argv) {
@@ -230,6 +322,28 @@ int main(int argc, char ** argv) {
     a.add<int>("clientnum", 'c', "client number", false, default_opt.client_num); 
     a.add<std::string>("fronttype", 'f', "front type", false, default_opt.front_type);
     a.add<bool> ("latmode", 'l', "latency mode", false, default_opt.lat_mode);
+    a.add<bool> ("async", 'a', "asynchronous client mode", false, default_opt.async_mode);
+    a.add<int>("window", 'w', "requests in flight per client (async mode)", false, default_opt.window);
+    a.add<std::string>("transport", 't', "rdma or shm", false, default_opt.transport);
+    a.add<std::string>("dbtype", 'd', "database type (shm only)", false, default_opt.db_type);
+    a.add<std::string>("dir", 0, "database directory (shm only)", false, default_opt.dir);
+    a.add<int>("shmlat", 0, "shm injected latency (ns)", false, default_opt.shm_latency);
+    a.add<int>("shmbw", 0, "shm bandwidth (MB/s)", false, default_opt.shm_bandwidth);
+    a.add<std::string>("notify", 'n', "ring notification: poll, imm or frame", false, default_opt.notify);
+    a.add<int>("workers", 0, "server polling threads, 0 for one per connection", false, default_opt.worker_num);
+    a.add<std::string>("profile", 0, "transport profiles to sweep, separated by ';'", false, default_opt.profile);
+    a.add<bool>("readpath", 0, "pmraccess gets read the server's index with RDMA first", false, default_opt.read_path);
+    a.add<int>("lanes", 0, "connections per client, requests are striped over them by key", false, default_opt.lanes);
+    a.add<std::string>("device", 0, "RDMA devices: name[:port],...", false, default_opt.rdma_device);
+    a.add<std::string>("rpc", 0, "rc for a connection per client, ud for datagrams", false, default_opt.rpc);
+    a.add<int>("combine", 0, "pmraccess puts notified together, 1 for none", false, default_opt.combine);
+    a.add<int>("combinebytes", 0, "bytes of combined puts that trigger a notification", false, default_opt.combine_bytes);
+    a.add<int>("linger", 0, "microseconds a combined put waits at most for others", false, default_opt.linger_us);
+    a.add<int>("ingest", 0, "pmraccess ingest workers, 0 to ingest on the clerks", false, default_opt.ingest_workers);
+    a.add<int>("ingestmerge", 0, "sealed chunks put into the database with one write", false, default_opt.ingest_merge);
+    a.add<int>("chunks", 0, "chunks of the PMR buffer used, -1 for all", false, default_opt.pmr_chunks);
+    a.add<int>("spill", 0, "chunks of host DRAM the buffer spills to, -1 for all", false, default_opt.spill_chunks);
+    a.add<std::string>("poll", 0, "idling after empty polls: spin,pause,yield,block_ms", false, default_opt.poll);
 
     a.parse_check(argc, argv);
 
@@ -237,13 +351,63 @@ int main(int argc, char ** argv) {
     opt.valsize = a.get<int>("valsize");
     opt.client_num = a.get<int>("clientnum");
     opt.lat_mode = a.get<bool>("latmode");
+    opt.async_mode = a.get<bool>("async");
+    opt.window = a.get<int>("window");
     opt.front_type = a.get<std::string>("fronttype");
+    opt.transport = a.get<std::string>("transport");
+    opt.db_type = a.get<std::string>("dbtype");
+    opt.dir = a.get<std::string>("dir");
+    opt.shm_latency = a.get<int>("shmlat");
+    opt.shm_bandwidth = a.get<int>("shmbw");
+    opt.notify = a.get<std::string>("notify");
+    opt.worker_num = a.get<int>("workers");
+    opt.poll = a.get<std::string>("poll");
+    opt.read_path = a.get<bool>("readpath");
+    opt.lanes = a.get<int>("lanes");
+    opt.rdma_device = a.get<std::string>("device");
+    opt.rpc = a.get<std::string>("rpc");
+    opt.combine = a.get<int>("combine");
+    opt.combine_bytes = a.get<int>("combinebytes");
+    opt.linger_us = a.get<int>("linger");
+    opt.ingest_workers = a.get<int>("ingest");
+    opt.ingest_merge = a.get<int>("ingestmerge");
+    opt.pmr_chunks = a.get<int>("chunks");
+    opt.spill_chunks = a.get<int>("spill");
 
     std::cerr << "Value Size:\t" << opt.valsize << std::endl
               << "Client Num:\t" << opt.client_num << std::endl
-              << "FrontType :\t" << opt.front_type << std::endl;
-    YCSBench YCSBench(opt);
-    YCSBench.Start();
+              << "FrontType :\t" << opt.front_type << std::endl
+              << "Async Mode:\t" << opt.async_mode << " (window " << opt.window << ")" << std::endl
+              << "Poll      :\t" << (opt.poll.empty() ? "spin" : opt.poll) << std::endl
+              << "Transport :\t" << opt.transport << std::endl;
+
+    // run the benchmark once per transport profile
+    std::vector<std::string> profiles;
+    std::string profile_list = a.get<std::string>("profile");
+    size_t pos = 0;
+    do {
+        size_t end = std::min(profile_list.find(';', pos), profile_list.size());
+        profiles.push_back(profile_list.substr(pos, end - pos));
+        pos = end + 1;
+    } while(pos <= profile_list.size());
+
+    for(size_t i = 0; i < profiles.size(); i++) {
+        MyOption run_opt = opt;
+        run_opt.profile = profiles[i];
+        std::cout << "Profile   :\t" << (run_opt.profile.empty() ? "detect" : run_opt.profile) << std::endl;
+
+        if(opt.transport == "shm") {
+            run_opt.ipaddr = "127.0.0.1";
+            if(profiles.size() > 1) { // a fresh in-process server and database for each profile
+                run_opt.ipport = opt.ipport + i;
+                run_opt.dir = opt.dir + "/profile" + std::to_string(i);
+                mkdir(run_opt.dir.c_str(), 0777);
+            }
+            ServeInProcess(run_opt);
+        }
+        YCSBench YCSBench(run_opt);
+        YCSBench.Start();
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -9,6 +9,11 @@
 #include "leveldb/write_batch.h"
 #include "cuckoodb/libcuckoo/cuckoohash_map.h"
 
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
 struct Meta {
     struct FileAddress {
         uint32_t file_offset = 0;
@@ -48,18 +53,45 @@ struct Meta {
     uint32_t DataSize() const { return key_size_ + value_size_; }
 };
 
+// records in a buffer as PutBatch takes them
+struct RecordBatch {
+    std::vector<std::string> * keys;
+    std::vector<Meta> * metas;
+    uint8_t * buf;
+    int length;
+};
+
 class DBType {
 public:
     virtual bool Put(std::string & key, std::string & val) = 0;
 
     virtual bool Get(std::string & key, std::string * val) = 0;
 
+    // look up every key in one go, vals and found are resized to the number of keys
+    virtual bool GetBatch(std::vector<std::string> & key_batch, std::vector<std::string> * vals, 
+                    std::vector<bool> * found) = 0;
+
+    // up to `limit` entries in key order from `start` on, before `end` unless it is empty
+    virtual bool Scan(std::string & start, std::string & end, int limit, 
+                    std::vector<std::pair<std::string, std::string>> * kvs) = 0;
+
     virtual bool Update(std::string & key, std::string & val) = 0;
 
     virtual bool Delete(std::string & key) = 0;
 
     virtual bool PutBatch(std::vector<std::string> & key_batch, std::vector<Meta> & metas, 
                     uint8_t *buf, int length) = 0;
+
+    // put several batches in order, a record of a later batch overwrites one of the same key before it
+    virtual bool PutBatches(std::vector<RecordBatch> & batches) {
+        for(auto & batch : batches) {
+            PutBatch(*batch.keys, *batch.metas, batch.buf, batch.length);
+        }
+        return true;
+    }
+
+    // make every write so far durable, false if the database does not outlive the process
+    virtual bool Sync() = 0;
 };
 
 class LevelDB : public DBType {
@@ -114,6 +146,33 @@ public:
         return s.ok();
     }
 
+    bool GetBatch(std::vector<std::string> & key_batch, std::vector<std::string> * vals, 
+                    std::vector<bool> * found) {
+        // all keys share one reference to the memtables and the current version
+        std::vector<leveldb::Slice> keys(key_batch.begin(), key_batch.end());
+        std::vector<leveldb::Status> status;
+        db_->MultiGet(leveldb::ReadOptions(), keys, vals, &status);
+        found->resize(key_batch.size());
+        for(size_t i = 0; i < key_batch.size(); i++) {
+            (*found)[i] = status[i].ok();
+        }
+        return true;
+    }
+
+    bool Scan(std::string & start, std::string & end, int limit, 
+                    std::vector<std::pair<std::string, std::string>> * kvs) {
+        leveldb::Iterator * it = db_->NewIterator(leveldb::ReadOptions());
+        for(it->Seek(leveldb::Slice(start)); it->Valid() && kvs->size() < (size_t)limit; it->Next()) {
+            if(!end.empty() && it->key().compare(leveldb::Slice(end)) >= 0) {
+                break;
+            }
+            kvs->emplace_back(it->key().ToString(), it->value().ToString());
+        }
+        bool ok = it->status().ok();
+        delete it;
+        return ok;
+    }
+
     bool Update(std::string & key, std::string & val) {
         leveldb::WriteBatch batch;
         batch.Put(leveldb::Slice(key), leveldb::Slice(val));
@@ -139,6 +198,27 @@ public:
         leveldb::Status s = db_->Write(write_options_, &batch);
         return true;
     }
+
+    // all batches go into one write batch, so that they take a single write to the log
+    bool PutBatches(std::vector<RecordBatch> & batches) {
+        leveldb::WriteBatch batch;
+        for(auto & records : batches) {
+            for(size_t i = 0; i < records.keys->size(); i++) {
+                Meta & meta = (*records.metas)[i];
+                char * val = (char *)records.buf + meta.fileaddr_.file_offset + meta.key_size_;
+                batch.Put(leveldb::Slice((*records.keys)[i]), leveldb::Slice(val, meta.value_size_));
+            }
+        }
+        return db_->Write(write_options_, &batch).ok();
+    }
+
+    bool Sync() {
+        // an empty batch written with sync syncs the log of all writes before it
+        leveldb::WriteOptions options;
+        options.sync = true;
+        leveldb::WriteBatch batch;
+        return db_->Write(options, &batch).ok();
+    }
 };
 
 class CuckooDB : public DBType {
@@ -161,7 +241,35 @@ public:
     }
 
     bool Get(std::string & key, std::string * val) {
-        *val = db_->find(key);
+        return db_->find(key, *val);
+    }
+
+    bool GetBatch(std::vector<std::string> & key_batch, std::vector<std::string> * vals, 
+                    std::vector<bool> * found) {
+        vals->resize(key_batch.size());
+        found->resize(key_batch.size());
+        for(size_t i = 0; i < key_batch.size(); i++) {
+            (*found)[i] = db_->find(key_batch[i], (*vals)[i]);
+        }
+        return true;
+    }
+
+    // the table is unordered, every entry is looked at
+    bool Scan(std::string & start, std::string & end, int limit, 
+                    std::vector<std::pair<std::string, std::string>> * kvs) {
+        size_t first = kvs->size();
+        {
+            auto table = db_->lock_table();
+            for(auto & [key, val] : table) {
+                if(key >= start && (end.empty() || key < end)) {
+                    kvs->emplace_back(key, val);
+                }
+            }
+        }
+        std::sort(kvs->begin() + first, kvs->end());
+        if(kvs->size() - first > (size_t)limit) {
+            kvs->resize(first + limit);
+        }
         return true;
     }
 
@@ -185,6 +293,10 @@ public:
         
         return true;
     }
+
+    bool Sync() {
+        return false;
+    }
 };
 
 #endif // DBTYPE
\ No newline at end of file
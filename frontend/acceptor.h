@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "socketutil.h"
+
+namespace frontend {
+
+/*
+ * Acceptor: accepts client connections on one thread and hands each socket to a pool of helpers,
+ * which run `setup` on it: open a context, exchange certificates, bring the queue pair up and start
+ * its clerk. Many clients connecting together thus set up in parallel, and the clerks already serving
+ * never wait for a connection being set up. `setup` has to be thread-safe, and close the socket of a
+ * client it fails to set up.
+ */
+class Acceptor {
+public:
+    using Setup = std::function<void(int commu_fd)>;
+
+    static const int HELPERS = 4;
+
+    Acceptor(int port, Setup setup) : port_(port), setup_(std::move(setup)) {}
+
+    Acceptor(const Acceptor &) = delete;
+    Acceptor &operator=(const Acceptor &) = delete;
+
+    // accept connections forever
+    void Run() {
+        for(int i = 0; i < HELPERS; i++) {
+            std::thread th(&Acceptor::Help, this);
+            th.detach();
+        }
+
+        auto socket = SocketUtil::Socket::make_socket(SocketUtil::SERVER, port_);
+        int commu_fd = socket->GetFirst();
+        while(true) {
+            {
+                std::lock_guard<std::mutex> l(mu_);
+                pending_.push_back(commu_fd);
+            }
+            cv_.notify_one();
+            commu_fd = socket->NewChannel(port_);
+        }
+    }
+
+private:
+    void Help() {
+        while(true) {
+            int commu_fd;
+            {
+                std::unique_lock<std::mutex> l(mu_);
+                cv_.wait(l, [this] { return !pending_.empty(); });
+                commu_fd = pending_.front();
+                pending_.pop_front();
+            }
+            setup_(commu_fd);
+        }
+    }
+
+    int port_;
+    Setup setup_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<int> pending_; // accepted sockets not set up yet
+};
+
+} // namespace frontend
@@ -1,12 +1,22 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <cstdint>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cassert>
 
 #include "rdmautil.h"
 #include "socketutil.h"
 #include "flags.h"
 #include "request.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "acceptor.h"
+#include "udrpc.h"
 #include "../database/db.h"
 
 #include <sys/stat.h>
@@ -14,36 +24,327 @@
 #include <unistd.h>
 
 namespace frontend {
+// the devices of MyOption::rdma_device, a comma separated list of name[:port], as (name, port) pairs
+inline std::vector<std::pair<std::string, int>> ParseDevices(const MyOption & opt) {
+    std::vector<std::pair<std::string, int>> devices;
+    size_t pos = 0;
+    do {
+        size_t end = std::min(opt.rdma_device.find(',', pos), opt.rdma_device.size());
+        std::string entry = opt.rdma_device.substr(pos, end - pos);
+        size_t colon = entry.find(':');
+        if(colon == std::string::npos) {
+            devices.emplace_back(entry, opt.port);
+        } else {
+            devices.emplace_back(entry.substr(0, colon), std::stoi(entry.substr(colon + 1)));
+        }
+        pos = end + 1;
+    } while(pos <= opt.rdma_device.size());
+    return devices;
+}
+
+// number of devices to spread connections over, the loopback transport has a single one
+inline int DeviceCount(const MyOption & opt) {
+    return opt.transport == "shm" ? 1 : ParseDevices(opt).size();
+}
+
+// the index-th device of MyOption::rdma_device
+inline std::unique_ptr<RDMAUtil::RDMADevice> MakeDevice(const MyOption & opt, int index = 0) {
+    std::unique_ptr<RDMAUtil::RDMADevice> device;
+    if(opt.transport == "shm") {
+        device = RDMAUtil::RDMADevice::make_loopback(opt.shm_latency, opt.shm_bandwidth);
+    } else {
+        auto devices = ParseDevices(opt);
+        auto & [name, port] = devices[index % devices.size()];
+        device = RDMAUtil::RDMADevice::make_rdma(name, port, opt.gid);
+    }
+    if(device) {
+        device->set_poll_policy(RDMAUtil::PollPolicy::Parse(opt.poll));
+        device->set_profile(RDMAUtil::TransportProfile::Parse(opt.profile));
+    }
+    return device;
+}
+
 class Server {
 public:
     Server() {}
 
     virtual void Listen() = 0;
+
+protected:
+    // open every device of MyOption::rdma_device, connections are spread over them in turn
+    void InitDevices(const MyOption & opt) {
+        for(int i = 0; i < DeviceCount(opt); i++) {
+            auto device = MakeDevice(opt, i);
+            assert(device != nullptr);
+            devices_.push_back(std::move(device));
+        }
+    }
+
+    // index of the device the next connection is set up on
+    int NextDevice() {
+        return next_device_++ % devices_.size();
+    }
+
+    // MyOption::worker_num > 0 serves all connections on a pool of polling workers
+    void InitScheduler(const MyOption & opt) {
+        if(opt.worker_num > 0) {
+            scheduler_.reset(new ClerkScheduler(opt.worker_num, RDMAUtil::PollPolicy::Parse(opt.poll)));
+        }
+    }
+
+    // serve a new connection on the worker pool, or on a thread of its own without one
+    void StartClerk(std::unique_ptr<Clerk> clk) {
+        if(scheduler_) {
+            scheduler_->Add(std::move(clk));
+        } else {
+            std::thread th(RunClerk, std::move(clk));
+            th.detach();
+        }
+    }
+
+    // MyOption::rpc "ud" serves all clients with datagrams, see udrpc.h
+    void InitDatagrams(const MyOption & opt) {
+        datagrams_ = opt.rpc == "ud";
+        ud_workers_ = std::max(1, opt.worker_num);
+        ud_policy_ = RDMAUtil::PollPolicy::Parse(opt.poll);
+    }
+
+    // serve datagram clients forever, each worker applies requests with a handler made by `make`
+    void ServeDatagrams(int port, UdService::MakeHandler make) {
+        std::vector<RDMAUtil::RDMADevice *> devices;
+        for(auto & device : devices_) {
+            devices.push_back(device.get());
+        }
+        UdService service(devices, ud_workers_, ud_policy_, std::move(make));
+        Acceptor acceptor(port, [&service](int commu_fd) {
+            service.Setup(commu_fd);
+        });
+        acceptor.Run();
+    }
+
+    std::vector<std::unique_ptr<RDMAUtil::RDMADevice>> devices_;
+    std::atomic<int> next_device_{0};
+    std::unique_ptr<ClerkScheduler> scheduler_;
+    bool datagrams_ = false;
+    int ud_workers_ = 1;
+    RDMAUtil::PollPolicy ud_policy_;
 };
 
+/*
+ * Client: the Async* calls return once the request is posted, `cb` runs from Poll() or Drain() when
+ * the reply arrives, in submission order. `val` points to the value of a found key for gets, it is
+ * nullptr otherwise. A connection keeps at most MyOption::window requests in flight, Async* waits for
+ * replies when the window is full. The Send* calls are synchronous.
+ *
+ * With MyOption::lanes > 1 a client stripes its requests over that many connections by key, the
+ * order above then holds among the requests on the same key only.
+ *
+ * Keys and values are taken with their length and may hold any bytes, a C string converts to the
+ * std::string_view of its characters. A client may post values of ZERO_COPY_SIZE bytes or more
+ * straight from the `val` given to AsyncPut and AsyncUpdate, so such a value must stay unchanged until
+ * its callback ran.
+ *
+ * pmraccess takes values of up to MAX_VALUE bytes. A record that does not fit in a request slot is
+ * read by the clerk from the caller's `val` with RDMA, and a value that does not fit in a reply is
+ * written by the clerk to the client in segments once a second request asked for it, the callback of
+ * such a get then runs from a later Poll() or Drain(). Other clients take records of a slot at most.
+ *
+ * With MyOption::read_path a pmraccess get without requests in flight may be resolved with RDMA reads
+ * of the server's index, its callback then runs before AsyncGet returns.
+ *
+ * With MyOption::combine > 1 pmraccess puts are written and acknowledged in groups. A group goes out
+ * once it is full, before any other request on its lane, on Drain(), or on the first call after its
+ * first put lingered MyOption::linger_us, so a put is only sent by a later call at the latest.
+ *
+ * AsyncMultiGet and AsyncMultiDelete run `cb` once for each key, with its index in `keys`. pmraccess
+ * sends the keys of a lane in as few requests as fit in a slot, other clients one request per key.
+ * A key whose value did not fit in the reply of a multi-key get is asked for again on its own, its
+ * callback then runs from a later Poll() or Drain().
+ *
+ * AsyncScan asks for the entries of a range page by page on a single connection and runs `cb` with
+ * all of them before it returns. Datagram clients do not scan, their callback gets false.
+ */
 class Client {
 public:
+    using Callback = std::function<void(bool ok, std::string * val)>;
+    using MultiCallback = std::function<void(int i, bool ok, std::string * val)>;
+    using ScanCallback = std::function<void(bool ok, ScanEntries * entries)>;
+
     Client() {}
 
     virtual void Connect() = 0;
 
-    virtual void SendPut(const char * key, const char * val) = 0;
+    virtual void AsyncPut(std::string_view key, std::string_view val, Callback cb = nullptr) = 0;
+
+    virtual void AsyncUpdate(std::string_view key, std::string_view val, Callback cb = nullptr) = 0;
+
+    virtual void AsyncGet(std::string_view key, Callback cb) = 0;
+
+    virtual void AsyncDelete(std::string_view key, Callback cb = nullptr) = 0;
 
-    virtual void SendUpdate(const char * key, const char * val) = 0;
+    virtual void AsyncMultiGet(const std::vector<std::string> & keys, MultiCallback cb) {
+        for(size_t i = 0; i < keys.size(); i++) {
+            AsyncGet(keys[i], [cb, i](bool ok, std::string * val) {
+                cb(i, ok, val);
+            });
+        }
+    }
 
-    virtual bool SendGet(const char * key, std::string * val) = 0;
+    virtual void AsyncMultiDelete(const std::vector<std::string> & keys, MultiCallback cb = nullptr) {
+        for(size_t i = 0; i < keys.size(); i++) {
+            AsyncDelete(keys[i], !cb ? nullptr : Callback([cb, i](bool ok, std::string *) {
+                cb(i, ok, nullptr);
+            }));
+        }
+    }
 
-    virtual bool SendDelete(const char * key) = 0;
+    // up to `limit` entries in key order from `start` on, before `end` unless it is empty
+    virtual void AsyncScan(std::string_view /* start */, std::string_view /* end */, int /* limit */, ScanCallback cb) {
+        cb(false, nullptr);
+    }
+
+    // run the callbacks of arrived replies, return the number of completed requests
+    virtual int Poll() = 0;
+
+    // wait for every request in flight
+    virtual void Drain() = 0;
+
+    virtual void SendPut(std::string_view key, std::string_view val) {
+        AsyncPut(key, val);
+        Drain();
+    }
+
+    virtual void SendUpdate(std::string_view key, std::string_view val) {
+        AsyncUpdate(key, val);
+        Drain();
+    }
+
+    virtual bool SendGet(std::string_view key, std::string * val) {
+        bool found = false;
+        AsyncGet(key, [&](bool ok, std::string * v) {
+            found = ok;
+            if(ok) *val = std::move(*v);
+        });
+        Drain();
+        return found;
+    }
+
+    virtual bool SendDelete(std::string_view key) {
+        bool found = false;
+        AsyncDelete(key, [&](bool ok, std::string *) {
+            found = ok;
+        });
+        Drain();
+        return found;
+    }
+
+    // the values of found keys go to `vals`, return the number found
+    virtual int SendMultiGet(const std::vector<std::string> & keys, std::vector<std::string> * vals, std::vector<bool> * found) {
+        int n = 0;
+        vals->assign(keys.size(), std::string());
+        found->assign(keys.size(), false);
+        AsyncMultiGet(keys, [&](int i, bool ok, std::string * v) {
+            (*found)[i] = ok;
+            if(ok) {
+                (*vals)[i] = std::move(*v);
+                n += 1;
+            }
+        });
+        Drain();
+        return n;
+    }
+
+    // return the number of keys deleted
+    virtual int SendMultiDelete(const std::vector<std::string> & keys) {
+        int n = 0;
+        AsyncMultiDelete(keys, [&](int, bool ok, std::string *) {
+            n += ok;
+        });
+        Drain();
+        return n;
+    }
+
+    virtual bool SendScan(std::string_view start, std::string_view end, int limit, ScanEntries * entries) {
+        bool done = false;
+        AsyncScan(start, end, limit, [&](bool ok, ScanEntries * e) {
+            done = ok;
+            if(ok) *entries = std::move(*e);
+        });
+        return done;
+    }
 
     virtual void SendClose() = 0;
 
     virtual int GetClientID() = 0; 
+
+    // idle time of the connection so far
+    virtual const RDMAUtil::PollStats & Stats() const = 0;
 };
 
+// adapt a client callback to the reply of the request ring
+inline ClientRing::Handler ReplyHandler(Client::Callback cb, bool has_value) {
+    if(!cb) {
+        return nullptr;
+    }
+    return [cb, has_value](RequestReply * reply) {
+        if(reply->status != RequestStatus::OK) {
+            cb(false, nullptr);
+        } else if(has_value) {
+            std::string val(reply->value, reply->val_size);
+            cb(true, &val);
+        } else {
+            cb(true, nullptr);
+        }
+    };
+}
+
+// ask for a scan page by page on `ring`, the indices of entries left out for SCAN_LARGE go to `large`
+inline bool ScanPages(ClientRing & ring, std::string_view start, std::string_view end, uint32_t limit,
+                      ScanEntries * entries, std::vector<int> * large) {
+    assert(sizeof(Request) + start.size() + sizeof(uint32_t) + end.size() <= RING_SLOT_SIZE);
+    std::string from(start);
+    bool ok = true;
+    while(entries->size() < limit) {
+        size_t before = entries->size();
+        bool full = false;
+        Request * request = ring.Next();
+        ScanInit(request, from, end, limit - before);
+        ring.Submit(request->Length(), [&](RequestReply * reply) {
+            ok = reply->status == RequestStatus::OK;
+            if(ok) full = ScanUnpack(reply, entries, large);
+        });
+        ring.Drain();
+        if(!ok || !full || entries->size() == before) {
+            break;
+        }
+        // the next page starts right after the last key
+        from = entries->back().first;
+        from.push_back('\0');
+    }
+    return ok;
+}
+
+// answer a SCAN from the database alone
+inline void ServeScan(DBType * db, Request * request, RequestReply * reply, uint32_t capacity) {
+    std::string start, end;
+    uint32_t limit;
+    ScanArgs(request, &start, &end, &limit);
+    // no more than a page can hold
+    uint32_t page = std::min<uint32_t>(limit, capacity / (2 * sizeof(uint32_t)));
+    ScanEntries entries;
+    if(!db->Scan(start, end, page, &entries)) {
+        reply->status = RequestStatus::ERROR;
+        reply->val_size = 0;
+        return ;
+    }
+    ScanPack(entries, page < limit && entries.size() == page, reply, capacity);
+}
+
 const int MAX_ASYNC_SIZE   = 32 * 1024;
-const uint32_t CLIENT_DONE = 0x7f7f7f7f;
-const uint32_t CLERK_DONE  = 0xf7f7f7f7;
-const int RING_HEADER      = sizeof(uint32_t) * 2;
+const int ZERO_COPY_SIZE   = 1024; // smaller values are cheaper to copy than to gather
+const int MAX_VALUE        = 1024 * 1024; // the write buffer of a pmraccess lane, large gets land there
+const int CHUNK_HEADER     = 64; // a pmraccess chunk starts with a ChunkHeader, its records follow
+const int CHUNK_SPACE      = MAX_ASYNC_SIZE - CHUNK_HEADER;
 
 inline bool folder_exist(const char *fname) {
     struct stat buffer;
@@ -3,4 +3,5 @@
 #include "pmr/client.h"
 #include "pmr/server.h"
 #include "pmem/client.h"
-#include "pmem/server.h"
\ No newline at end of file
+#include "pmem/server.h"
+#include "ud/client.h"
\ No newline at end of file
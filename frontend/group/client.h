@@ -7,6 +7,7 @@
 #include <cstdio>
 
 #include "../cs.h"
+#include "../lanes.h"
 
 using namespace RDMAUtil;
 using namespace SocketUtil;
@@ -19,17 +20,27 @@ public:
 
     void Connect();
 
-    void SendPut(const char * key, const char * val) {
-        SendWrite(key, val, PUT);
+    void AsyncPut(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, PUT, cb);
     }
 
-    void SendUpdate(const char * key, const char * val) {
-        SendWrite(key, val, UPDATE);
+    void AsyncUpdate(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, UPDATE, cb);
     } 
 
-    bool SendGet(const char * key, std::string * val);
+    void AsyncGet(std::string_view key, Callback cb);
 
-    bool SendDelete(const char * key);
+    void AsyncDelete(std::string_view key, Callback cb = nullptr);
+
+    void AsyncScan(std::string_view start, std::string_view end, int limit, ScanCallback cb);
+
+    int Poll() {
+        return lanes_.Poll();
+    }
+
+    void Drain() {
+        lanes_.Drain();
+    }
 
     void SendClose();
 
@@ -37,15 +48,19 @@ public:
         return client_id_;
     }
 
+    const RDMAUtil::PollStats & Stats() const {
+        return lanes_.Stats();
+    }
+
 private:
-    void SendWrite(const char * key, const char * val, Operation op);
+    void AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb);
 
 private:
-    std::unique_ptr<RDMADevice> rdma_device_;
-    std::unique_ptr<RDMAContext> rdma_context_;
-    uint8_t * local_buf_;
+    ClientLanes lanes_;
 
     int client_id_;
+    int window_;
+    Notify notify_;
     std::string ip_;
     int port_;
 };
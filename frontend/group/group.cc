@@ -53,268 +53,260 @@ GroupClient::GroupClient(MyOption opt, int id) {
     client_id_ = id;
     ip_ = opt.ipaddr;
     port_ = opt.ipport;
+    window_ = opt.window;
+    notify_ = ParseNotify(opt.notify);
 
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
-    assert(device != nullptr);
-    rdma_device_ = std::move(device);
-
-    auto [context, status] = rdma_device_->open();
-    if(status != Status::Ok) {
-        fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
-    }
-    local_buf_ = new uint8_t[MAX_REQUEST + RING_HEADER];
-    context->register_write_buf(local_buf_, MAX_REQUEST + RING_HEADER);
-    rdma_context_ = std::move(context);
+    lanes_.Open(opt);
 }
 
 void GroupClient::Connect() {
-    // connect the rdma channel to a client rdma channel
-    auto socket = Socket::make_socket(CLIENT, port_, ip_);
-    int commu_fd = socket->GetFirst();
-    // exchange rdma context
-    if(rdma_context_->default_connect(commu_fd) == -1) {
-        exit(-1);
-    }
-    // fprintf(stderr, "connect to server\n");
-    local_buf_ = (uint8_t *)rdma_context_->get_write_buf();
-    assert(local_buf_ != nullptr);
-    // init the header
-    uint32_t * header = (uint32_t *) local_buf_;
-    *header = CLIENT_DONE;
+    // connect the rdma channels to the clerks, one per lane
+    lanes_.Connect(ip_, port_, window_, notify_);
 }
 
-void GroupClient::SendWrite(const char * key, const char * val, Operation op) {
-    uint16_t key_len = strlen(key);
-    uint16_t val_len = strlen(val);
-    uint16_t total_len = sizeof(Request) + key_len + val_len;
+void GroupClient::AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t val_len = val.size();
+    uint32_t total_len = sizeof(Request) + key_len + val_len;
+    if(total_len > RING_SLOT_SIZE) { // a record takes a request slot at most
+        if(cb) cb(false, nullptr);
+        return ;
+    }
+    ClientRing & ring = lanes_[lanes_.Of(key.data(), key_len)].ring;
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring.Next();
     request->op = op;
     request->key_size = key_len;
     request->val_size = val_len;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, key_len);
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request) + key_len, val, val_len);
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+    memcpy((uint8_t *)request + sizeof(Request) + key_len, val.data(), val_len);
 
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-    
-    // wait for the clerk side to update this field
-    uint32_t * header = (uint32_t *) local_buf_;
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
+    // write the record to clerk's request ring
+    ring.Submit(total_len, ReplyHandler(cb, false));
 
     return ;
 }
 
-bool GroupClient::SendGet(const char * key, std::string * val) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void GroupClient::AsyncGet(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
+    ClientRing & ring = lanes_[lanes_.Of(key.data(), key_len)].ring;
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring.Next();
     request->op = GET;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
-
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-
-    // wait for the clerk side to update this field
-    uint32_t * header = (uint32_t *) local_buf_;
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
-
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        *val = std::move(std::string(reply->value, reply->val_size));
-        return true;
-    } else {
-        return false;
-    }
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+
+    // write the record to clerk's request ring
+    ring.Submit(total_len, ReplyHandler(cb, true));
 }
 
-bool GroupClient::SendDelete(const char * key) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void GroupClient::AsyncDelete(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
+    ClientRing & ring = lanes_[lanes_.Of(key.data(), key_len)].ring;
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring.Next();
     request->op = DELETE;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
-
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-
-    // wait for the clerk side to update this field
-    uint32_t * header = (uint32_t *) local_buf_;
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
-
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        return true;
-    } else {
-        return false;
-    }
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+
+    // write the record to clerk's request ring
+    ring.Submit(total_len, ReplyHandler(cb, false));
 }
 
-void GroupClient::SendClose() {
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
-    uint16_t total_len = sizeof(Request);
-    request->op = CLOSE;
-    request->key_size = 0;
-    request->val_size = 0;
+void GroupClient::AsyncScan(std::string_view start, std::string_view end, int limit, ScanCallback cb) {
+    // the database is shared by all clerks, any lane serves a scan
+    ScanEntries entries;
+    std::vector<int> large;
+    bool ok = ScanPages(lanes_[0].ring, start, end, limit, &entries, &large) && large.empty();
+    cb(ok, ok ? &entries : nullptr);
+}
 
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+void GroupClient::SendClose() {
+    // write close requests to the request rings of all clerks
+    for(int l = 0; l < lanes_.Size(); l++) {
+        Request * request = lanes_[l].ring.Next();
+        uint32_t total_len = sizeof(Request);
+        request->op = CLOSE;
+        request->key_size = 0;
+        request->val_size = 0;
+        lanes_[l].ring.Submit(total_len);
+    }
 
-    // send out 
-    rdma_context_->post_send(nullptr, MAX_REQUEST, 0);
-    rdma_context_->poll_one_completion(true);
+    // wait for the clerks to acknowledge
+    for(int l = 0; l < lanes_.Size(); l++) {
+        lanes_[l].ring.Drain();
+        lanes_[l].context->drain_completions();
+    }
 }
 
 
-GroupClerk::GroupClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, ringlog::RingLog * log, int id) {
+GroupClerk::GroupClerk(std::unique_ptr<RDMAContext> ctx, std::unique_ptr<uint8_t[]> mem, DBType * db, 
+                       ringlog::RingLog * log, int id, Notify notify) {
+    mem_ = std::move(mem);
     context_ = std::move(ctx);
     clerk_id_ = id;
     db_ = db;
     log_ = log;
 
-    local_buf_ = (uint8_t *)context_->get_write_buf();
+    ring_.Init(context_.get(), notify);
 }
 
-void GroupClerk::Run(std::unique_ptr<GroupClerk> clk, std::unique_ptr<uint8_t[]> buf) {
-    while(true) {
-        // wait for the clerk side to update this field
-        uint32_t * header = (uint32_t *) clk->local_buf_;
-        while(*header != CLIENT_DONE) asm("nop");
-        *header = CLERK_DONE; // update this for next clerk write
+int GroupClerk::Poll() {
+    int served = 0;
+    Request * request;
+    while(served < RING_SLOTS && (request = ring_.Peek()) != nullptr) {
+        if(!Serve(request)) {
+            return -1;
+        }
+        served += 1;
+    }
+    // publish the replies of this batch
+    ring_.Flush();
+    return served;
+}
 
-        Request * request = (Request *)(clk->local_buf_ + RING_HEADER);
-        uint32_t total_len = request->key_size + request->val_size;
-        RequestReply * reply = (RequestReply *)(clk->local_buf_ + RING_HEADER);
-        
-        if(request->op == CLOSE) {
-            clk->context_->post_recv(MAX_REQUEST, 0);
-            clk->context_->poll_one_completion(false);
-            return ;
-        } else if(request->op == GET) {
-            std::string key((char *)request + sizeof(Request), request->key_size);
-            std::string value;
-            if(clk->db_->Get(key, &value)) {
-                reply->status = RequestStatus::OK;
-                reply->val_size = value.size();
-                memcpy(reply->value, value.c_str(), reply->val_size);
-            } else {
-                reply->status = RequestStatus::NOTFOUND;
-            }
-        } else { // requests that should be logged
-            Writer w(&global_mutex);
-            w.request = request;
-            MutexLock l(&global_mutex);
-            writers_queue.push_back(&w);
-            while (!w.done && &w != writers_queue.front()) {
-                w.cv.Wait();
-            }
-            if (w.done) {
-                reply->status = RequestStatus::OK;
-                reply->val_size = 0;
-                goto send_reply;
-            }
-            
-            // wait for followers
-            global_mutex.unlock();
-            usleep(5);
-            global_mutex.lock();
-
-            Writer* last_writer;
-            BuildBatchGroup(batch, &last_writer);
-
-            // batch write the request into storage
-            global_mutex.unlock();
-            clk->db_->PutBatch(batch.keys, batch.metas, batch.buffer, batch.batch_length);
-            clk->log_->PutBatch((char *)batch.buffer, batch.batch_length);
-            global_mutex.lock();
-
-            // mark all followers to be done
-            while (true) {
-                Writer* ready = writers_queue.front();
-                writers_queue.pop_front();
-                if (ready != &w) { // notify the waiting request
-                    ready->done = true;
-                    ready->cv.Signal();
-                }
-                if (ready == last_writer) break;
-            }
-
-            // notify new head of the writer queue
-            if (!writers_queue.empty()) {
-                writers_queue.front()->cv.Signal();
-            }
+// apply a get or a logged request from any clerk or datagram worker, logged requests are group committed
+void ServeRequest(Request * request, RequestReply * reply, DBType * db, RingLog * log) {
+    if(request->op == GET) {
+        std::string key((char *)request + sizeof(Request), request->key_size);
+        std::string value;
+        if(db->Get(key, &value)) {
+            reply->status = RequestStatus::OK;
+            reply->val_size = value.size();
+            memcpy(reply->value, value.c_str(), reply->val_size);
+        } else {
+            reply->status = RequestStatus::NOTFOUND;
+            reply->val_size = 0;
+        }
+        return ;
+    }
+    if(request->op == SCAN) {
+        ServeScan(db, request, reply, RING_SLOT_SIZE - sizeof(RequestReply));
+        return ;
+    }
+
+    // requests that should be logged
+    Writer w(&global_mutex);
+    w.request = request;
+    MutexLock l(&global_mutex);
+    writers_queue.push_back(&w);
+    while (!w.done && &w != writers_queue.front()) {
+        w.cv.Wait();
+    }
+    reply->status = RequestStatus::OK;
+    reply->val_size = 0;
+    if (w.done) {
+        return ;
+    }
+    
+    // wait for followers
+    global_mutex.unlock();
+    usleep(5);
+    global_mutex.lock();
+
+    Writer* last_writer;
+    BuildBatchGroup(batch, &last_writer);
+
+    // batch write the request into storage
+    global_mutex.unlock();
+    db->PutBatch(batch.keys, batch.metas, batch.buffer, batch.batch_length);
+    log->PutBatch((char *)batch.buffer, batch.batch_length);
+    global_mutex.lock();
+
+    // mark all followers to be done
+    while (true) {
+        Writer* ready = writers_queue.front();
+        writers_queue.pop_front();
+        if (ready != &w) { // notify the waiting request
+            ready->done = true;
+            ready->cv.Signal();
         }
+        if (ready == last_writer) break;
+    }
+
+    // notify new head of the writer queue
+    if (!writers_queue.empty()) {
+        writers_queue.front()->cv.Signal();
+    }
+}
 
-        send_reply:
-        // write the request reply to client
-        clk->context_->post_write(nullptr, sizeof(RequestReply) + reply->val_size, RING_HEADER, RING_HEADER, false);
-        // write the clerk done messgae to client
-        clk->context_->post_write(nullptr, sizeof(uint32_t), 0, 0, true); // write to client write_buf[0:4]
-        clk->context_->poll_one_completion(true);
+bool GroupClerk::Serve(Request * request) {
+    RequestReply * reply = ring_.Reply();
+    assert(sizeof(Request) + request->key_size <= ring_.Length());
+    
+    if(request->op == CLOSE) {
+        reply->status = RequestStatus::OK;
+        reply->val_size = 0;
+        ring_.Done(sizeof(RequestReply));
+        ring_.Flush();
+        context_->drain_completions();
+        return false;
     }
+    ServeRequest(request, reply, db_, log_);
+
+    // stage the request reply to client, it is published with the rest of this batch
+    ring_.Done(sizeof(RequestReply) + reply->val_size);
+    return true;
 }
 
+void GroupUdHandler::Serve(Request * request, RequestReply * reply) {
+    if(request->op == CLOSE) {
+        reply->status = RequestStatus::OK;
+        reply->val_size = 0;
+        return ;
+    }
+    ServeRequest(request, reply, db_, log_);
+}
 
 GroupServer::GroupServer(MyOption opt, DBType * db) {
     port_ = opt.ipport;
+    notify_ = ParseNotify(opt.notify);
     db_ = db;
     log_ = new RingLog(opt.dir, opt.db_type, opt.sync);
-
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
-    assert(device != nullptr);
-    rdma_device_ = std::move(device); 
+    InitScheduler(opt);
+    InitDatagrams(opt);
+    InitDevices(opt);
 }
 
 void GroupServer::Listen() {
-    // wait for the first client to connect
-    auto socket = Socket::make_socket(SERVER, port_);
-    int commu_fd = socket->GetFirst();
-    
-    // a infinite loop waiting for new connection
-    do {
+    if(datagrams_) {
+        ServeDatagrams(port_, [this]() {
+            return std::make_unique<GroupUdHandler>(db_, log_);
+        });
+        return ;
+    }
+
+    // set up every client connection on a helper thread, so that clients connect in parallel
+    Acceptor acceptor(port_, [this](int commu_fd) {
         // create a rdma context
-        auto [context, status] = rdma_device_->open();
+        auto [context, status] = devices_[NextDevice()]->open();
         if(status != Status::Ok) {
             fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
+            close(commu_fd);
+            return ;
         }
         std::unique_ptr<uint8_t[]> mem;
-        mem.reset(new uint8_t[MAX_REQUEST + RING_HEADER]);
-        context->register_write_buf(mem.get(), MAX_REQUEST + RING_HEADER);
+        mem.reset(new uint8_t[MAX_REQUEST]);
+        context->register_write_buf(mem.get(), MAX_REQUEST);
 
-        // exchange rdma context
-        if(context->default_connect(commu_fd) == -1) {
-            exit(-1);
+        // exchange rdma context, a failed client does not affect the others
+        if(context->default_connect(commu_fd) != 0) {
+            close(commu_fd);
+            return ;
         }
         
-        // create a new thread to accept client request
-        std::unique_ptr<GroupClerk> new_clerk = std::make_unique<GroupClerk>(std::move(context), db_, log_, clerk_num_++);
-        std::thread th(&(GroupClerk::Run), std::move(new_clerk), std::move(mem));
-        th.detach();
+        // serve the client requests
+        StartClerk(std::make_unique<GroupClerk>(std::move(context), std::move(mem), db_, log_, clerk_num_++, notify_));
         // fprintf(stderr, "Make a clerk serving...\n");
-
-        // wait for a client to connect
-        commu_fd = socket->NewChannel(port_);
-    } while (true);
+    });
+    acceptor.Run();
 }
 
 } // namespace frontend
\ No newline at end of file
@@ -14,25 +14,50 @@ using namespace ringlog;
 
 namespace frontend {
 
-class GroupClerk {
+class GroupClerk : public Clerk {
 public: 
-    GroupClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, RingLog * log, int id);
+    GroupClerk(std::unique_ptr<RDMAContext> ctx, std::unique_ptr<uint8_t[]> mem, DBType * db, RingLog * log, int id, Notify notify);
 
     ~GroupClerk() {
         fprintf(stderr,"closing a clerk\n");
     }
 
-    static void Run(std::unique_ptr<GroupClerk> clk, std::unique_ptr<uint8_t[]> buf);
+    int Poll();
+
+    void Idle() {
+        ring_.Idle();
+    }
+
+    const RDMAUtil::PollStats & Stats() const {
+        return ring_.Stats();
+    }
 
 private:
+    // serve a single request, return false for the close request
+    bool Serve(Request * request);
+
+private:
+    std::unique_ptr<uint8_t[]> mem_; // the registered write buffer, outlives context_
     std::unique_ptr<RDMAContext> context_;
     DBType * db_;
     RingLog * log_;
-    uint8_t * local_buf_;
+    ClerkRing ring_;
 
     int clerk_id_;
 };
 
+/* GroupUdHandler: serves datagram clients, their writes join the same group commits as the clerks' */
+class GroupUdHandler : public UdHandler {
+public:
+    GroupUdHandler(DBType * db, RingLog * log) : db_(db), log_(log) {}
+
+    void Serve(Request * request, RequestReply * reply);
+
+private:
+    DBType * db_;
+    RingLog * log_;
+};
+
 class GroupServer : Server {
 public:
     GroupServer(MyOption opt, DBType * db);
@@ -41,11 +66,11 @@ public:
     void Listen();
 
 private:
-    std::unique_ptr<RDMADevice> rdma_device_;
     RingLog * log_;
     DBType * db_;
-    int clerk_num_;
+    std::atomic<int> clerk_num_{0}; // connections set up by the acceptor helpers
     int port_;
+    Notify notify_;
 };
 
 } // namespace frontend
\ No newline at end of file
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cs.h"
+
+namespace frontend {
+
+/*
+ * ClientLanes: the connections a client stripes its requests over, MyOption::lanes of them spread
+ * over the devices of MyOption::rdma_device in turn. Each lane is a queue pair with a request ring
+ * of its own and is served by a clerk of its own, so lanes are processed in parallel by the NICs on
+ * both ends. A key always maps to the same lane, which keeps the requests on a key in order.
+ */
+class ClientLanes {
+public:
+    struct Lane {
+        std::unique_ptr<RDMAUtil::RDMAContext> context;
+        std::unique_ptr<uint8_t[]> local_buf; // local write buffer
+        ClientRing ring;                      // requests and replies in the send buffer
+    };
+
+    // open the queue pairs of all lanes, each with a write buffer of `write_buf_size` bytes
+    void Open(const MyOption & opt, size_t write_buf_size = MAX_REQUEST) {
+        int lanes = std::max(1, opt.lanes);
+        for(int i = 0; i < std::min(lanes, DeviceCount(opt)); i++) {
+            auto device = MakeDevice(opt, i);
+            assert(device != nullptr);
+            devices_.push_back(std::move(device));
+        }
+
+        for(int i = 0; i < lanes; i++) {
+            auto [context, status] = devices_[i % devices_.size()]->open();
+            if(status != RDMAUtil::Status::Ok) {
+                fprintf(stderr, "%s\n", RDMAUtil::decode_rdma_status(status).c_str());
+            }
+            auto lane = std::make_unique<Lane>();
+            lane->local_buf.reset(new uint8_t[write_buf_size]);
+            context->register_write_buf(lane->local_buf.get(), write_buf_size);
+            lane->context = std::move(context);
+            lanes_.push_back(std::move(lane));
+        }
+    }
+
+    // connect every lane to the server, exit on failure
+    void Connect(const std::string & ip, int port, int window, Notify notify) {
+        for(auto & lane : lanes_) {
+            auto socket = SocketUtil::Socket::make_socket(SocketUtil::CLIENT, port, ip);
+            int commu_fd = socket->GetFirst();
+            // exchange rdma context
+            if(lane->context->default_connect(commu_fd) == -1) {
+                exit(-1);
+            }
+            lane->ring.Init(lane->context.get(), window, notify);
+        }
+    }
+
+    inline int Size() const {
+        return lanes_.size();
+    }
+
+    inline Lane & operator[](int i) {
+        return *lanes_[i];
+    }
+
+    // the lane requests on `key` go to
+    inline int Of(const char * key, size_t len) const {
+        if(lanes_.size() == 1) {
+            return 0;
+        }
+        return std::hash<std::string_view>()(std::string_view(key, len)) % lanes_.size();
+    }
+
+    int Poll() {
+        int completed = 0;
+        for(auto & lane : lanes_) {
+            completed += lane->ring.Poll();
+        }
+        return completed;
+    }
+
+    void Drain() {
+        for(auto & lane : lanes_) {
+            lane->ring.Drain();
+        }
+    }
+
+    // idle time of all lanes together
+    const RDMAUtil::PollStats & Stats() const {
+        stats_ = RDMAUtil::PollStats{};
+        for(auto & lane : lanes_) {
+            const RDMAUtil::PollStats & s = lane->ring.Stats();
+            for(int p = 0; p < RDMAUtil::POLL_PHASES; p++) {
+                stats_.ns[p] += s.ns[p];
+            }
+            stats_.wakeups += s.wakeups;
+        }
+        return stats_;
+    }
+
+private:
+    std::vector<std::unique_ptr<RDMAUtil::RDMADevice>> devices_;
+    std::vector<std::unique_ptr<Lane>> lanes_;
+    mutable RDMAUtil::PollStats stats_;
+};
+
+} // namespace frontend
@@ -12,9 +12,11 @@ PMemClient::PMemClient(MyOption opt, int id) {
     client_id_ = id;
     ip_ = opt.ipaddr;
     port_ = opt.ipport;
+    window_ = opt.window;
+    notify_ = ParseNotify(opt.notify);
     buf_head_ = 0;
 
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
+    auto device = MakeDevice(opt);
     assert(device != nullptr);
     rdma_device_ = std::move(device);
 
@@ -22,8 +24,8 @@ PMemClient::PMemClient(MyOption opt, int id) {
     if(status != Status::Ok) {
         fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
     }
-    local_buf_ = new uint8_t[MAX_REQUEST + RING_HEADER];
-    context->register_write_buf(local_buf_, MAX_REQUEST + RING_HEADER);
+    local_buf_ = new uint8_t[MAX_REQUEST];
+    context->register_write_buf(local_buf_, MAX_REQUEST);
     rdma_context_ = std::move(context);
 }
 
@@ -36,20 +38,20 @@ void PMemClient::Connect() {
         exit(-1);
     }
     // fprintf(stderr, "connect to server\n");
-    local_buf_ = (uint8_t *)rdma_context_->get_write_buf();
-    assert(local_buf_ != nullptr);
-    // init the header
-    uint32_t * header = (uint32_t *) local_buf_;
-    *header = CLIENT_DONE;
+    ring_.Init(rdma_context_.get(), window_, notify_);
 }
 
-void PMemClient::SendWrite(const char * key, const char * val, Operation op) {
-    uint16_t key_len = strlen(key);
-    uint16_t val_len = strlen(val);
-    uint16_t total_len = sizeof(Request) + key_len + val_len;
+void PMemClient::AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t val_len = val.size();
+    uint32_t total_len = sizeof(Request) + key_len + val_len;
+    if(total_len > RING_SLOT_SIZE) { // a record takes a request slot at most
+        if(cb) cb(false, nullptr);
+        return ;
+    }
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring_.Next();
     if(buf_head_ + total_len >= PMEM_BUFSIZE) { // a ring buffer that store data persistently
         buf_head_ = 0;
     } 
@@ -57,108 +59,76 @@ void PMemClient::SendWrite(const char * key, const char * val, Operation op) {
     request->op = op;
     request->key_size = key_len;
     request->val_size = val_len;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, key_len);
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request) + key_len, val, val_len);
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+    memcpy((uint8_t *)request + sizeof(Request) + key_len, val.data(), val_len);
 
-    // write meta data to clerk's send buffer
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
     // write record data to clerk's write buffer
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, buf_head_, false);
-    // write completed: signaled
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    rdma_context_->batch_write1(nullptr, total_len, ring_.SlotOffset(), buf_head_, false);
+    // write the record to clerk's request ring, both go out with a single doorbell
+    ring_.Submit(total_len, ReplyHandler(cb, false));
     buf_head_ += total_len;
-    
-    uint32_t * header = (uint32_t *) local_buf_;
-    // wait for the clerk side to update this field
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
 
     return ;
 }
 
-bool PMemClient::SendGet(const char * key, std::string * val) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void PMemClient::AsyncGet(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring_.Next();
     request->op = GET;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
-
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-
-    // wait for the clerk side to update this field
-    uint32_t * header = (uint32_t *) local_buf_;
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
-
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        *val = std::move(std::string(reply->value, reply->val_size));
-        return true;
-    } else {
-        return false;
-    }
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+
+    // write the record to clerk's request ring
+    ring_.Submit(total_len, ReplyHandler(cb, true));
 }
 
-bool PMemClient::SendDelete(const char * key) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void PMemClient::AsyncDelete(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = ring_.Next();
     request->op = DELETE;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
-
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-
-    // wait for the clerk side to update this field
-    uint32_t * header = (uint32_t *) local_buf_;
-    while(*header != CLERK_DONE) asm("nop");
-    *header = CLIENT_DONE; // update this for next client write
-
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        return true;
-    } else {
-        return false;
-    }
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+
+    // write the record to clerk's request ring
+    ring_.Submit(total_len, ReplyHandler(cb, false));
+}
+
+void PMemClient::AsyncScan(std::string_view start, std::string_view end, int limit, ScanCallback cb) {
+    ScanEntries entries;
+    std::vector<int> large;
+    bool ok = ScanPages(ring_, start, end, limit, &entries, &large) && large.empty();
+    cb(ok, ok ? &entries : nullptr);
 }
 
 void PMemClient::SendClose() {
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
-    uint16_t total_len = sizeof(Request);
+    Request * request = ring_.Next();
+    uint32_t total_len = sizeof(Request);
     request->op = CLOSE;
     request->key_size = 0;
     request->val_size = 0;
 
-    // write the record to the remote: use buffer[RING_HEADER:]
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    // write the record to clerk's request ring
+    ring_.Submit(total_len);
 
-    // send out 
-    rdma_context_->post_send(nullptr, MAX_REQUEST, 0);
-    rdma_context_->poll_one_completion(true);
+    // wait for the clerk to acknowledge
+    ring_.Drain();
+    rdma_context_->drain_completions();
 }
 
-PMemClerk::PMemClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, int id) {
+PMemClerk::PMemClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, int id, Notify notify) {
     context_ = std::move(ctx);
     clerk_id_ = id;
     db_ = db;
 
-    local_buf_ = (uint8_t *)context_->get_send_buf();
+    ring_.Init(context_.get(), notify);
 }
 
 PMemClerk::~PMemClerk() {
@@ -166,120 +136,134 @@ PMemClerk::~PMemClerk() {
     fprintf(stderr,"closing a clerk\n");
 }
 
-void PMemClerk::Run(std::unique_ptr<PMemClerk> clk) {
-     while(true) {
-        // wait for the clerk side to update this field
-        uint32_t * header = (uint32_t *) clk->local_buf_;
-        while(*header != CLIENT_DONE) asm("nop");
-        *header = CLERK_DONE; // update this for next clerk write
-
-        Request * request = (Request *)(clk->local_buf_ + RING_HEADER);
-        RequestReply * reply = (RequestReply *)(clk->local_buf_ + RING_HEADER);
-        uint32_t key_size = request->key_size;
-        switch(request->op) {
-            case UPDATE: // intended passdown
-            case PUT: {
-                std::string key((char *)request + sizeof(Request), key_size);
-                std::string val((char *)request + sizeof(Request) + key_size, request->val_size);
-                if(clk->db_->Put(key, val)) {
-                    reply->status = RequestStatus::OK;
-                } else {
-                    reply->status = RequestStatus::ERROR;
-                }
-                reply->val_size = 0;
-                break;
-            }
-            case GET: {
-                std::string key((char *)request + sizeof(Request), key_size);
-                std::string value;
-                if(clk->db_->Get(key, &value)) {
-                    reply->status = RequestStatus::OK;
-                    reply->val_size = value.size();
-                    memcpy(reply->value, value.c_str(), reply->val_size);
-                } else {
-                    reply->status = RequestStatus::NOTFOUND;
-                    reply->val_size = 0;
-                }
-                break;
+int PMemClerk::Poll() {
+    int served = 0;
+    Request * request;
+    while(served < RING_SLOTS && (request = ring_.Peek()) != nullptr) {
+        if(!Serve(request)) {
+            return -1;
+        }
+        served += 1;
+    }
+    // publish the replies of this batch
+    ring_.Flush();
+    return served;
+}
+
+bool PMemClerk::Serve(Request * request) {
+    RequestReply * reply = ring_.Reply();
+    assert(sizeof(Request) + request->key_size <= ring_.Length());
+    uint32_t key_size = request->key_size;
+    switch(request->op) {
+        case UPDATE: // intended passdown
+        case PUT: {
+            std::string key((char *)request + sizeof(Request), key_size);
+            std::string val((char *)request + sizeof(Request) + key_size, request->val_size);
+            if(db_->Put(key, val)) {
+                reply->status = RequestStatus::OK;
+            } else {
+                reply->status = RequestStatus::ERROR;
             }
-            case DELETE: {
-                std::string key((char *)request + sizeof(Request), key_size);
-                std::string value;
-                if(clk->db_->Delete(key)) {
-                    reply->status = RequestStatus::OK;
-                } else {
-                    reply->status = RequestStatus::NOTFOUND;
-                }
+            reply->val_size = 0;
+            break;
+        }
+        case GET: {
+            std::string key((char *)request + sizeof(Request), key_size);
+            std::string value;
+            if(db_->Get(key, &value)) {
+                reply->status = RequestStatus::OK;
+                reply->val_size = value.size();
+                memcpy(reply->value, value.c_str(), reply->val_size);
+            } else {
+                reply->status = RequestStatus::NOTFOUND;
                 reply->val_size = 0;
-                break;
-            }
-            case CLOSE: {
-                clk->context_->post_recv(MAX_REQUEST, 0);
-                clk->context_->poll_one_completion(false);
-                return ;
             }
-            default: {
-                fprintf(stderr, "Error operation at Clerk %d\n", clk->clerk_id_);
-                exit(-1);
+            break;
+        }
+        case DELETE: {
+            std::string key((char *)request + sizeof(Request), key_size);
+            std::string value;
+            if(db_->Delete(key)) {
+                reply->status = RequestStatus::OK;
+            } else {
+                reply->status = RequestStatus::NOTFOUND;
             }
+            reply->val_size = 0;
+            break;
+        }
+        case SCAN: {
+            ServeScan(db_, request, reply, RING_SLOT_SIZE - sizeof(RequestReply));
+            break;
+        }
+        case CLOSE: {
+            reply->status = RequestStatus::OK;
+            reply->val_size = 0;
+            ring_.Done(sizeof(RequestReply));
+            ring_.Flush();
+            context_->drain_completions();
+            return false;
+        }
+        default: {
+            fprintf(stderr, "Error operation at Clerk %d\n", clerk_id_);
+            exit(-1);
         }
-
-        // write the request reply to client
-        clk->context_->post_write1(nullptr, sizeof(RequestReply) + reply->val_size, RING_HEADER, RING_HEADER, false);
-        // write the clerk done messgae to client
-        clk->context_->post_write1(nullptr, sizeof(uint32_t), 0, 0, true); // write to client write_buf[0:4]
-        clk->context_->poll_one_completion(true);
     }
+
+    // stage the request reply to client, it is published with the rest of this batch
+    ring_.Done(sizeof(RequestReply) + reply->val_size);
+    return true;
 }
 
 
 PMemServer::PMemServer(MyOption opt, DBType * db) {
     port_ = opt.ipport;
+    notify_ = ParseNotify(opt.notify);
     db_ = db;
     pmem_device_ = opt.pmem;
-
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
-    assert(device != nullptr);
-    rdma_device_ = std::move(device); 
+    if(opt.rpc == "ud") { // clients write to the device with RDMA, which needs a connection each
+        fprintf(stderr, "pmemaccess does not support datagram rpc\n");
+        exit(-1);
+    }
+    InitScheduler(opt);
+    InitDevices(opt);
 }
 
 void PMemServer::Listen() {
-    // wait for the first client to connect
-    auto socket = Socket::make_socket(SERVER, port_);
-    int commu_fd = socket->GetFirst();
     int dax_fd = open(pmem_device_.c_str(), O_RDWR);
     assert(dax_fd > 3);
     
-    // a infinite loop waiting for new connection
-    do {
+    // set up every client connection on a helper thread, so that clients connect in parallel
+    Acceptor acceptor(port_, [this, dax_fd](int commu_fd) {
         // create a rdma context
-        auto [context, status] = rdma_device_->open();
+        auto [context, status] = devices_[NextDevice()]->open();
         if(status != Status::Ok) {
             fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
+            close(commu_fd);
+            return ;
         }
 
+        int id = clerk_num_++;
         char * pmemaddr = (char *)mmap(0, PMEM_BUFSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dax_fd, 
-                                        clerk_num_ * PMEM_BUFSIZE);
+                                        (off_t)id * PMEM_BUFSIZE);
         if(pmemaddr == NULL || (uint64_t)pmemaddr == 0xffffffffffffffff) {
             fprintf(stderr, "mmap pmem error\n");
             exit(-1);
         }
         context->register_write_buf(pmemaddr, PMEM_BUFSIZE);
 
-        // exchange rdma context
-        if(context->default_connect(commu_fd) == -1) {
-            exit(-1);
+        // exchange rdma context, a failed client does not affect the others
+        if(context->default_connect(commu_fd) != 0) {
+            context.reset(); // its write buffer is deregistered before the window goes
+            munmap(pmemaddr, PMEM_BUFSIZE);
+            close(commu_fd);
+            return ;
         }
         
         // create a new thread to accept client request
-        std::unique_ptr<PMemClerk> new_clerk = std::make_unique<PMemClerk>(std::move(context), db_, clerk_num_++);
-        std::thread th(&(PMemClerk::Run), std::move(new_clerk));
-        th.detach();
+        StartClerk(std::make_unique<PMemClerk>(std::move(context), db_, id, notify_));
         // fprintf(stderr, "Make a clerk serving...\n");
-
-        // wait for a client to connect
-        commu_fd = socket->NewChannel(port_);
-    } while (true);
+    });
+    acceptor.Run();
 }
 
 } // namespace frontend
\ No newline at end of file
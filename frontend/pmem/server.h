@@ -12,20 +12,32 @@ using namespace SocketUtil;
 
 namespace frontend {
 
-class PMemClerk {
+class PMemClerk : public Clerk {
 public: 
-    PMemClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, int id);
+    PMemClerk(std::unique_ptr<RDMAContext> ctx, DBType * db, int id, Notify notify);
 
     ~PMemClerk();
 
-    static void Run(std::unique_ptr<PMemClerk> clk);
+    int Poll();
+
+    void Idle() {
+        ring_.Idle();
+    }
+
+    const RDMAUtil::PollStats & Stats() const {
+        return ring_.Stats();
+    }
+
+private:
+    // serve a single request, return false for the close request
+    bool Serve(Request * request);
 
 private:
     std::unique_ptr<RDMAContext> context_;
     DBType * db_;
     int clerk_id_;
 
-    uint8_t * local_buf_;
+    ClerkRing ring_;
 };
 
 class PMemServer : Server {
@@ -35,11 +47,11 @@ public:
     void Listen();
 
 private:
-    std::unique_ptr<RDMADevice> rdma_device_;
 
     DBType * db_;
-    int clerk_num_;
+    std::atomic<int> clerk_num_{0}; // connections set up by the acceptor helpers
     int port_;
+    Notify notify_;
     std::string pmem_device_;
 };
 
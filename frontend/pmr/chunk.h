@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "index.h"
+#include "../cs.h"
+
+namespace frontend {
+
+/*
+ * ChunkHeader: the first CHUNK_HEADER bytes of a chunk, in the PMR buffer and in the log alike, so
+ * that a chunk tells by itself which of its records were acknowledged. The clerk extends `commit`
+ * with a single store after each record it made visible, before it replies. A chunk image in the
+ * log takes a slot of MAX_ASYNC_SIZE bytes, and a chunk whose image was written is freed with its
+ * magic cleared, so the PMR buffer only holds chunks the log may lack. The epoch changes at every
+ * recovery, so that log slots left from before it are not taken for new ones.
+ */
+const uint32_t CHUNK_MAGIC = 0x434b4d50; // "PMKC"
+
+struct ChunkHeader {
+    uint32_t magic;
+    uint32_t epoch;
+    uint64_t seq;                 // chunks taken later have larger ones, across restarts too
+    std::atomic<uint64_t> commit; // bytes of acknowledged records in the low half, their checksum in the high half
+};
+static_assert(sizeof(ChunkHeader) <= CHUNK_HEADER, "the chunk header exceeds its room");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "a commit is a single store");
+
+inline uint64_t MakeCommit(uint32_t length, uint32_t checksum) {
+    return (uint64_t)checksum << 32 | length;
+}
+
+inline uint32_t CommitLength(uint64_t commit) {
+    return (uint32_t)commit;
+}
+
+inline uint32_t CommitChecksum(uint64_t commit) {
+    return commit >> 32;
+}
+
+// start an empty chunk, the magic goes last
+inline void StartChunk(ChunkHeader * header, uint64_t seq, uint32_t epoch) {
+    header->epoch = epoch;
+    header->seq = seq;
+    header->commit.store(MakeCommit(0, Checksum(nullptr, 0)), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = CHUNK_MAGIC;
+}
+
+// acknowledge the record at the end of the committed ones
+inline void CommitRecord(ChunkHeader * header, const Request * record, uint32_t length) {
+    uint64_t commit = header->commit.load(std::memory_order_relaxed);
+    uint32_t checksum = Checksum(record, length, CommitChecksum(commit));
+    header->commit.store(MakeCommit(CommitLength(commit) + length, checksum), std::memory_order_release);
+}
+
+/*
+ * The acknowledged records of a chunk image (header and records), as PutBatch takes them: keys and
+ * metas whose offsets are relative to the records. False if the image is torn or corrupt.
+ */
+inline bool ParseChunk(const uint8_t * image, size_t size, std::vector<std::string> * keys, std::vector<Meta> * metas) {
+    const ChunkHeader * header = (const ChunkHeader *)image;
+    if(size < CHUNK_HEADER || header->magic != CHUNK_MAGIC) {
+        return false;
+    }
+    uint64_t commit = header->commit.load(std::memory_order_acquire);
+    uint32_t length = CommitLength(commit);
+    const uint8_t * records = image + CHUNK_HEADER;
+    if(length > CHUNK_SPACE || CHUNK_HEADER + length > size || Checksum(records, length) != CommitChecksum(commit)) {
+        return false;
+    }
+
+    uint32_t pos = 0;
+    while(pos < length) {
+        const Request * record = (const Request *)(records + pos);
+        if(pos + sizeof(Request) > length || pos + ((Request *)record)->Length() > length) {
+            return false;
+        }
+        keys->emplace_back(record->keyvalue, record->key_size);
+        metas->emplace_back(0, pos + sizeof(Request), record->key_size, record->val_size);
+        pos += ((Request *)record)->Length();
+    }
+    return true;
+}
+
+} // namespace frontend
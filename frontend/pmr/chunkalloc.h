@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace frontend {
+
+/*
+ * ChunkAllocator: hands out the chunks of the PMR buffer, and those of a spill pool in host DRAM once
+ * the PMR chunks run out. Spilled chunks come after the PMR ones, so a chunk id tells its tier. Free
+ * chunks of a tier sit on a lock-free stack whose head carries a tag against ABA, so taking and
+ * freeing one is a single CAS. A clerk that finds no free chunk in either tier sleeps until the uring
+ * thread frees one. The counters are kept as chunks move, so usage is read in O(1).
+ */
+class ChunkAllocator {
+public:
+    static const uint32_t NIL   = UINT32_MAX;     // the end of a stack
+    static const uint32_t TAKEN = UINT32_MAX - 1; // the link of a chunk off its stack
+
+    enum Tier { PMR = 0, SPILL = 1 };
+
+    // spilled chunks take ids from `spill_base` on, past every chunk of the buffer even if fewer are used
+    ChunkAllocator(uint32_t chunks, uint32_t spill_chunks = 0, uint32_t spill_base = 0) {
+        tiers_[PMR].Init(0, chunks);
+        tiers_[SPILL].Init(std::max(chunks, spill_base), spill_chunks);
+    }
+
+    // a free chunk of `tier`, NIL if there is none
+    uint32_t TryTake(Tier tier = PMR) {
+        Stack & s = tiers_[tier];
+        uint64_t head = s.head.load(std::memory_order_acquire);
+        while(Index(head) != NIL) {
+            // a stale link fails the CAS, as the tag moved on
+            uint32_t next = s.next[Index(head)].load(std::memory_order_relaxed);
+            if(s.head.compare_exchange_weak(head, Pack(next, Tag(head) + 1), std::memory_order_acq_rel,
+                                            std::memory_order_acquire)) {
+                s.next[Index(head)].store(TAKEN, std::memory_order_relaxed);
+                s.free.fetch_sub(1, std::memory_order_relaxed);
+                return s.base + Index(head);
+            }
+        }
+        return NIL;
+    }
+
+    // a free chunk, from the spill pool when the PMR buffer has none, waiting for one to be freed
+    // when neither has
+    uint32_t Take() {
+        for(int i = 0; i < SPIN_TRIES; i++) {
+            uint32_t chunk = TryTake(PMR);
+            if(chunk != NIL) {
+                return chunk;
+            }
+            asm volatile ("pause" : : : "memory");
+        }
+        uint32_t chunk = TryTake(SPILL);
+        if(chunk != NIL) {
+            return chunk;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiters_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond_.wait(lock, [&]() { return (chunk = TryTake(PMR)) != NIL || (chunk = TryTake(SPILL)) != NIL; });
+        waiters_.fetch_sub(1);
+        return chunk;
+    }
+
+    // put a chunk back without it having been used, such as one left in a cache
+    void Give(uint32_t chunk) {
+        Stack & s = tiers_[TierOf(chunk)];
+        uint32_t index = chunk - s.base;
+        assert(index < s.chunks && s.next[index].load() == TAKEN);
+        uint64_t head = s.head.load(std::memory_order_relaxed);
+        do {
+            s.next[index].store(Index(head), std::memory_order_relaxed);
+        } while(!s.head.compare_exchange_weak(head, Pack(index, Tag(head) + 1), std::memory_order_release,
+                                              std::memory_order_relaxed));
+        s.free.fetch_add(1, std::memory_order_relaxed);
+
+        // a waiter either saw the chunk or is woken up
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters_.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            cond_.notify_one();
+        }
+    }
+
+    // note a chunk taken by a clerk is written to
+    inline void Use(uint32_t chunk) {
+        tiers_[TierOf(chunk)].in_use.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // put back a chunk whose records were handed over
+    void Free(uint32_t chunk) {
+        tiers_[TierOf(chunk)].in_use.fetch_sub(1, std::memory_order_relaxed);
+        Give(chunk);
+    }
+
+    inline Tier TierOf(uint32_t chunk) const {
+        return chunk < tiers_[SPILL].base ? PMR : SPILL;
+    }
+
+    inline uint32_t Chunks(Tier tier = PMR) const {
+        return tiers_[tier].chunks;
+    }
+
+    // id of the first chunk of `tier`
+    inline uint32_t Base(Tier tier) const {
+        return tiers_[tier].base;
+    }
+
+    // one past the largest chunk id
+    inline uint32_t Ids() const {
+        return tiers_[SPILL].base + tiers_[SPILL].chunks;
+    }
+
+    // chunks on the stack of `tier`, a hint while others take and free them
+    inline int32_t FreeCount(Tier tier = PMR) const {
+        return tiers_[tier].free.load(std::memory_order_relaxed);
+    }
+
+    // chunks of `tier` written to or waiting for the log
+    inline uint32_t InUse(Tier tier = PMR) const {
+        return tiers_[tier].in_use.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const int SPIN_TRIES = 64;
+
+    struct Stack {
+        uint32_t base;   // id of the first chunk
+        uint32_t chunks;
+        std::unique_ptr<std::atomic<uint32_t>[]> next; // the link of every chunk on the stack
+        std::atomic<uint64_t> head;                    // tag in the high half, chunk in the low half
+        std::atomic<int32_t> free{0};
+        std::atomic<uint32_t> in_use{0};
+
+        void Init(uint32_t first, uint32_t n) {
+            base = first;
+            chunks = n;
+            next.reset(new std::atomic<uint32_t>[n]);
+            for(uint32_t i = 0; i < n; i++) {
+                next[i].store(i + 1 < n ? i + 1 : NIL, std::memory_order_relaxed);
+            }
+            head.store(Pack(n > 0 ? 0 : NIL, 0));
+            free.store(n);
+        }
+    };
+
+    static inline uint64_t Pack(uint32_t index, uint32_t tag) {
+        return (uint64_t)tag << 32 | index;
+    }
+
+    static inline uint32_t Index(uint64_t head) {
+        return (uint32_t)head;
+    }
+
+    static inline uint32_t Tag(uint64_t head) {
+        return head >> 32;
+    }
+
+    Stack tiers_[2];
+
+    std::atomic<int> waiters_{0};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+/*
+ * ChunkCache: the free PMR chunks a clerk took ahead. It takes a few at a time only while at least
+ * half of them are free, so that chunks idle in caches never leave another clerk waiting for long.
+ */
+class ChunkCache {
+public:
+    explicit ChunkCache(ChunkAllocator * allocator) : allocator_(allocator), count_(0) {}
+
+    ~ChunkCache() {
+        while(count_ > 0) {
+            allocator_->Give(chunks_[--count_]);
+        }
+    }
+
+    ChunkCache(const ChunkCache &) = delete;
+    ChunkCache & operator=(const ChunkCache &) = delete;
+
+    // a chunk to write to
+    uint32_t Take() {
+        if(count_ == 0) {
+            Refill(true);
+        }
+        uint32_t chunk = chunks_[--count_];
+        allocator_->Use(chunk);
+        return chunk;
+    }
+
+    // a chunk to write to, NIL if none is free
+    uint32_t TryTake() {
+        if(count_ == 0) {
+            Refill(false);
+        }
+        if(count_ == 0) {
+            return ChunkAllocator::NIL;
+        }
+        uint32_t chunk = chunks_[--count_];
+        allocator_->Use(chunk);
+        return chunk;
+    }
+
+private:
+    static const int CACHE_CHUNKS = 4;
+
+    void Refill(bool wait) {
+        if(allocator_->FreeCount() >= (int32_t)allocator_->Chunks() / 2) {
+            while(count_ < CACHE_CHUNKS) {
+                uint32_t chunk = allocator_->TryTake();
+                if(chunk == ChunkAllocator::NIL) {
+                    break;
+                }
+                chunks_[count_++] = chunk;
+            }
+        }
+        if(count_ == 0 && wait) {
+            chunks_[count_++] = allocator_->Take();
+        } else if(count_ == 0) {
+            uint32_t chunk = allocator_->TryTake(ChunkAllocator::SPILL);
+            if(chunk != ChunkAllocator::NIL) {
+                chunks_[count_++] = chunk;
+            }
+        }
+    }
+
+    ChunkAllocator * allocator_;
+    uint32_t chunks_[CACHE_CHUNKS];
+    int count_;
+};
+
+} // namespace frontend
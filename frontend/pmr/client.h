@@ -1,35 +1,68 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 #include <cstdio>
 
 #include "../cs.h"
+#include "../lanes.h"
+#include "index.h"
 
 using namespace RDMAUtil;
 using namespace SocketUtil;
 
 namespace frontend {
 
+const int COMBINE_AREAS = 2; // chunks of a lane whose combined puts are staged at a time
+
 class PMRClient : Client {
 public:
     PMRClient(MyOption opt, int id = 1);
 
     void Connect();
 
-    void SendPut(const char * key, const char * val) {
-        SendWrite(key, val, PUT);
+    void AsyncPut(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, PUT, cb);
     }
 
-    bool SendGet(const char * key, std::string * val);
-
-    void SendUpdate(const char * key, const char * val) {
-        SendWrite(key, val, UPDATE);
+    void AsyncUpdate(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, UPDATE, cb);
     } 
 
-    bool SendDelete(const char * key);
+    void AsyncGet(std::string_view key, Callback cb);
+
+    void AsyncDelete(std::string_view key, Callback cb = nullptr);
+
+    void AsyncMultiGet(const std::vector<std::string> & keys, MultiCallback cb) {
+        AsyncMulti(MGET, keys, std::move(cb));
+    }
+
+    void AsyncMultiDelete(const std::vector<std::string> & keys, MultiCallback cb = nullptr) {
+        AsyncMulti(MDELETE, keys, std::move(cb));
+    }
+
+    void AsyncScan(std::string_view start, std::string_view end, int limit, ScanCallback cb);
+
+    int Poll() {
+        FlushExpired();
+        int completed = lanes_.Poll();
+        SendRetries();
+        return completed;
+    }
+
+    void Drain() {
+        do {
+            SendRetries();
+            for(int l = 0; l < lanes_.Size(); l++) {
+                FlushGroup(l);
+            }
+            lanes_.Drain();
+        } while(!retries_.empty());
+    }
 
     void SendClose();
 
@@ -37,21 +70,70 @@ public:
         return client_id_;
     }
 
-    void SendAlloc();
+    const RDMAUtil::PollStats & Stats() const {
+        return lanes_.Stats();
+    }
+
+    // switch lane `l` to a new chunk
+    void SendAlloc(int l);
+
+    // switch lane `l` to its spare chunk without waiting, the clerk replies the next spare
+    void SendNext(int l);
 
 private:
-    void SendWrite(const char * key, const char * val, Operation op);
+    void AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb);
+
+    // have the clerk read a record that does not fit in a slot from `val`
+    void AsyncLargeWrite(int l, std::string_view key, std::string_view val, Callback cb);
+
+    // have the clerk write a value that did not fit in the reply to the write buffer of the lane
+    void GetLarge(const std::string & key, Callback cb);
+
+    // look the key up with RDMA reads of the server's index and record, false to ask the clerk
+    bool ReadGet(RDMAContext * context, const char * key, uint32_t key_len, std::string * val);
+
+    // write the combined puts of lane `l` to its chunk and notify the clerk of all of them at once
+    void FlushGroup(int l);
+
+    // flush the groups whose linger passed
+    void FlushExpired();
+
+    // send the keys of each lane in MGET or MDELETE requests
+    void AsyncMulti(Operation op, const std::vector<std::string> & keys, MultiCallback cb);
+
+    // send the requests that replies asked for again, outside of reply handlers
+    void SendRetries();
 
 private:
-    std::unique_ptr<RDMADevice> rdma_device_;
-    std::unique_ptr<RDMAContext> rdma_context_;
-    uint8_t * local_buf_; // local send buffer
-    uint32_t * header_;   // an of local_buf_
-    // private write buffer
-    uint32_t chunk_offset_; 
-    uint32_t buf_head_;
+    /*
+     * Group: puts of a lane staged for write combining, acknowledged together. The groups of
+     * consecutive chunks are staged in COMBINE_AREAS areas in turn, and an area is only staged in
+     * again once the groups flushed from it were acknowledged, as their writes may read it until then.
+     */
+    struct Group {
+        uint32_t start; // offset in the chunk of the first record
+        std::vector<Callback> callbacks;
+        std::chrono::steady_clock::time_point deadline;
+        int area = 0;                         // the groups of the current chunk are staged in
+        uint32_t end = 0;                     // of the last group staged in `area`
+        uint32_t unacked[COMBINE_AREAS] = {}; // groups flushed from each area without a reply yet
+    };
+
+    ClientLanes lanes_;
+    // private write buffer of each lane
+    std::vector<uint32_t> chunk_offset_; 
+    std::vector<uint32_t> spare_offset_; // UINT32_MAX while the clerk has not replied one
+    std::vector<uint32_t> buf_head_;
+    std::vector<Group> groups_;
+    std::vector<std::function<void()>> retries_; // requests to send again, queued by reply handlers
+    int combine_;
+    uint32_t combine_bytes_;
+    std::chrono::microseconds linger_;
 
     int client_id_;
+    int window_;
+    bool read_path_;
+    Notify notify_;
     std::string ip_;
     int port_;
 };
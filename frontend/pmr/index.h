@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#include "../request.h"
+
+namespace frontend {
+
+/*
+ * IndexEntry: where the latest record of a recently written key lies in the PMR buffer. `version`
+ * is odd while the server rewrites the entry, a client reading the entry with RDMA takes it only
+ * with an even version, a matching key hash and a record whose checksum matches.
+ */
+struct alignas(32) IndexEntry {
+    std::atomic<uint64_t> version;
+    uint64_t key_hash; // 0 for an empty entry
+    uint32_t offset;   // of the record (Request, key, value) in the PMR buffer
+    uint32_t length;   // of the whole record
+    uint32_t checksum; // of the whole record
+    uint32_t pad;
+};
+static_assert(sizeof(IndexEntry) == 32, "an index entry is read with a single RDMA read");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the version is read by the NIC as a plain word");
+
+const int INDEX_ENTRIES = 64 * 1024;
+
+// FNV-1a, never 0 so that it tells an empty entry apart
+inline uint64_t KeyHash(const char * key, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+// FNV-1a as well, `h` continues the checksum of the bytes before
+inline uint32_t Checksum(const void * data, size_t len, uint32_t h = 2166136261u) {
+    const uint8_t * p = (const uint8_t *)data;
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * ReadIndex: a direct-mapped table of IndexEntry the server exports for RDMA reads, a key lives in
+ * entry KeyHash % INDEX_ENTRIES only. A newer key taking the entry evicts the older one, whose gets
+ * then go to the clerk. Clerks publish a record once they served its put, and retire it before its
+ * chunk is flushed and may be reused.
+ */
+class ReadIndex {
+public:
+    ReadIndex() {
+        entries_ = (IndexEntry *)aligned_alloc(4096, Size());
+        memset((void *)entries_, 0, Size());
+    }
+
+    ~ReadIndex() {
+        free(entries_);
+    }
+
+    ReadIndex(const ReadIndex &) = delete;
+    ReadIndex &operator=(const ReadIndex &) = delete;
+
+    void * Data() {
+        return entries_;
+    }
+
+    static constexpr size_t Size() {
+        return sizeof(IndexEntry) * INDEX_ENTRIES;
+    }
+
+    static size_t Slot(uint64_t key_hash) {
+        return key_hash % INDEX_ENTRIES;
+    }
+
+    // point the entry of `key` to the record at `offset`
+    void Publish(const char * key, size_t len, uint32_t offset, const Request * record) {
+        uint64_t h = KeyHash(key, len);
+        IndexEntry * e = &entries_[Slot(h)];
+        uint64_t v = Lock(e);
+        e->key_hash = h;
+        e->offset = offset;
+        e->length = ((Request *)record)->Length();
+        e->checksum = Checksum(record, e->length);
+        Unlock(e, v);
+    }
+
+    // empty the entry of `key` if it still points to the record at `offset`, UINT32_MAX for any record
+    void Retire(const char * key, size_t len, uint32_t offset) {
+        uint64_t h = KeyHash(key, len);
+        IndexEntry * e = &entries_[Slot(h)];
+        uint64_t v = Lock(e);
+        if(e->key_hash == h && (offset == UINT32_MAX || e->offset == offset)) {
+            e->key_hash = 0;
+        }
+        Unlock(e, v);
+    }
+
+private:
+    // make the version odd, return the even version it had
+    static uint64_t Lock(IndexEntry * e) {
+        uint64_t v = e->version.load(std::memory_order_relaxed);
+        while((v & 1) || !e->version.compare_exchange_weak(v, v + 1, std::memory_order_acquire)) {
+            v = e->version.load(std::memory_order_relaxed) & ~1ull;
+        }
+        return v;
+    }
+
+    static void Unlock(IndexEntry * e, uint64_t v) {
+        e->version.store(v + 2, std::memory_order_release);
+    }
+
+    IndexEntry * entries_;
+};
+
+} // namespace frontend
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../cs.h"
+
+namespace frontend {
+
+// how far the chunks handed over by a writer got into the database
+struct IngestOrder {
+    std::atomic<uint64_t> sealed{0};   // chunks handed over
+    std::atomic<uint64_t> ingested{0}; // the first of them that are in the database
+};
+
+// the records of a chunk handed over by a writer, served from the chunk until they are ingested
+struct SealedChunk {
+    uint32_t id;
+    uint8_t * addr;  // local address of the chunk
+    uint8_t * image; // its image written to the log, which the records are put from
+    uint32_t head;   // bytes of records
+    std::vector<std::string> keys;
+    std::vector<Meta> metas;
+    std::shared_ptr<IngestOrder> order; // of the writer, which may be gone before the chunk is ingested
+    uint64_t ordinal;                   // among the chunks of the writer, from 1 on
+    std::chrono::steady_clock::time_point sealed;
+};
+
+/*
+ * IngestQueue: the sealed chunks waiting for the ingest workers. It holds a bounded number of them,
+ * so that clerks ahead of the database wait for room instead of sealing every chunk of the buffer.
+ * Chunks leave in the order they came under a single lock, so a worker knows that the earlier
+ * chunks of a writer were taken by others before, and waiting for them to be ingested is safe.
+ */
+class IngestQueue {
+public:
+    explicit IngestQueue(size_t capacity) : capacity_(capacity) {}
+
+    IngestQueue(const IngestQueue &) = delete;
+    IngestQueue & operator=(const IngestQueue &) = delete;
+
+    // queue a chunk, waiting while the queue is full
+    void Push(SealedChunk && chunk) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&]() { return chunks_.size() < capacity_; });
+        chunks_.push_back(std::move(chunk));
+        depth_.store(chunks_.size(), std::memory_order_relaxed);
+        not_empty_.notify_one();
+    }
+
+    // wait for a chunk, and take up to `max` chunks at once if more are queued
+    void Pop(std::vector<SealedChunk> * batch, size_t max) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&]() { return !chunks_.empty(); });
+        while(!chunks_.empty() && batch->size() < max) {
+            batch->push_back(std::move(chunks_.front()));
+            chunks_.pop_front();
+        }
+        depth_.store(chunks_.size(), std::memory_order_relaxed);
+        not_full_.notify_all();
+    }
+
+    // chunks waiting, a hint while clerks and workers move them
+    inline size_t Depth() const {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+private:
+    size_t capacity_;
+    std::deque<SealedChunk> chunks_;
+    std::atomic<size_t> depth_{0};
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+} // namespace frontend
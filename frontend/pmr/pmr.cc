@@ -1,23 +1,104 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+
 #include "client.h"
 #include "server.h"
 #include "uring.h"
-#include "concurrentqueue.h"
 
 #define COPY2DRAM true
 
 namespace frontend {
 
 const int MAX_DMABUF_SIZE = 8 * 1024 * 1024; // 8 MiB
+const int MAX_SPILL_SIZE  = 32 * 1024 * 1024; // 32 MiB of host DRAM the buffer spills to
+
+// where a one-sided get reads the index entry and the record to in the send buffer
+const int READ_ENTRY  = RING_END;
+const int READ_RECORD = RING_END + 64;
+static_assert(READ_RECORD + MAX_REQUEST <= RDMAUtil::SEND_BUF_SIZE, "reads exceed the send buffer");
+
+// where combined puts are staged in the send buffer, at the offset of their record in the chunk of
+// one of COMBINE_AREAS areas
+const int COMBINE_BUF = READ_RECORD + MAX_REQUEST;
+static_assert(COMBINE_BUF + COMBINE_AREAS * MAX_ASYNC_SIZE <= RDMAUtil::SEND_BUF_SIZE, "combined puts exceed the send buffer");
+
+// where a clerk stages the segments of a large value in its send buffer
+const int SEGMENT_BUF  = RING_END;
+const int SEGMENT_SIZE = 64 * 1024;
+static_assert(SEGMENT_BUF + SEGMENT_SIZE <= RDMAUtil::SEND_BUF_SIZE, "segments exceed the send buffer");
 
-moodycamel::ConcurrentQueue<std::tuple<void *, uint32_t, size_t>> global_queue;
+const int LOG_QUEUE_DEPTH   = 64;  // chunk images written to the log at a time
+const int CHECKPOINT_CHUNKS = 256; // chunk images written between checkpoints
+const int INGEST_QUEUE_DEPTH = 64; // sealed chunks waiting for the ingest workers
+
+// the chunks of a region of `size` bytes to use, all of them for -1
+static uint32_t RegionChunks(int wanted, uint32_t size) {
+    uint32_t chunks = size / MAX_ASYNC_SIZE;
+    return wanted < 0 ? chunks : std::min<uint32_t>(wanted, chunks);
+}
 
 void UringRun(IOuring * ring, PMRServer * server) {
+    const __u64 SYNC_WRITE = 1ULL << 63; // the write of a spilled chunk a clerk waits for
     uint32_t free_cnt = 1;
     io_uring_cqe* cqe;
+    // the log slot of a chunk being written, a spilled one keeps the slot of its first write until its
+    // last one. Once written, a chunk whose records may not be ingested yet holds back the checkpoint.
+    std::unordered_map<size_t, off_t> slots;
+    std::unordered_map<size_t, off_t> ingesting;
+    std::unordered_map<size_t, std::atomic<bool> *> syncs;
+
+    auto complete = [&](io_uring_cqe * cqe) {
+        __u64 data = io_uring_cqe_get_data64(cqe);
+        size_t chunkid = data & ~SYNC_WRITE;
+        if(data & SYNC_WRITE) {
+            syncs[chunkid]->store(true, std::memory_order_release);
+            syncs.erase(chunkid);
+        } else {
+            ingesting[chunkid] = slots[chunkid];
+            slots.erase(chunkid);
+            server->ReleaseChunk(chunkid);
+            free_cnt += 1;
+        }
+        ring->Seen(cqe);
+    };
+    // wait for the next write to complete, the log is unusable once waiting fails
+    auto wait = [&]() {
+        int ret;
+        while((ret = ring->Wait(&cqe)) == -EINTR) {}
+        if(ret < 0) {
+            fprintf(stderr, "PMRServer log: waiting for a write failed, %s\n", strerror(-ret));
+            exit(-1);
+        }
+        complete(cqe);
+    };
+
     while (true) {
-        std::tuple<void *, uint32_t, size_t> item;
-        while(!ring->Full() && global_queue.try_dequeue(item)) {
-            ring->Write(std::get<0>(item), std::get<1>(item), (__u64)std::get<2>(item));
+        std::tuple<void *, uint32_t, size_t, std::atomic<bool> *, uint32_t> item;
+        while(!ring->Full() && server->flush_queue_.try_dequeue(item)) {
+            auto [buf, length, chunkid, synced, at] = item;
+            if(server->chunks_.TierOf(chunkid) == ChunkAllocator::PMR) {
+                // every chunk image takes a slot of its own, so that recovery can step over a torn one
+                slots[chunkid] = ring->Offset();
+                ring->Write(buf, length, chunkid, MAX_ASYNC_SIZE);
+                continue;
+            }
+            auto slot = slots.find(chunkid);
+            if(slot == slots.end()) {
+                slot = slots.emplace(chunkid, ring->Offset()).first;
+                ring->Seek(ring->Offset() + MAX_ASYNC_SIZE);
+            }
+            if(synced != nullptr) {
+                syncs[chunkid] = synced;
+                ring->WriteAt(buf, length, chunkid | SYNC_WRITE, slot->second + at);
+            } else {
+                ring->WriteAt(buf, length, chunkid, slot->second);
+            }
         }
         
         if(ring->Empty()) {
@@ -26,17 +107,45 @@ void UringRun(IOuring * ring, PMRServer * server) {
             ring->Submit();
         }
         
-        int ret = ring->Wait(&cqe);
-        assert(ret >= 0);
-        __u64 chunkid = io_uring_cqe_get_data64(cqe);
-        server->FreeChunk(chunkid);
-        ring->Seen(cqe);
+        uint32_t freed = free_cnt;
+        wait();
+        if(free_cnt == freed) {
+            continue;
+        }
 
         // monitoring the usage of messaging buffer
-        free_cnt += 1;
         if(free_cnt % 1000 == 0) {
-            printf("\t %f\n", server->PeekUsage());
+            printf("\t %f %zu %ld\n", server->PeekUsage(), server->IngestDepth(), (long)server->IngestLag());
         }
+
+        if(free_cnt % CHECKPOINT_CHUNKS == 0) {
+            // every image before the checkpoint has to be written and ingested, and no spilled chunk
+            // still open
+            while(!ring->Empty()) {
+                wait();
+            }
+            off_t offset = ring->Offset();
+            for(auto & [chunkid, slot] : slots) {
+                offset = std::min(offset, slot);
+            }
+            for(auto it = ingesting.begin(); it != ingesting.end(); ) {
+                if(server->Ingested(it->first)) {
+                    it = ingesting.erase(it);
+                } else {
+                    offset = std::min(offset, (it++)->second);
+                }
+            }
+            server->Checkpoint(offset);
+        }
+    }
+}
+
+void IngestRun(PMRServer * server) {
+    std::vector<SealedChunk> batch;
+    while(true) {
+        server->ingest_.Pop(&batch, server->ingest_merge_);
+        server->PutChunks(batch);
+        batch.clear();
     }
 }
 
@@ -44,312 +153,818 @@ PMRClient::PMRClient(MyOption opt, int id) {
     client_id_ = id;
     ip_ = opt.ipaddr;
     port_ = opt.ipport;
-    chunk_offset_ = UINT32_MAX; // NAN
-    buf_head_ = UINT32_MAX;     // NAN
-
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
-    assert(device != nullptr);
-    rdma_device_ = std::move(device);
+    window_ = opt.window;
+    read_path_ = opt.read_path;
+    notify_ = ParseNotify(opt.notify);
+    combine_ = opt.combine;
+    combine_bytes_ = opt.combine_bytes;
+    linger_ = std::chrono::microseconds(opt.linger_us);
 
-    auto [context, status] = rdma_device_->open();
-    if(status != Status::Ok) {
-        fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
-    }
-    local_buf_ = new uint8_t[MAX_REQUEST];
-    context->register_write_buf(local_buf_, MAX_REQUEST);
-    rdma_context_ = std::move(context);
+    lanes_.Open(opt, MAX_VALUE); // large gets land in the write buffer
+    chunk_offset_.assign(lanes_.Size(), UINT32_MAX); // NAN
+    spare_offset_.assign(lanes_.Size(), UINT32_MAX);
+    buf_head_.assign(lanes_.Size(), UINT32_MAX);     // NAN
+    groups_.resize(lanes_.Size());
 }
 
 void PMRClient::Connect() {
-    // connect the rdma channel to a client rdma channel
-    auto socket = Socket::make_socket(CLIENT, port_, ip_);
-    int commu_fd = socket->GetFirst();
-    // exchange rdma context
-    if(rdma_context_->default_connect(commu_fd) == -1) {
-        exit(-1);
-    }
-    // fprintf(stderr, "connect to server\n");
-    local_buf_ = (uint8_t *)rdma_context_->get_write_buf();
-    assert(local_buf_ != nullptr);
-    // init the header_
-    header_ = (uint32_t *) local_buf_;
-    *header_ = CLIENT_DONE;
+    // connect the rdma channels to the clerks, one per lane
+    lanes_.Connect(ip_, port_, window_, notify_);
     
-    // allocate a chunk at first
+    // allocate a chunk for each lane at first
     usleep(50); // Weird Thing: must wait for a few moment, the server is not ready for RDMA
-    SendAlloc();
+    for(int l = 0; l < lanes_.Size(); l++) {
+        SendAlloc(l);
+    }
 }
 
-void PMRClient::SendWrite(const char * key, const char * val, Operation op) {
-    uint16_t key_len = strlen(key);
-    uint16_t val_len = strlen(val);
-    uint16_t meta_len = sizeof(Request) + key_len;
-    uint16_t total_len = sizeof(Request) + key_len + val_len;
-    
-    if(buf_head_ + total_len >= MAX_ASYNC_SIZE) {
-        SendAlloc();
+void PMRClient::AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t val_len = val.size();
+    uint32_t meta_len = sizeof(Request) + key_len;
+    uint32_t total_len = sizeof(Request) + key_len + val_len;
+    if(meta_len + sizeof(ValueRef) > RING_SLOT_SIZE || val_len > MAX_VALUE) {
+        if(cb) cb(false, nullptr);
+        return ;
+    }
+
+    int l = lanes_.Of(key.data(), key_len);
+    auto & lane = lanes_[l];
+    if(total_len > RING_SLOT_SIZE) {
+        AsyncLargeWrite(l, key, val, std::move(cb));
+        return ;
+    }
+    if(buf_head_[l] + total_len >= CHUNK_SPACE) {
+        FlushGroup(l);
+        SendNext(l);
+    }
+
+    if(combine_ > 1) {
+        // stage the record for the group, it is written to the chunk when the group is flushed
+        Group & group = groups_[l];
+        if(group.callbacks.empty()) {
+            if(buf_head_[l] < group.end) {
+                // a new chunk, whose records would overwrite those of the last one before they were written
+                group.area = (group.area + 1) % COMBINE_AREAS;
+                group.end = 0;
+                while(group.unacked[group.area] > 0) {
+                    if(lane.ring.Poll() == 0) lane.ring.Idle();
+                }
+            }
+            group.start = buf_head_[l];
+            group.deadline = std::chrono::steady_clock::now() + linger_;
+        }
+        uint32_t staging = COMBINE_BUF + group.area * MAX_ASYNC_SIZE;
+        Request * record = (Request *)(lane.context->get_send_buf() + staging + buf_head_[l]);
+        record->op = op;
+        record->key_size = key_len;
+        record->val_size = val_len;
+        memcpy(record->keyvalue, key.data(), key_len);
+        memcpy(record->keyvalue + key_len, val.data(), val_len);
+        group.callbacks.push_back(std::move(cb));
+        buf_head_[l] += total_len;
+
+        if(group.callbacks.size() >= (size_t)combine_ || buf_head_[l] - group.start >= combine_bytes_ || 
+           std::chrono::steady_clock::now() >= group.deadline) {
+            FlushGroup(l);
+        }
+        return ;
     }
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = lane.ring.Next();
     request->op = op;
     request->key_size = key_len;
     request->val_size = val_len;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, key_len);
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request) + key_len, val, val_len);
-
-    // write meta data to clerk's send buffer
-    rdma_context_->post_write0(nullptr, meta_len, RING_HEADER, RING_HEADER, false);
-    // write record data to clerk's write buffer
-    rdma_context_->post_write(nullptr, total_len, RING_HEADER, chunk_offset_ + buf_head_, false);
-    // write completed: signaled
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
-    buf_head_ += total_len;
-    
-    // wait for the clerk side to update this field
-    while(*header_ != CLERK_DONE) asm("nop");
-    *header_ = CLIENT_DONE; // update this for next client write
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
+
+    // write record data to clerk's write buffer, a large value is gathered from the caller's buffer
+    Slice record[2] = {{request, meta_len}, {val.data(), val_len}};
+    uint32_t remote_offset = chunk_offset_[l] + buf_head_[l];
+    if(val_len < ZERO_COPY_SIZE || lane.context->batch_writev(record, 2, remote_offset) != 0) {
+        if(notify_ == Notify::Frame) {
+            // the ring puts its marker right after the request, so the value is staged behind it
+            record[1].addr = (uint8_t *)request + meta_len + 1;
+            memcpy((uint8_t *)record[1].addr, val.data(), val_len);
+            lane.context->batch_writev(record, 2, remote_offset);
+        } else {
+            memcpy((uint8_t *)request + sizeof(Request) + key_len, val.data(), val_len);
+            lane.context->batch_write1(nullptr, total_len, lane.ring.SlotOffset(), remote_offset, false);
+        }
+    }
+    // write meta data to clerk's request ring, both go out with a single doorbell
+    lane.ring.Submit(meta_len, ReplyHandler(cb, false));
+    buf_head_[l] += total_len;
 
     return ;
 }
 
-bool PMRClient::SendGet(const char * key, std::string * val) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void PMRClient::AsyncLargeWrite(int l, std::string_view key, std::string_view val, Callback cb) {
+    auto & lane = lanes_[l];
+    uint32_t total_len = sizeof(Request) + key.size() + val.size();
+    ValueRef ref;
+    ref.length = val.size();
+    struct ibv_mr * pin;
+    if(!lane.context->expose(val.data(), val.size(), &ref.addr, &ref.rkey, &pin)) {
+        if(cb) cb(false, nullptr);
+        return ;
+    }
+    FlushGroup(l);
+    // a record that fits in a chunk is read into the chunk by the clerk, a larger one is put on its own
+    bool in_chunk = total_len < CHUNK_SPACE;
+    if(in_chunk && buf_head_[l] + total_len >= CHUNK_SPACE) {
+        SendNext(l);
+    }
+
+    // the request carries where the clerk reads the value from
+    Request * request = lane.ring.Next();
+    request->op = LPUT;
+    request->key_size = key.size();
+    request->val_size = sizeof(ValueRef);
+    memcpy(request->keyvalue, key.data(), key.size());
+    memcpy(request->keyvalue + key.size(), &ref, sizeof(ValueRef));
+    // the clerk read the value before it replied, the value stays pinned until the reply
+    ClientRing::Handler handler = ReplyHandler(cb, false);
+    RDMAContext * context = lane.context.get();
+    lane.ring.Submit(request->Length(), [context, pin, handler](RequestReply * reply) {
+        context->unpin(pin);
+        if(handler) handler(reply);
+    });
+    if(in_chunk) {
+        buf_head_[l] += total_len;
+    }
+}
+
+void PMRClient::AsyncGet(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
+    int l = lanes_.Of(key.data(), key_len);
+    auto & lane = lanes_[l];
+    FlushGroup(l); // the get follows the puts before it
+
+    // only without requests in flight, so that the get sees the client's own writes
+    std::string val;
+    if(read_path_ && lane.ring.Inflight() == 0 && ReadGet(lane.context.get(), key.data(), key_len, &val)) {
+        if(cb) cb(true, &val);
+        return ;
+    }
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = lane.ring.Next();
     request->op = GET;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
 
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
     // no need to write records to async write buffer
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    ClientRing::Handler handler = ReplyHandler(cb, true);
+    if(handler) {
+        // a value too large for the reply is asked for again once the handler returned
+        handler = [this, handler, cb, key = std::string(key)](RequestReply * reply) {
+            if(reply->status == RequestStatus::LARGE) {
+                retries_.push_back([this, key, cb]() { GetLarge(key, cb); });
+            } else {
+                handler(reply);
+            }
+        };
+    }
+    lane.ring.Submit(total_len, std::move(handler));
+}
 
-    // wait for the clerk side to update this field
-    while(*header_ != CLERK_DONE) asm("nop");
-    *header_ = CLIENT_DONE; // update this for next client write
+void PMRClient::GetLarge(const std::string & key, Callback cb) {
+    int l = lanes_.Of(key.data(), key.size());
+    auto & lane = lanes_[l];
+    FlushGroup(l);
 
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        *val = std::move(std::string(reply->value, reply->val_size));
-        return true;
+    Request * request = lane.ring.Next();
+    request->op = LGET;
+    request->key_size = key.size();
+    request->val_size = 0;
+    memcpy(request->keyvalue, key.data(), key.size());
+
+    RequestStatus status = RequestStatus::ERROR;
+    uint32_t length = 0;
+    lane.ring.Submit(request->Length(), [&](RequestReply * reply) {
+        status = reply->status;
+        if(status == RequestStatus::OK) {
+            memcpy(&length, reply->value, sizeof(uint32_t));
+        }
+    });
+    // wait for it, the write buffer of the lane holds the value of a single LGET at a time
+    lane.ring.Drain();
+    if(status == RequestStatus::OK) {
+        std::string val((char *)lane.local_buf.get(), length);
+        cb(true, &val);
     } else {
+        cb(false, nullptr);
+    }
+}
+
+bool PMRClient::ReadGet(RDMAContext * context, const char * key, uint32_t key_len, std::string * val) {
+    if(context->remote.length2 == 0) {
+        return false;
+    }
+    uint8_t * buf = context->get_send_buf();
+    uint64_t h = KeyHash(key, key_len);
+
+    context->post_read2(sizeof(IndexEntry), READ_ENTRY, ReadIndex::Slot(h) * sizeof(IndexEntry));
+    context->drain_completions();
+    IndexEntry * entry = (IndexEntry *)(buf + READ_ENTRY);
+    uint64_t version = entry->version.load(std::memory_order_relaxed);
+    if((version & 1) || entry->key_hash != h || entry->length > MAX_REQUEST) {
         return false;
     }
+    uint32_t length = entry->length, checksum = entry->checksum;
+
+    // the record may have been overwritten since, if its chunk was flushed and reused
+    context->post_read1(length, READ_RECORD, entry->offset);
+    context->drain_completions();
+    Request * record = (Request *)(buf + READ_RECORD);
+    if(Checksum(record, length) != checksum || record->Length() != length || record->key_size != key_len
+        || memcmp(record->keyvalue, key, key_len) != 0) {
+        return false;
+    }
+    val->assign(record->keyvalue + key_len, record->val_size);
+    return true;
 }
 
-bool PMRClient::SendDelete(const char * key) {
-    uint16_t key_len = strlen(key);
-    uint16_t total_len = sizeof(Request) + key_len;
+void PMRClient::AsyncDelete(std::string_view key, Callback cb) {
+    uint32_t key_len = key.size();
+    uint32_t total_len = sizeof(Request) + key_len;
+    int l = lanes_.Of(key.data(), key_len);
+    auto & lane = lanes_[l];
+    FlushGroup(l); // the delete follows the puts before it
 
-    // prepare the record in buffer[RING_HEADER:]
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // prepare the record in the next request slot
+    Request * request = lane.ring.Next();
     request->op = DELETE;
-    request->key_size = strlen(key);
+    request->key_size = key_len;
     request->val_size = 0;
-    memcpy(local_buf_ + RING_HEADER + sizeof(Request), key, strlen(key));
+    memcpy((uint8_t *)request + sizeof(Request), key.data(), key_len);
 
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
     // no need to write records to async write buffer
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    lane.ring.Submit(total_len, ReplyHandler(cb, false));
+}
+
+void PMRClient::AsyncMulti(Operation op, const std::vector<std::string> & keys, MultiCallback cb) {
+    // the indices of the keys of each lane
+    std::vector<std::vector<int>> lane_keys(lanes_.Size());
+    for(size_t i = 0; i < keys.size(); i++) {
+        lane_keys[lanes_.Of(keys[i].data(), keys[i].size())].push_back(i);
+    }
 
-    // wait for the clerk side to update this field
-    while(*header_ != CLERK_DONE) asm("nop");
-    *header_ = CLIENT_DONE; // update this for next client write
+    for(int l = 0; l < lanes_.Size(); l++) {
+        auto & lane = lanes_[l];
+        FlushGroup(l); // the request follows the puts before it
+        size_t k = 0;
+        while(k < lane_keys[l].size()) {
+            // as many keys as fit in a slot
+            Request * request = lane.ring.Next();
+            MultiInit(request, op);
+            std::vector<int> index;
+            while(k < lane_keys[l].size() && MultiAdd(request, keys[lane_keys[l][k]], RING_SLOT_SIZE)) {
+                index.push_back(lane_keys[l][k++]);
+            }
+            assert(!index.empty());
 
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        return true;
-    } else {
-        return false;
+            ClientRing::Handler handler = nullptr;
+            if(op == MGET) {
+                std::vector<std::string> sent;
+                for(int i : index) sent.push_back(keys[i]);
+                handler = [this, cb, index, sent](RequestReply * reply) {
+                    uint32_t pos = 0;
+                    for(size_t j = 0; j < index.size(); j++) {
+                        uint32_t length = MULTI_MISSING;
+                        if(reply->status == RequestStatus::OK) {
+                            memcpy(&length, reply->value + pos, sizeof(uint32_t));
+                            pos += sizeof(uint32_t);
+                        }
+                        if(length == MULTI_RETRY) {
+                            retries_.push_back([this, key = sent[j], i = index[j], cb]() {
+                                AsyncGet(key, [cb, i](bool ok, std::string * val) {
+                                    cb(i, ok, val);
+                                });
+                            });
+                        } else if(length == MULTI_MISSING) {
+                            cb(index[j], false, nullptr);
+                        } else {
+                            std::string val(reply->value + pos, length);
+                            pos += length;
+                            cb(index[j], true, &val);
+                        }
+                    }
+                };
+            } else if(cb) {
+                handler = [cb, index](RequestReply * reply) {
+                    for(size_t j = 0; j < index.size(); j++) {
+                        bool ok = reply->status == RequestStatus::OK && reply->value[j] == RequestStatus::OK;
+                        cb(index[j], ok, nullptr);
+                    }
+                };
+            }
+            lane.ring.Submit(request->Length(), std::move(handler));
+        }
+    }
+}
+
+void PMRClient::SendRetries() {
+    // retries are taken out first, a get may complete right away with the read path
+    std::vector<std::function<void()>> retries;
+    retries.swap(retries_);
+    for(auto & retry : retries) {
+        retry();
     }
 }
 
+void PMRClient::AsyncScan(std::string_view start, std::string_view end, int limit, ScanCallback cb) {
+    // the scan follows the puts before it on every lane
+    for(int l = 0; l < lanes_.Size(); l++) {
+        FlushGroup(l);
+    }
+    ScanEntries entries;
+    std::vector<int> large;
+    bool ok = ScanPages(lanes_[0].ring, start, end, limit, &entries, &large);
+    for(int i : large) {
+        GetLarge(entries[i].first, [&](bool found, std::string * val) {
+            if(found) entries[i].second = std::move(*val);
+        });
+    }
+    cb(ok, ok ? &entries : nullptr);
+}
+
 void PMRClient::SendClose() {
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
+    // write close requests to the request rings of all clerks
+    for(int l = 0; l < lanes_.Size(); l++) {
+        FlushGroup(l);
+        Request * request = lanes_[l].ring.Next();
+        uint16_t total_len = sizeof(Request);
+        request->op = CLOSE;
+        request->key_size = 0;
+        request->val_size = 0;
+        lanes_[l].ring.Submit(total_len);
+    }
+
+    // the clerks reply after they flushed the chunk in use
+    for(int l = 0; l < lanes_.Size(); l++) {
+        lanes_[l].ring.Drain();
+        lanes_[l].context->drain_completions();
+    }
+}
+
+void PMRClient::SendAlloc(int l) {
+    auto & lane = lanes_[l];
+    Request * request = lane.ring.Next();
     uint16_t total_len = sizeof(Request);
-    request->op = CLOSE;
+    request->op = ALLOC;
     request->key_size = 0;
     request->val_size = 0;
 
-    // write close request to clerk's send buffer
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    // write alloc request to clerk's request ring
+    lane.ring.Submit(total_len, [this, l](RequestReply * reply) {
+        if(reply->status == RequestStatus::OK) {
+            chunk_offset_[l] = *((uint32_t *)reply->value);
+            spare_offset_[l] = *((uint32_t *)reply->value + 1);
+            buf_head_[l] = 0;
+        }
+    });
 
-    // send out 
-    rdma_context_->post_send(nullptr, MAX_REQUEST, 0);
-    rdma_context_->poll_one_completion(true);
+    // wait for the clerk to reply, the records in flight are flushed with the old chunk
+    lane.ring.Drain();
 }
 
-void PMRClient::SendAlloc() {
-    Request * request = (Request *)(local_buf_ + RING_HEADER);
-    uint16_t total_len = sizeof(Request);
-    request->op = ALLOC;
+void PMRClient::SendNext(int l) {
+    if(spare_offset_[l] == UINT32_MAX) {
+        // no spare yet, wait for a new chunk
+        SendAlloc(l);
+        return ;
+    }
+
+    auto & lane = lanes_[l];
+    Request * request = lane.ring.Next();
+    request->op = NEXT;
     request->key_size = 0;
     request->val_size = 0;
+    lane.ring.Submit(sizeof(Request), [this, l](RequestReply * reply) {
+        if(reply->status == RequestStatus::OK) {
+            spare_offset_[l] = *((uint32_t *)reply->value);
+        }
+    });
 
-    // write alloc request to clerk's send buffer
-    rdma_context_->post_write0(nullptr, total_len, RING_HEADER, RING_HEADER, false);
-    rdma_context_->post_write0(nullptr, sizeof(uint32_t), 0, 0, true);
-    rdma_context_->poll_one_completion(true);
+    // the records that follow go to the spare, the clerk switches to it before it serves them
+    chunk_offset_[l] = spare_offset_[l];
+    spare_offset_[l] = UINT32_MAX;
+    buf_head_[l] = 0;
+}
 
-    // wait for the clerk side to update this field
-    while(*header_ != CLERK_DONE) asm("nop");
-    *header_ = CLIENT_DONE; // update this for next client write
+void PMRClient::FlushGroup(int l) {
+    Group & group = groups_[l];
+    if(group.callbacks.empty()) {
+        return ;
+    }
+    auto & lane = lanes_[l];
+    uint32_t length = buf_head_[l] - group.start;
 
-    RequestReply * reply = (RequestReply *)(local_buf_ + RING_HEADER);
-    if(reply->status == RequestStatus::OK) {
-        chunk_offset_ = *((uint32_t *)reply->value);
-        buf_head_ = 0;
+    // one write for the records of the group, one request for the clerk to take all of them
+    Request * request = lane.ring.Next();
+    request->op = WBATCH;
+    request->key_size = 0;
+    request->val_size = length;
+    uint32_t staging = COMBINE_BUF + group.area * MAX_ASYNC_SIZE;
+    lane.context->batch_write1(nullptr, length, staging + group.start, chunk_offset_[l] + group.start, false);
+
+    // the staged records may be overwritten once the reply says the clerk took them
+    int area = group.area;
+    group.end = buf_head_[l];
+    group.unacked[area] += 1;
+    ClientRing::Handler handler;
+    if(std::any_of(group.callbacks.begin(), group.callbacks.end(), [](const Callback & cb) { return cb != nullptr; })) {
+        handler = [&group, area, callbacks = std::move(group.callbacks)](RequestReply * reply) {
+            group.unacked[area] -= 1;
+            for(auto & cb : callbacks) {
+                if(cb) cb(reply->status == RequestStatus::OK, nullptr);
+            }
+        };
+    } else {
+        handler = [&group, area](RequestReply *) {
+            group.unacked[area] -= 1;
+        };
+    }
+    lane.ring.Submit(sizeof(Request), std::move(handler));
+    group.callbacks.clear();
+}
+
+void PMRClient::FlushExpired() {
+    auto now = std::chrono::steady_clock::time_point::min();
+    for(size_t l = 0; l < groups_.size(); l++) {
+        if(groups_[l].callbacks.empty()) {
+            continue;
+        }
+        if(now == std::chrono::steady_clock::time_point::min()) { // read the clock only with groups pending
+            now = std::chrono::steady_clock::now();
+        }
+        if(now >= groups_[l].deadline) {
+            FlushGroup(l);
+        }
     }
 }
 
-PMRClerk::PMRClerk(std::unique_ptr<RDMAContext> ctx, PMRServer *server, int id) {
+ChunkWriter::ChunkWriter(PMRServer * server) :
+    server_(server), cache_(&server->chunks_), spare_(ChunkAllocator::NIL), order_(std::make_shared<IngestOrder>()) {}
+
+void ChunkWriter::Append() {
+    Request * record = (Request *)Tail();
+    uint32_t key_size = record->key_size;
+    current_.keys.emplace_back(record->keyvalue, key_size);
+    current_.metas.emplace_back(0, current_.head + sizeof(Request), key_size, record->val_size);
+    Meta mem_idx(Tail() + sizeof(Request), key_size, record->val_size);
+    server_->map_.insert_or_assign(current_.keys.back(), mem_idx);
+    server_->index_.Publish(record->keyvalue, key_size, Offset() + current_.head, record);
+    CommitRecord((ChunkHeader *)current_.addr, record, record->Length());
+    current_.head += record->Length();
+}
+
+void ChunkWriter::Flush(Chunk & chunk) {
+    // the image of the chunk goes to the log with its header, the records are put from it
+    uint8_t * start_buf = chunk.addr;
+    uint32_t image_len = CHUNK_HEADER + chunk.head;
+    #ifndef COPY2DRAM
+        uint8_t * tmp_buf = start_buf;
+    #else
+        uint8_t * tmp_buf = new uint8_t[image_len];
+        memcpy(tmp_buf, start_buf, image_len);
+    #endif
+    server_->images_[chunk.id] = tmp_buf;
+    server_->holds_[chunk.id].store(2, std::memory_order_relaxed);
+    server_->open_[chunk.id].store(0, std::memory_order_relaxed); // no record goes after the last one
+    server_->flush_queue_.enqueue({tmp_buf, image_len, chunk.id, nullptr, 0});
+
+    uint64_t ordinal = order_->sealed.fetch_add(1, std::memory_order_relaxed) + 1;
+    server_->Ingest({chunk.id, chunk.addr, tmp_buf, chunk.head, std::move(chunk.keys), std::move(chunk.metas),
+                     order_, ordinal, std::chrono::steady_clock::now()});
+}
+
+void ChunkWriter::Sync(Chunk & chunk) {
+    if(!chunk.spilled || chunk.synced == chunk.head) {
+        return ;
+    }
+    auto write = [&](uint32_t offset, uint32_t length) {
+        std::atomic<bool> synced{false};
+        server_->flush_queue_.enqueue({chunk.addr + offset, length, chunk.id, &synced, offset});
+        while(!synced.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    };
+    // only the records since the last sync, then the header committing them once they are in the log
+    uint32_t head = chunk.head;
+    write(CHUNK_HEADER + chunk.synced, head - chunk.synced);
+    write(0, CHUNK_HEADER);
+    chunk.synced = head;
+}
+
+void ChunkWriter::Sync() {
+    for(auto & chunk : sealed_) {
+        Sync(chunk);
+    }
+    Sync(current_);
+}
+
+uint32_t ChunkWriter::Take(bool wait) {
+    uint32_t chunkid = wait ? cache_.Take() : cache_.TryTake();
+    if(chunkid != ChunkAllocator::NIL) {
+        server_->OpenChunk(chunkid);
+    }
+    return chunkid;
+}
+
+void ChunkWriter::Switch(bool wait) {
+    if(current_.id != ChunkAllocator::NIL) {
+        sealed_.push_back(std::move(current_));
+    }
+    if(wait || spare_ == ChunkAllocator::NIL) {
+        // the chunks switched out go first, a chunk may only come free after them
+        Retire();
+    }
+    if(spare_ == ChunkAllocator::NIL) {
+        spare_ = Take(true);
+    }
+
+    current_ = Chunk();
+    current_.id = spare_;
+    current_.addr = server_->ChunkAddr(spare_);
+    current_.spilled = server_->chunks_.TierOf(spare_) == ChunkAllocator::SPILL;
+    // never wait for a spare, in a buffer of one chunk it would be the one just switched to. A client
+    // without one asks for a chunk with ALLOC when it needs it.
+    spare_ = Take(false);
+}
+
+void ChunkWriter::Retire() {
+    for(auto & chunk : sealed_) {
+        Flush(chunk);
+    }
+    sealed_.clear();
+}
+
+void ChunkWriter::Close() {
+    Sync();
+    if(current_.id != ChunkAllocator::NIL) {
+        if(current_.head > 0) {
+            sealed_.push_back(std::move(current_));
+        } else {
+            server_->FreeChunk(current_.id);
+        }
+        current_ = Chunk();
+    }
+    Retire();
+    if(spare_ != ChunkAllocator::NIL) {
+        server_->FreeChunk(spare_);
+        spare_ = ChunkAllocator::NIL;
+    }
+}
+
+PMRClerk::PMRClerk(std::unique_ptr<RDMAContext> ctx, PMRServer *server, int id) :
+    server_(server), writer_(server) {
     context_ = std::move(ctx);
     clerk_id_ = id;
-    db_ = server->db_;
-    chunk_offset_ = UINT32_MAX; // NAN
-    buf_head_ = UINT32_MAX;     // NAN
-    server_ = server;
-
-    send_buf_ = (uint8_t *)context_->get_send_buf();
-    write_buf_ = (uint8_t *)context_->get_write_buf();
-    uint32_t * header = (uint32_t *) send_buf_;
-    *header = CLERK_DONE;
+    ring_.Init(context_.get(), server->notify_);
 }
 
-void PMRClerk::Run(std::unique_ptr<PMRClerk> clk) {
-    std::vector<std::string> key_batch;
-    std::vector<Meta> metas;
+int PMRClerk::Poll() {
+    int served = 0;
+    Request * request;
+    while(served < RING_SLOTS && (request = ring_.Peek()) != nullptr) {
+        if(!Serve(request)) {
+            return -1;
+        }
+        served += 1;
+    }
+    // publish the replies of this batch, records in a spilled chunk once they are in the log
+    writer_.Sync();
+    ring_.Flush();
+    // the chunks switched out are handed over off the path of the replies
+    writer_.Retire();
+    return served;
+}
 
-    while(true) {
-        // wait for the clerk side to update this field
-        uint32_t * header = (uint32_t *) clk->send_buf_;
-        while(*header != CLIENT_DONE) asm("nop");
-        *header = CLERK_DONE; // update this for next clerk write
-
-        // read meta data from message buffer
-        Request * request = (Request *)(clk->send_buf_ + RING_HEADER);
-        RequestReply * reply = (RequestReply *)(clk->send_buf_ + RING_HEADER);
-        uint32_t key_size = request->key_size;
-        switch(request->op) {
-            case UPDATE : // intended passdown
-            case PUT: {
-                key_batch.emplace_back((char *)request + sizeof(Request), key_size);
-                metas.emplace_back(0, clk->buf_head_ + sizeof(Request), key_size, request->val_size);
-                Meta mem_idx(clk->write_buf_ + clk->chunk_offset_ + clk->buf_head_ + sizeof(Request), 
-                                key_size, request->val_size);
-                clk->server_->map_.insert_or_assign(key_batch.back(), mem_idx);
-                clk->buf_head_ += request->Length();
-                
-                reply->status = RequestStatus::OK;
+bool PMRClerk::Serve(Request * request) {
+    // read meta data from the request ring
+    RequestReply * reply = ring_.Reply();
+    assert(sizeof(Request) + request->key_size <= ring_.Length());
+    uint32_t key_size = request->key_size;
+    switch(request->op) {
+        case UPDATE : // intended passdown
+        case PUT: {
+            // the client wrote the record to the chunk before the request
+            writer_.Append();
+            
+            reply->status = RequestStatus::OK;
+            reply->val_size = 0;
+            break;
+        }
+        case GET: {
+            server_->Get(std::string((char *)request + sizeof(Request), key_size), reply, RING_SLOT_SIZE - sizeof(RequestReply));
+            break;
+        }
+        case DELETE: {
+            server_->Delete(std::string((char *)request + sizeof(Request), key_size), reply);
+            break;
+        }
+        case LPUT: {
+            PutLarge(request, reply);
+            break;
+        }
+        case LGET: {
+            std::string value;
+            if(!server_->Find(std::string(request->keyvalue, key_size), &value)) {
+                reply->status = RequestStatus::NOTFOUND;
                 reply->val_size = 0;
-                break;
-            }
-            case GET: {
-                std::string key((char *)request + sizeof(Request), key_size);
-                std::string value;
-                Meta mem_idx;
-                if(clk->server_->map_.find(key, mem_idx)) {
-                    reply->status = RequestStatus::OK;
-                    reply->val_size = mem_idx.value_size_;
-                    memcpy(reply->value, (char *)mem_idx.memaddr_ + key_size, reply->val_size);
-                } else if(clk->db_->Get(key, &value)) {
-                    reply->status = RequestStatus::OK;
-                    reply->val_size = value.size();
-                    memcpy(reply->value, value.c_str(), reply->val_size);
-                } else {
-                    reply->status = RequestStatus::NOTFOUND;
-                    reply->val_size = 0;
-                }
-                break;
-            }
-            case DELETE: {
-                std::string key((char *)request + sizeof(Request), key_size);
-                std::string value;
-                if(clk->db_->Delete(key)) {
-                    reply->status = RequestStatus::OK;
-                } else {
-                    reply->status = RequestStatus::NOTFOUND;
-                }
+            } else if(value.size() > context_->remote.length) {
+                reply->status = RequestStatus::ERROR;
                 reply->val_size = 0;
-                break;
+            } else {
+                // the value is in place before the reply, which goes out on the same queue pair
+                Stream(value);
+                uint32_t length = value.size();
+                reply->status = RequestStatus::OK;
+                reply->val_size = sizeof(uint32_t);
+                memcpy(reply->value, &length, sizeof(uint32_t));
+            }
+            break;
+        }
+        case MGET: {
+            server_->MultiGet(request, reply, RING_SLOT_SIZE - sizeof(RequestReply));
+            break;
+        }
+        case MDELETE: {
+            server_->MultiDelete(request, reply);
+            break;
+        }
+        case SCAN: {
+            server_->Scan(request, reply, RING_SLOT_SIZE - sizeof(RequestReply));
+            break;
+        }
+        case WBATCH: {
+            // the client wrote `val_size` bytes of records to the chunk before the request
+            uint32_t end = writer_.Head() + request->val_size;
+            while(writer_.Head() < end) {
+                writer_.Append();
             }
-            case ALLOC: {
-                if(clk->chunk_offset_ < UINT32_MAX) {
-                    uint8_t * start_buf = clk->write_buf_ + clk->chunk_offset_;
-                    #ifndef COPY2DRAM
-                        uint8_t * tmp_buf = start_buf;
-                    #else
-                        uint8_t * tmp_buf = new uint8_t[MAX_ASYNC_SIZE];
-                        memcpy(tmp_buf, start_buf, MAX_ASYNC_SIZE);
-                    #endif
-                    clk->db_->PutBatch(key_batch, metas, tmp_buf, clk->buf_head_);
-                    for(int i = 0; i < key_batch.size(); i++) {
-                        clk->server_->map_.erase(key_batch[i]);
-                    }
-                    key_batch.resize(0);
-                    metas.resize(0);
 
-                    global_queue.enqueue({tmp_buf, clk->buf_head_, clk->chunk_offset_ / MAX_ASYNC_SIZE});
-                }
+            reply->status = RequestStatus::OK;
+            reply->val_size = 0;
+            break;
+        }
+        case ALLOC: {
+            // reply the chunk to write to and the spare
+            writer_.Switch(true);
+            uint32_t chunk_offset[2] = {writer_.Offset(), writer_.Spare()};
 
-                clk->chunk_offset_ = MAX_ASYNC_SIZE * clk->server_->AllocChunk();
-                clk->buf_head_ = 0;
+            reply->status = RequestStatus::OK;
+            reply->val_size = sizeof(chunk_offset);
+            memcpy(reply->value, chunk_offset, sizeof(chunk_offset));
+            break;
+        }
+        case NEXT: {
+            // the client went on to the spare, reply the next spare if there is one free
+            writer_.Switch(false);
+            uint32_t spare = writer_.Spare();
 
-                reply->status = RequestStatus::OK;
-                reply->val_size = 4;
-                memcpy(reply->value, &(clk->chunk_offset_), sizeof(uint32_t));
-                break;
-            }
-            case CLOSE: {
-                if(clk->buf_head_ > 0) {
-                    uint8_t * start_buf = clk->write_buf_ + clk->chunk_offset_;
-                    #ifndef COPY2DRAM
-                        uint8_t * tmp_buf = start_buf;
-                    #else
-                        uint8_t * tmp_buf = new uint8_t[MAX_ASYNC_SIZE];
-                        memcpy(tmp_buf, start_buf, MAX_ASYNC_SIZE);
-                    #endif
-                    clk->db_->PutBatch(key_batch, metas, tmp_buf, MAX_ASYNC_SIZE);
-                    for(int i = 0; i < key_batch.size(); i++) {
-                        clk->server_->map_.erase(key_batch[i]);
-                    }
+            reply->status = RequestStatus::OK;
+            reply->val_size = sizeof(uint32_t);
+            memcpy(reply->value, &spare, sizeof(uint32_t));
+            break;
+        }
+        case CLOSE: {
+            writer_.Close();
+            // reply the close request to client
+            reply->status = RequestStatus::OK;
+            reply->val_size = 0;
+            ring_.Done(sizeof(RequestReply));
+            ring_.Flush();
+            context_->drain_completions();
 
-                    global_queue.enqueue({tmp_buf, clk->buf_head_, clk->chunk_offset_ / MAX_ASYNC_SIZE});
-                }
-                // send close msg to client
-                clk->context_->post_recv(MAX_REQUEST, 0);
-                clk->context_->poll_one_completion(false);
+            return false;
+        }
+        default: {
+            fprintf(stderr, "Error operation at Clerk %d\n", clerk_id_);
+            exit(-1);
+        }
+    }
 
-                return ;
-            }
-            default: {
-                fprintf(stderr, "Error operation at Clerk %d\n", clk->clerk_id_);
-                exit(-1);
-            }
+    // stage the request reply to client, it is published with the rest of this batch
+    ring_.Done(sizeof(RequestReply) + reply->val_size);
+    return true;
+}
+
+void PMRClerk::PutLarge(Request * request, RequestReply * reply) {
+    uint32_t key_size = request->key_size;
+    ValueRef ref;
+    memcpy(&ref, request->keyvalue + key_size, sizeof(ValueRef));
+    reply->status = RequestStatus::OK;
+    reply->val_size = 0;
+
+    uint32_t length = sizeof(Request) + key_size + ref.length;
+    if(writer_.Fits(length)) {
+        // the client left room for the record in the chunk, the value is read in behind the key
+        Request * record = (Request *)writer_.Tail();
+        record->op = PUT;
+        record->key_size = key_size;
+        record->val_size = ref.length;
+        memcpy(record->keyvalue, request->keyvalue, key_size);
+        if(!writer_.Spilled()) {
+            context_->post_read_at(ref.length, writer_.Offset() + writer_.Head() + sizeof(Request) + key_size, ref.addr, ref.rkey);
+            context_->drain_completions();
+        } else {
+            // the spill pool is not in the write buffer of the clerk, the value comes through the send buffer
+            ReadSegments(ref, record->keyvalue + key_size);
         }
+        writer_.Append();
+        return ;
+    }
 
-        // write the request reply to client
-        clk->context_->post_write1(nullptr, sizeof(RequestReply) + reply->val_size, 
-                    RING_HEADER, RING_HEADER, false);
+    // too large for a chunk, read it segment by segment
+    std::string key(request->keyvalue, key_size);
+    std::string value(ref.length, '\0');
+    ReadSegments(ref, &value[0]);
+    if(!server_->PutDirect(key, value)) {
+        reply->status = RequestStatus::ERROR;
+    }
+}
 
-        // write the clerk done message to client
-        clk->context_->post_write1(nullptr, sizeof(uint32_t), 0, 0, true); // write to client write_buf[0:4]
-        clk->context_->poll_one_completion(true);
+void PMRClerk::ReadSegments(const ValueRef & ref, char * dst) {
+    for(uint32_t done = 0; done < ref.length; done += SEGMENT_SIZE) {
+        uint32_t segment = std::min<uint32_t>(SEGMENT_SIZE, ref.length - done);
+        context_->post_read_at1(segment, SEGMENT_BUF, ref.addr + done, ref.rkey);
+        context_->drain_completions();
+        memcpy(dst + done, context_->get_send_buf() + SEGMENT_BUF, segment);
     }
 }
 
-PMRServer::PMRServer(MyOption opt, DBType * db) : bitmap_(MAX_DMABUF_SIZE / MAX_ASYNC_SIZE) {
+void PMRClerk::Stream(const std::string & value) {
+    for(uint32_t done = 0; done < value.size(); done += SEGMENT_SIZE) {
+        uint32_t segment = std::min<uint32_t>(SEGMENT_SIZE, value.size() - done);
+        memcpy(context_->get_send_buf() + SEGMENT_BUF, value.data() + done, segment);
+        context_->post_write1(nullptr, segment, SEGMENT_BUF, done, true);
+        // the segment buffer is reused once the write left it
+        context_->drain_completions();
+    }
+}
+
+PMRUdHandler::PMRUdHandler(PMRServer * server) :
+    server_(server), writer_(server) {}
+
+void PMRUdHandler::Serve(Request * request, RequestReply * reply) {
+    reply->status = RequestStatus::OK;
+    reply->val_size = 0;
+    switch(request->op) {
+        case UPDATE : // intended passdown
+        case PUT: {
+            // the record came in the datagram, copy it to the chunk like a client would have written it
+            if(!writer_.Fits(request->Length())) {
+                writer_.Switch(true);
+            }
+            memcpy(writer_.Tail(), request, request->Length());
+            writer_.Append();
+            writer_.Sync();
+            writer_.Retire();
+            break;
+        }
+        case GET: {
+            server_->Get(std::string(request->keyvalue, request->key_size), reply, MAX_REQUEST);
+            break;
+        }
+        case DELETE: {
+            server_->Delete(std::string(request->keyvalue, request->key_size), reply);
+            break;
+        }
+        case SCAN: {
+            server_->Scan(request, reply, MAX_REQUEST);
+            break;
+        }
+        case ALLOC: // datagram clients write no chunk of their own
+        case CLOSE: {
+            break;
+        }
+        default: {
+            reply->status = RequestStatus::ERROR;
+        }
+    }
+}
+
+PMRServer::PMRServer(MyOption opt, DBType * db) : 
+    chunks_(std::max(1u, RegionChunks(opt.pmr_chunks, MAX_DMABUF_SIZE)), RegionChunks(opt.spill_chunks, MAX_SPILL_SIZE),
+            MAX_DMABUF_SIZE / MAX_ASYNC_SIZE),
+    ingest_(INGEST_QUEUE_DEPTH) {
     port_ = opt.ipport;
+    notify_ = ParseNotify(opt.notify);
     db_ = db;
+    ingest_workers_ = opt.ingest_workers;
+    ingest_merge_ = std::max(1, opt.ingest_merge);
+    size_t chunks = chunks_.Ids();
+    holds_.reset(new std::atomic<int>[chunks]());
+    images_.reset(new uint8_t *[chunks]());
+    open_.reset(new std::atomic<uint64_t>[chunks]());
+    InitScheduler(opt);
+    InitDatagrams(opt);
     
     std::string db_dir = opt.dir + "/" + opt.db_type;
     if(!folder_exist(db_dir.c_str())) {
@@ -357,82 +972,678 @@ PMRServer::PMRServer(MyOption opt, DBType * db) : bitmap_(MAX_DMABUF_SIZE / MAX_
     }
     path_ = db_dir + "/" + "pmrlog.dat";
 
-    auto device = RDMADevice::make_rdma(opt.rdma_device, opt.port, opt.gid);
-    assert(device != nullptr);
-    rdma_device_ = std::move(device); 
+    InitDevices(opt);
 
-    int log_fd = open(path_.c_str(), O_CREAT | O_WRONLY, 0644);
-    assert(log_fd > 3);
-    assert(ftruncate(log_fd, PREALLOCATE_SIZE) == 0);
-    lseek(log_fd, 0 , SEEK_SET);
+    // a chunk is freed once its image was written, so the image has to be on the disk by then
+    log_fd_ = open(path_.c_str(), O_CREAT | O_RDWR | O_DSYNC, 0644);
+    assert(log_fd_ > 3);
+    if(ftruncate(log_fd_, PREALLOCATE_SIZE) != 0) {
+        fprintf(stderr, "PMRServer: fail to preallocate the log\n");
+        exit(-1);
+    }
+    lseek(log_fd_, 0 , SEEK_SET);
 
-    ring_ = new IOuring(log_fd, 64);
+    ring_ = new IOuring(log_fd_, LOG_QUEUE_DEPTH);
     #ifdef DMABUF
         dmabuf_fd_ = mapcmb(opt.cmb_device, MAX_DMABUF_SIZE);
         fprintf(stderr, "PMRServer using DMABUF is ON\n");
     #else
-        dmabuf_mem_ = new uint8_t[MAX_DMABUF_SIZE];
+        dmabuf_mem_ = new uint8_t[MAX_DMABUF_SIZE](); // nothing to recover in DRAM
     #endif
+    spill_mem_ = new uint8_t[MAX_SPILL_SIZE]();
+    // the buffer and the index are shared by the clerks on all devices
+    for(auto & device : devices_) {
+        #ifdef DMABUF
+            regions_.push_back(device->register_region(dmabuf_fd_, 0, MAX_DMABUF_SIZE));
+        #else
+            regions_.push_back(device->register_region(dmabuf_mem_, MAX_DMABUF_SIZE));
+        #endif
+        assert(regions_.back() != nullptr);
+        index_regions_.push_back(device->register_region(index_.Data(), ReadIndex::Size()));
+        assert(index_regions_.back() != nullptr);
+        spill_regions_.push_back(device->register_region(spill_mem_, MAX_SPILL_SIZE));
+        assert(spill_regions_.back() != nullptr);
+    }
+    pmr_ = regions_[0]->buf + regions_[0]->dmaoff;
+
+    // before any clerk takes a chunk
+    Recover();
 
     std::thread uring(UringRun, ring_, this);
     uring.detach();
+    for(int i = 0; i < ingest_workers_; i++) {
+        std::thread ingest(IngestRun, this);
+        ingest.detach();
+    }
 }
 
 void PMRServer::Listen() {
-    // wait for the first client to connect
-    auto socket = Socket::make_socket(SERVER, port_);
-    int commu_fd = socket->GetFirst();
-    
-    // a infinite loop waiting for new connection
-    do {
+    if(datagrams_) {
+        ServeDatagrams(port_, [this]() {
+            return std::make_unique<PMRUdHandler>(this);
+        });
+        return ;
+    }
+
+    // set up every client connection on a helper thread, so that clients connect in parallel
+    Acceptor acceptor(port_, [this](int commu_fd) {
         // create a rdma context
-        auto [context, status] = rdma_device_->open();
+        int d = NextDevice();
+        auto [context, status] = devices_[d]->open();
         if(status != Status::Ok) {
             fprintf(stderr, "%s\n", decode_rdma_status(status).c_str());
+            close(commu_fd);
+            return ;
         }
 
-        #ifdef DMABUF
-            context->register_write_buf(dmabuf_fd_, 0, MAX_DMABUF_SIZE);
-        #else
-            context->register_write_buf(dmabuf_mem_, MAX_DMABUF_SIZE);
-        #endif
+        context->attach_write_buf(regions_[d]);
+        context->attach_export(index_regions_[d]);
+        context->attach_spill(spill_regions_[d]);
 
-        // exchange rdma context
-        if(context->default_connect(commu_fd) == -1) {
-            exit(-1);
+        // exchange rdma context, a failed client does not affect the others
+        if(context->default_connect(commu_fd) != 0) {
+            close(commu_fd);
+            return ;
         }
         
         // create a new thread to accept client request
-        std::unique_ptr<PMRClerk> new_clerk = std::make_unique<PMRClerk>(std::move(context), this, clerk_num_++);
-        std::thread th(&(PMRClerk::Run), std::move(new_clerk));
-        th.detach();
+        StartClerk(std::make_unique<PMRClerk>(std::move(context), this, clerk_num_++));
         fprintf(stderr, "Make a clerk serving...\n");
-
-        // wait for a client to connect
-        commu_fd = socket->NewChannel(port_);
-    } while (true);
+    });
+    acceptor.Run();
 }
 
-size_t PMRServer::AllocChunk() {
-    size_t slot = bitmap_.blindset();
-    // printf("alloc %lu\n", slot);
-    return slot;
+uint8_t * PMRServer::ChunkAddr(size_t chunkid) {
+    if(chunks_.TierOf(chunkid) == ChunkAllocator::PMR) {
+        return pmr_ + chunkid * MAX_ASYNC_SIZE;
+    }
+    return spill_mem_ + (chunkid - chunks_.Base(ChunkAllocator::SPILL)) * MAX_ASYNC_SIZE;
 }
 
 void PMRServer::FreeChunk(size_t chunkid) {
-    assert(chunkid < MAX_DMABUF_SIZE / MAX_ASYNC_SIZE);
-    assert(bitmap_.get(chunkid));
+    assert(chunkid < chunks_.Ids());
+    // its image is in the log, recovery must not find the chunk any more
+    ((ChunkHeader *)ChunkAddr(chunkid))->magic = 0;
+    open_[chunkid].store(0, std::memory_order_relaxed);
     // printf("free %lu\n", chunkid);
-    bitmap_.clear(chunkid);
+    chunks_.Free(chunkid);
 }
 
-float PMRServer::PeekUsage() {
-    uint32_t usage = 0;
-    for(int i = 0; i < MAX_DMABUF_SIZE / MAX_ASYNC_SIZE; i++) {
-        usage += MAX_ASYNC_SIZE * (bitmap_.get(i) ? 1 : 0);
+void PMRServer::OpenChunk(size_t chunkid) {
+    // a fence waits for the chunks given an earlier sequence to show up as open
+    opening_.fetch_add(1);
+    StartChunk((ChunkHeader *)ChunkAddr(chunkid), next_seq_.fetch_add(1), epoch_);
+    open_[chunkid].store(((ChunkHeader *)ChunkAddr(chunkid))->seq, std::memory_order_release);
+    opening_.fetch_sub(1);
+}
+
+void PMRServer::ReleaseChunk(size_t chunkid) {
+    if(holds_[chunkid].fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return ;
+    }
+    #ifdef COPY2DRAM
+        delete[] images_[chunkid];
+    #endif
+    images_[chunkid] = nullptr;
+    FreeChunk(chunkid);
+}
+
+void PMRServer::Ingest(SealedChunk && chunk) {
+    if(ingest_workers_ > 0) {
+        ingest_.Push(std::move(chunk));
+        return ;
+    }
+    std::vector<SealedChunk> batch;
+    batch.push_back(std::move(chunk));
+    PutChunks(batch);
+}
+
+void PMRServer::PutChunks(std::vector<SealedChunk> & batch) {
+    for(size_t i = 0; i < batch.size(); i++) {
+        SealedChunk & chunk = batch[i];
+        // the earlier chunks of a writer left the queue before, a later record of a key must win
+        bool first = std::none_of(batch.begin(), batch.begin() + i, [&chunk](const SealedChunk & c) {
+            return c.order == chunk.order;
+        });
+        while(first && chunk.order->ingested.load(std::memory_order_acquire) + 1 < chunk.ordinal) {
+            std::this_thread::yield();
+        }
+    }
+
+    // a delete or a direct put of a key goes between the records of it put before and those after
+    std::shared_lock<std::shared_mutex> lock(direct_mutex_);
+    std::vector<RecordBatch> records;
+    for(auto & chunk : batch) {
+        // only the records map_ still serves, of any writer a later one or a delete replaced the rest
+        size_t n = 0;
+        for(size_t j = 0; j < chunk.keys.size(); j++) {
+            uint32_t record = MAX_ASYNC_SIZE * chunk.id + CHUNK_HEADER + chunk.metas[j].fileaddr_.file_offset - sizeof(Request);
+            void * value = chunk.addr + CHUNK_HEADER + chunk.metas[j].fileaddr_.file_offset;
+            bool live = false;
+            map_.find_fn(chunk.keys[j], [value, &live](const Meta & m) { live = m.memaddr_ == value; });
+            if(!live) {
+                // the chunk may be reused once released, readers must not find its records any more
+                index_.Retire(chunk.keys[j].data(), chunk.keys[j].size(), record);
+                continue;
+            }
+            if(n != j) {
+                chunk.keys[n] = std::move(chunk.keys[j]);
+                chunk.metas[n] = chunk.metas[j];
+            }
+            n += 1;
+        }
+        chunk.keys.resize(n);
+        chunk.metas.resize(n);
+        records.push_back({&chunk.keys, &chunk.metas, chunk.image + CHUNK_HEADER, (int)chunk.head});
+    }
+    db_->PutBatches(records);
+
+    for(auto & chunk : batch) {
+        for(size_t i = 0; i < chunk.keys.size(); i++) {
+            uint32_t record = MAX_ASYNC_SIZE * chunk.id + CHUNK_HEADER + chunk.metas[i].fileaddr_.file_offset - sizeof(Request);
+            index_.Retire(chunk.keys[i].data(), chunk.keys[i].size(), record);
+            // a later record of the key, in a chunk switched to since, stays
+            void * value = chunk.addr + CHUNK_HEADER + chunk.metas[i].fileaddr_.file_offset;
+            map_.erase_fn(chunk.keys[i], [value](Meta & m) { return m.memaddr_ == value; });
+        }
+        chunk.order->ingested.store(chunk.ordinal, std::memory_order_release);
+    }
+    lock.unlock();
+    auto lag = std::chrono::steady_clock::now() - batch.front().sealed;
+    ingest_lag_us_.store(std::chrono::duration_cast<std::chrono::microseconds>(lag).count(), std::memory_order_relaxed);
+    for(auto & chunk : batch) {
+        ReleaseChunk(chunk.id);
+    }
+}
+
+/*
+ * LogCheckpoint: the log slot recovery starts from, kept in path_ + ".ckpt". It is written only
+ * after a database sync, so every chunk image before `offset` is in the database already.
+ */
+struct LogCheckpoint {
+    uint64_t offset;
+    uint64_t seq;      // next chunk sequence
+    uint32_t epoch;    // of the log slots after `offset`
+    uint32_t checksum;
+};
+
+static bool ReadCheckpoint(const std::string & path, LogCheckpoint * ckpt) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = read(fd, ckpt, sizeof(LogCheckpoint)) == sizeof(LogCheckpoint) && 
+              ckpt->checksum == Checksum(ckpt, offsetof(LogCheckpoint, checksum));
+    close(fd);
+    return ok;
+}
+
+static bool WriteCheckpoint(const std::string & path, LogCheckpoint ckpt) {
+    ckpt.checksum = Checksum(&ckpt, offsetof(LogCheckpoint, checksum));
+    // replace the old checkpoint at once
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, &ckpt, sizeof(ckpt)) == sizeof(ckpt) && fsync(fd) == 0;
+    close(fd);
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+/*
+ * Fence: what a delete or a direct put of a key leaves in the database, under FENCE_PREFIX and the
+ * key. Its records in the chunks that recovery finds are not in the order they were put in, so the
+ * fence tells those before it: a record came before it if its chunk was sealed by then, a sequence
+ * below `next` but not open, or if it is among the records its open chunk had committed. Recovery
+ * drops the fences once the database holds everything it found.
+ */
+static const std::string FENCE_PREFIX("\0\0pmr-fence/", 12);
+static const std::string FENCE_END("\0\0pmr-fence0", 12);
+
+struct Fence {
+    uint8_t op = DELETE;
+    uint64_t next = 0;                          // sequence of the next chunk taken
+    std::unordered_map<uint64_t, uint32_t> open; // committed bytes of the chunks open, by sequence
+
+    // whether the record at `offset` of the chunk `seq` came before the fence
+    bool Before(uint64_t seq, uint32_t offset) const {
+        if(seq >= next) {
+            return false;
+        }
+        auto it = open.find(seq);
+        return it == open.end() || offset < it->second;
+    }
+
+    std::string Encode() const {
+        std::string buf((char *)&op, sizeof(op));
+        buf.append((char *)&next, sizeof(next));
+        for(auto & [seq, length] : open) {
+            buf.append((char *)&seq, sizeof(seq));
+            buf.append((char *)&length, sizeof(length));
+        }
+        return buf;
+    }
+
+    bool Decode(const std::string & buf) {
+        const size_t entry = sizeof(uint64_t) + sizeof(uint32_t);
+        if(buf.size() < sizeof(op) + sizeof(next) || (buf.size() - sizeof(op) - sizeof(next)) % entry != 0) {
+            return false;
+        }
+        memcpy(&op, buf.data(), sizeof(op));
+        memcpy(&next, buf.data() + sizeof(op), sizeof(next));
+        for(size_t pos = sizeof(op) + sizeof(next); pos < buf.size(); pos += entry) {
+            uint64_t seq;
+            uint32_t length;
+            memcpy(&seq, buf.data() + pos, sizeof(seq));
+            memcpy(&length, buf.data() + pos + sizeof(seq), sizeof(length));
+            open[seq] = length;
+        }
+        return true;
+    }
+};
+
+void PMRServer::PutFence(std::string & key, Operation op) {
+    if(!durable_) {
+        return ;
+    }
+    Fence fence;
+    fence.op = op;
+    fence.next = next_seq_.load();
+    while(opening_.load() > 0) {
+        std::this_thread::yield();
+    }
+    for(size_t i = 0; i < chunks_.Ids(); i++) {
+        uint64_t seq = open_[i].load(std::memory_order_acquire);
+        if(seq != 0 && seq < fence.next) {
+            fence.open[seq] = CommitLength(((ChunkHeader *)ChunkAddr(i))->commit.load(std::memory_order_acquire));
+        }
+    }
+    std::string fence_key = FENCE_PREFIX + key;
+    std::string fence_val = fence.Encode();
+    db_->Put(fence_key, fence_val);
+}
+
+void PMRServer::Checkpoint(off_t offset) {
+    if(!db_->Sync()) {
+        return ;
+    }
+    WriteCheckpoint(path_ + ".ckpt", {(uint64_t)offset, next_seq_.load(), epoch_, 0});
+}
+
+void PMRServer::Recover() {
+    // a database lost with the process has nothing to recover into
+    if(!db_->Sync()) {
+        return ;
+    }
+    durable_ = true;
+
+    LogCheckpoint ckpt{0, 1, 0, 0};
+    ReadCheckpoint(path_ + ".ckpt", &ckpt);
+
+    struct Image {
+        std::unique_ptr<uint8_t[]> buf;
+        std::vector<std::string> keys;
+        std::vector<Meta> metas;
+        uint64_t seq;
+        bool valid;
+    };
+    std::vector<Image> images;
+
+    // the log slots after the checkpoint, up to a run of invalid ones longer than the writes in flight
+    off_t offset = ckpt.offset, tail = ckpt.offset;
+    for(int invalid = 0; invalid <= LOG_QUEUE_DEPTH; offset += MAX_ASYNC_SIZE) {
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[MAX_ASYNC_SIZE]);
+        const ChunkHeader * header = (const ChunkHeader *)buf.get();
+        if(pread(log_fd_, buf.get(), MAX_ASYNC_SIZE, offset) != MAX_ASYNC_SIZE || 
+           header->magic != CHUNK_MAGIC || header->epoch != ckpt.epoch) {
+            invalid += 1;
+            continue;
+        }
+        invalid = 0;
+        tail = offset + MAX_ASYNC_SIZE;
+        images.push_back({std::move(buf), {}, {}, header->seq, false});
+    }
+    size_t logged = images.size();
+
+    // the chunks in the buffer whose image may not be in the log
+    for(size_t i = 0; i < MAX_DMABUF_SIZE / MAX_ASYNC_SIZE; i++) {
+        const ChunkHeader * header = (const ChunkHeader *)(pmr_ + i * MAX_ASYNC_SIZE);
+        if(header->magic != CHUNK_MAGIC || header->epoch != ckpt.epoch) {
+            continue;
+        }
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[MAX_ASYNC_SIZE]);
+        memcpy(buf.get(), header, MAX_ASYNC_SIZE);
+        images.push_back({std::move(buf), {}, {}, header->seq, false});
+    }
+
+    // verify and parse the images, a torn one is dropped with all its records
+    auto parallel = [&images](std::function<void(Image &)> func) {
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> workers;
+        for(unsigned t = 0; t < std::max(1u, std::thread::hardware_concurrency()); t++) {
+            workers.emplace_back([&]() {
+                for(size_t i = next++; i < images.size(); i = next++) {
+                    func(images[i]);
+                }
+            });
+        }
+        for(auto & worker : workers) {
+            worker.join();
+        }
+    };
+    parallel([](Image & image) {
+        image.valid = ParseChunk(image.buf.get(), MAX_ASYNC_SIZE, &image.keys, &image.metas);
+    });
+
+    // the fences of the keys found, left by the deletes and direct puts since the checkpoint
+    std::unordered_map<std::string, Fence> fences;
+    {
+        std::unordered_set<std::string> found_keys;
+        std::vector<std::string> fence_keys;
+        for(auto & image : images) {
+            for(size_t i = 0; image.valid && i < image.keys.size(); i++) {
+                if(found_keys.insert(image.keys[i]).second) {
+                    fence_keys.push_back(FENCE_PREFIX + image.keys[i]);
+                }
+            }
+        }
+        std::vector<std::string> vals;
+        std::vector<bool> found;
+        db_->GetBatch(fence_keys, &vals, &found);
+        for(size_t i = 0; i < fence_keys.size(); i++) {
+            Fence fence;
+            if(found[i] && fence.Decode(vals[i])) {
+                fences.emplace(fence_keys[i].substr(FENCE_PREFIX.size()), std::move(fence));
+            }
+        }
+    }
+
+    // the latest record of every key wins, a chunk in the buffer may repeat one in the log. A record
+    // from before the fence of its key is out, the delete or direct put replaced it.
+    std::stable_sort(images.begin(), images.end(), [](const Image & a, const Image & b) {
+        return a.seq < b.seq;
+    });
+    std::unordered_map<std::string, std::pair<Image *, size_t>> latest;
+    uint64_t max_seq = 0;
+    size_t torn = 0, fenced = 0;
+    for(auto & image : images) {
+        if(!image.valid) {
+            torn += 1;
+            continue;
+        }
+        max_seq = std::max(max_seq, image.seq);
+        for(size_t i = 0; i < image.keys.size(); i++) {
+            auto fence = fences.find(image.keys[i]);
+            if(fence != fences.end() && fence->second.Before(image.seq, image.metas[i].fileaddr_.file_offset - sizeof(Request))) {
+                fenced += 1;
+                continue;
+            }
+            latest[image.keys[i]] = {&image, i};
+        }
+    }
+
+    // a delete the process died in may not have reached the database
+    for(auto & [key, fence] : fences) {
+        if(fence.op == DELETE && latest.find(key) == latest.end()) {
+            std::string k = key;
+            db_->Delete(k);
+        }
+    }
+
+    // put the records the database lacks, chunk by chunk
+    std::atomic<size_t> replayed{0};
+    parallel([&latest, &replayed, this](Image & image) {
+        std::vector<std::string> keys;
+        std::vector<Meta> metas;
+        for(size_t i = 0; i < image.keys.size(); i++) {
+            auto it = latest.find(image.keys[i]);
+            if(it != latest.end() && it->second.first == &image && it->second.second == i) {
+                keys.push_back(image.keys[i]);
+                metas.push_back(image.metas[i]);
+            }
+        }
+        if(keys.empty()) {
+            return ;
+        }
+
+        uint8_t * records = image.buf.get() + CHUNK_HEADER;
+        std::vector<std::string> vals;
+        std::vector<bool> found;
+        db_->GetBatch(keys, &vals, &found);
+        size_t n = 0;
+        for(size_t i = 0; i < keys.size(); i++) {
+            const Meta & m = metas[i];
+            if(found[i] && vals[i].compare(0, std::string::npos, 
+                    (char *)records + m.fileaddr_.file_offset + m.key_size_, m.value_size_) == 0) {
+                continue;
+            }
+            if(n != i) {
+                keys[n] = std::move(keys[i]);
+                metas[n] = metas[i];
+            }
+            n += 1;
+        }
+        keys.resize(n);
+        metas.resize(n);
+        if(n > 0) {
+            db_->PutBatch(keys, metas, records, CHUNK_SPACE);
+            replayed += n;
+        }
+    });
+
+    // the new epoch starts after the slots read, once the database holds all of them
+    if(!db_->Sync()) {
+        fprintf(stderr, "PMRServer recovery: database sync failed\n");
+        exit(-1);
+    }
+    next_seq_ = std::max(ckpt.seq, max_seq + 1);
+    epoch_ = ckpt.epoch + 1;
+    if(!WriteCheckpoint(path_ + ".ckpt", {(uint64_t)tail, next_seq_.load(), epoch_, 0})) {
+        fprintf(stderr, "PMRServer recovery: checkpoint write failed\n");
+        exit(-1);
+    }
+    for(size_t i = 0; i < MAX_DMABUF_SIZE / MAX_ASYNC_SIZE; i++) {
+        ((ChunkHeader *)(pmr_ + i * MAX_ASYNC_SIZE))->magic = 0;
+    }
+    ring_->Seek(tail);
+
+    // no record before the new checkpoint is found again, the fences have nothing left to tell
+    for(ScanEntries stale; ; stale.clear()) {
+        std::string start = FENCE_PREFIX, end = FENCE_END;
+        if(!db_->Scan(start, end, 1024, &stale) || stale.empty()) {
+            break;
+        }
+        for(auto & entry : stale) {
+            db_->Delete(entry.first);
+        }
+    }
+
+    if(!images.empty()) {
+        fprintf(stderr, "PMRServer recovery: %lu chunks from the log, %lu from the buffer, %lu torn, %lu records replayed, %lu fenced off\n",
+                logged, images.size() - logged, torn, replayed.load(), fenced);
+    }
+}
+
+void PMRServer::Get(std::string key, RequestReply * reply, uint32_t capacity) {
+    std::string value;
+    Meta mem_idx;
+    const char * found = nullptr;
+    uint32_t length = 0;
+    if(map_.find(key, mem_idx)) {
+        found = (char *)mem_idx.memaddr_ + key.size();
+        length = mem_idx.value_size_;
+    } else if(db_->Get(key, &value)) {
+        found = value.data();
+        length = value.size();
     }
-    // printf("in use %u\n", usage);
-    return (float)usage / MAX_DMABUF_SIZE;
+
+    if(found == nullptr) {
+        reply->status = RequestStatus::NOTFOUND;
+        reply->val_size = 0;
+    } else if(length > capacity) {
+        reply->status = RequestStatus::LARGE;
+        reply->val_size = sizeof(uint32_t);
+        memcpy(reply->value, &length, sizeof(uint32_t));
+    } else {
+        reply->status = RequestStatus::OK;
+        reply->val_size = length;
+        memcpy(reply->value, found, length);
+    }
+}
+
+bool PMRServer::Find(std::string key, std::string * val) {
+    Meta mem_idx;
+    if(map_.find(key, mem_idx)) {
+        val->assign((char *)mem_idx.memaddr_ + key.size(), mem_idx.value_size_);
+        return true;
+    }
+    return db_->Get(key, val);
+}
+
+bool PMRServer::PutDirect(std::string key, std::string & val) {
+    std::unique_lock<std::shared_mutex> lock(direct_mutex_);
+    index_.Retire(key.data(), key.size(), UINT32_MAX);
+    map_.erase(key);
+    PutFence(key, LPUT);
+    return db_->Put(key, val);
+}
+
+bool PMRServer::Remove(std::string key) {
+    std::unique_lock<std::shared_mutex> lock(direct_mutex_);
+    index_.Retire(key.data(), key.size(), UINT32_MAX);
+    bool buffered = map_.erase(key);
+    PutFence(key, DELETE);
+    bool stored = db_->Delete(key);
+    return buffered || stored;
+}
+
+void PMRServer::Delete(std::string key, RequestReply * reply) {
+    if(Remove(key)) {
+        reply->status = RequestStatus::OK;
+    } else {
+        reply->status = RequestStatus::NOTFOUND;
+    }
+    reply->val_size = 0;
+}
+
+void PMRServer::MultiGet(Request * request, RequestReply * reply, uint32_t capacity) {
+    std::vector<std::string> keys = MultiKeys(request);
+    std::vector<std::string> vals(keys.size());
+    std::vector<bool> found(keys.size(), false);
+    std::vector<std::string> missing;
+    std::vector<int> missing_index;
+    for(size_t i = 0; i < keys.size(); i++) {
+        Meta mem_idx;
+        if(map_.find(keys[i], mem_idx)) {
+            vals[i].assign((char *)mem_idx.memaddr_ + keys[i].size(), mem_idx.value_size_);
+            found[i] = true;
+        } else {
+            missing.push_back(keys[i]);
+            missing_index.push_back(i);
+        }
+    }
+    if(!missing.empty()) {
+        std::vector<std::string> missing_vals;
+        std::vector<bool> missing_found;
+        db_->GetBatch(missing, &missing_vals, &missing_found);
+        for(size_t j = 0; j < missing.size(); j++) {
+            vals[missing_index[j]] = std::move(missing_vals[j]);
+            found[missing_index[j]] = missing_found[j];
+        }
+    }
+
+    // keep room for the length of every key after the one packed
+    uint32_t used = 0;
+    for(size_t i = 0; i < keys.size(); i++) {
+        uint32_t length = found[i] ? vals[i].size() : MULTI_MISSING;
+        uint32_t rest = (keys.size() - i - 1) * sizeof(uint32_t);
+        if(found[i] && used + sizeof(uint32_t) + length + rest > capacity) {
+            length = MULTI_RETRY;
+        }
+        memcpy(reply->value + used, &length, sizeof(uint32_t));
+        used += sizeof(uint32_t);
+        if(length < MULTI_RETRY) {
+            memcpy(reply->value + used, vals[i].data(), length);
+            used += length;
+        }
+    }
+    reply->status = RequestStatus::OK;
+    reply->val_size = used;
+}
+
+void PMRServer::MultiDelete(Request * request, RequestReply * reply) {
+    std::vector<std::string> keys = MultiKeys(request);
+    for(size_t i = 0; i < keys.size(); i++) {
+        reply->value[i] = Remove(keys[i]) ? RequestStatus::OK : RequestStatus::NOTFOUND;
+    }
+    reply->status = RequestStatus::OK;
+    reply->val_size = keys.size();
+}
+
+void PMRServer::Scan(Request * request, RequestReply * reply, uint32_t capacity) {
+    std::string start, end;
+    uint32_t limit;
+    ScanArgs(request, &start, &end, &limit);
+    // no more than a page can hold
+    uint32_t page = std::min<uint32_t>(limit, capacity / (2 * sizeof(uint32_t)));
+    ScanEntries stored;
+    if(!db_->Scan(start, end, page, &stored)) {
+        reply->status = RequestStatus::ERROR;
+        reply->val_size = 0;
+        return ;
+    }
+    // the fences of deletes and direct puts are not entries
+    stored.erase(std::remove_if(stored.begin(), stored.end(), [](const std::pair<std::string, std::string> & entry) {
+        return entry.first.compare(0, FENCE_PREFIX.size(), FENCE_PREFIX) == 0;
+    }), stored.end());
+
+    // the records not put into the database yet, from the chunks open or waiting for their ingest. A
+    // key in range is looked up on its own and taken if map_ still serves that record, the value is
+    // copied under the lock of its entry, which an ingest erases before the chunk is freed.
+    ScanEntries recent;
+    for(size_t id = 0; id < chunks_.Ids(); id++) {
+        if(open_[id].load(std::memory_order_acquire) == 0 && holds_[id].load(std::memory_order_acquire) == 0) {
+            continue;
+        }
+        uint8_t * records = ChunkAddr(id) + CHUNK_HEADER;
+        uint32_t length = std::min<uint32_t>(CHUNK_SPACE, CommitLength(((ChunkHeader *)ChunkAddr(id))->commit.load(std::memory_order_acquire)));
+        // the chunk may be freed and reused meanwhile, a record that does not fit ends the walk
+        for(uint64_t pos = 0, size; pos + sizeof(Request) <= length; pos += size) {
+            Request * record = (Request *)(records + pos);
+            size = (uint64_t)sizeof(Request) + record->key_size + record->val_size;
+            if(pos + size > length) {
+                break;
+            }
+            std::string key(record->keyvalue, record->key_size);
+            if(key < start || (!end.empty() && key >= end)) {
+                continue;
+            }
+            map_.find_fn(key, [&](const Meta & m) {
+                if(m.memaddr_ == record->keyvalue) {
+                    recent.emplace_back(key, std::string((char *)m.memaddr_ + key.size(), m.value_size_));
+                }
+            });
+        }
+    }
+    std::sort(recent.begin(), recent.end());
+
+    // merge both, a record in memory replaces the entry of the database
+    ScanEntries entries;
+    auto s = stored.begin(), r = recent.begin();
+    while(entries.size() < page && (s != stored.end() || r != recent.end())) {
+        if(s == stored.end() || (r != recent.end() && r->first <= s->first)) {
+            if(s != stored.end() && s->first == r->first) ++s;
+            entries.push_back(std::move(*r++));
+        } else {
+            entries.push_back(std::move(*s++));
+        }
+    }
+    ScanPack(entries, page < limit && entries.size() == page, reply, capacity);
+}
+
+float PMRServer::PeekUsage() {
+    return (float)chunks_.InUse() / chunks_.Chunks();
 }
 
 } // namespace frontend
\ No newline at end of file
@@ -5,11 +5,17 @@
 #include <cstdio>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <queue>
+#include <tuple>
 
 #include "libcuckoo/cuckoohash_map.h"
-#include "atomicbitset.h"
+#include "chunkalloc.h"
+#include "ingest.h"
 #include "uring.h"
+#include "concurrentqueue.h"
+#include "index.h"
+#include "chunk.h"
 #include "../cs.h"
 
 #ifdef DMABUF
@@ -24,8 +30,99 @@ namespace frontend {
 
 class PMRServer;
 
+/*
+ * ChunkWriter: the chunk of the PMR buffer records are appended to. They are served from
+ * PMRServer::map_ until the chunk is switched and handed over, then until an ingest worker put them
+ * into the database, while the chunk is queued to be written to the log. The writer holds a spare
+ * chunk the client switches to without waiting, and a switched chunk is only handed over by
+ * Retire(), once the replies went out. A chunk
+ * spilled to host DRAM is not persistent, so its records are written to the log with Sync() before
+ * they are acknowledged.
+ */
+class ChunkWriter {
+public:
+    ChunkWriter(PMRServer * server);
+
+    // the offset of the records of the chunk in the buffer, UINT32_MAX before the first Switch()
+    inline uint32_t Offset() const {
+        return OffsetOf(current_.id);
+    }
+
+    // the offset of the records of the spare chunk, UINT32_MAX without one
+    inline uint32_t Spare() const {
+        return OffsetOf(spare_);
+    }
+
+    inline uint32_t Head() const {
+        return current_.head;
+    }
+
+    // whether a record of `length` bytes fits in the chunk in use
+    inline bool Fits(uint32_t length) const {
+        return current_.id != ChunkAllocator::NIL && current_.head + length < CHUNK_SPACE;
+    }
+
+    // where the next record goes
+    inline uint8_t * Tail() {
+        return current_.addr + CHUNK_HEADER + current_.head;
+    }
+
+    // whether the chunk in use was spilled to host DRAM
+    inline bool Spilled() const {
+        return current_.spilled;
+    }
+
+    // make the record written at Tail() visible
+    void Append();
+
+    // switch to the spare chunk and take a new spare if one is free. If `wait` or without a spare, the
+    // switched chunks are retired and a chunk to switch to is waited for.
+    void Switch(bool wait);
+
+    // hand the records of the switched chunks over
+    void Retire();
+
+    // hand the records of all chunks over and give the spare back
+    void Close();
+
+    // wait for the records of spilled chunks to be in the log, before they are acknowledged
+    void Sync();
+
+private:
+    // a chunk records are appended to
+    struct Chunk {
+        uint32_t id = ChunkAllocator::NIL;
+        uint8_t * addr = nullptr; // local address
+        uint32_t head = 0;        // bytes of records
+        uint32_t synced = 0;      // bytes of records of a spilled chunk in the log
+        bool spilled = false;
+        // its records, put into the database when the chunk is handed over
+        std::vector<std::string> keys;
+        std::vector<Meta> metas;
+    };
+
+    static inline uint32_t OffsetOf(uint32_t chunkid) {
+        return chunkid == ChunkAllocator::NIL ? UINT32_MAX : MAX_ASYNC_SIZE * chunkid + CHUNK_HEADER;
+    }
+
+    // a chunk with its header started, NIL if `wait` is not set and none is free
+    uint32_t Take(bool wait);
+
+    void Sync(Chunk & chunk);
+
+    // queue a chunk to be written to the log and its records to be put into the database
+    void Flush(Chunk & chunk);
+
+    PMRServer * server_;
+    ChunkCache cache_;           // chunks taken ahead from the server
+    Chunk current_;
+    uint32_t spare_;             // the chunk the client switches to next
+    std::vector<Chunk> sealed_;  // switched chunks waiting for Retire()
+    std::shared_ptr<IngestOrder> order_; // of the chunks handed over
+};
+
 /* PMRClerk: sync on every operation, but write do not sync to disk immediately */
-class PMRClerk {
+class PMRClerk : public Clerk {
 public: 
     PMRClerk(std::unique_ptr<RDMAContext> ctx, PMRServer *server, int id);
 
@@ -33,47 +130,172 @@ public:
         fprintf(stderr,"closing a clerk\n");
     }
 
-    static void Run(std::unique_ptr<PMRClerk> clk);
+    int Poll();
+
+    void Idle() {
+        ring_.Idle();
+    }
+
+    const RDMAUtil::PollStats & Stats() const {
+        return ring_.Stats();
+    }
+
+private:
+    // serve a single request, return false for the close request
+    bool Serve(Request * request);
+
+    // read the value an LPUT refers to from the client, into the chunk or on its own
+    void PutLarge(Request * request, RequestReply * reply);
+
+    // read the value an LPUT refers to into `dst`, in segments staged in the send buffer
+    void ReadSegments(const ValueRef & ref, char * dst);
+
+    // write a value to the write buffer of the client in segments staged in the send buffer
+    void Stream(const std::string & value);
 
 private:
     std::unique_ptr<RDMAContext> context_;
-    DBType * db_;
-    uint8_t * send_buf_;
-    uint8_t * write_buf_;
-    uint32_t buf_head_;
-    uint32_t chunk_offset_;
+    ClerkRing ring_;
     PMRServer * server_;
+    ChunkWriter writer_; // the chunk the client writes its records to
     int clerk_id_;
 };
 
+/* PMRUdHandler: serves datagram clients, whose records the server copies into a chunk of its own */
+class PMRUdHandler : public UdHandler {
+public:
+    PMRUdHandler(PMRServer * server);
+
+    void Serve(Request * request, RequestReply * reply);
+
+private:
+    PMRServer * server_;
+    ChunkWriter writer_;
+};
+
 class PMRServer : Server {
 public:
     PMRServer(MyOption opt, DBType * db);
 
     void Listen();
 
-    size_t AllocChunk();
-
     void FreeChunk(size_t);
 
+    // a sealed chunk is freed once its image is in the log and its records are in the database
+    void ReleaseChunk(size_t chunkid);
+
+    // whether the records of the last sealed use of a chunk are in the database
+    inline bool Ingested(size_t chunkid) const {
+        return holds_[chunkid].load(std::memory_order_acquire) == 0;
+    }
+
+    // put the records of a sealed chunk into the database, on an ingest worker if there are any
+    void Ingest(SealedChunk && chunk);
+
+    // put the records of sealed chunks into the database with a single write, after the earlier
+    // chunks of their writers. A record map_ no longer maps its key to was overwritten or deleted since,
+    // and is skipped.
+    void PutChunks(std::vector<SealedChunk> & batch);
+
     float PeekUsage();
 
+    // sealed chunks waiting for an ingest worker
+    inline size_t IngestDepth() const {
+        return ingest_.Depth();
+    }
+
+    // microseconds from sealing to the database, of the chunks ingested last
+    inline int64_t IngestLag() const {
+        return ingest_lag_us_.load(std::memory_order_relaxed);
+    }
+
+    // local address of a chunk, in the PMR buffer or the spill pool
+    uint8_t * ChunkAddr(size_t chunkid);
+
+    // start the header of a chunk a writer took, with the next sequence
+    void OpenChunk(size_t chunkid);
+
+    // note that the log before `offset` and the database hold every chunk freed so far
+    void Checkpoint(off_t offset);
+
+    // answer a get from the records in memory or the database, a value of more than `capacity`
+    // bytes is answered LARGE with its length
+    void Get(std::string key, RequestReply * reply, uint32_t capacity);
+
+    // the value of `key` from the records in memory or the database
+    bool Find(std::string key, std::string * val);
+
+    // put a value too large for a chunk into the database directly, the records of the key still
+    // buffered are not ingested any more, nor replayed by a recovery
+    bool PutDirect(std::string key, std::string & val);
+
+    // delete `key` from the records in memory and the database, true if it was found. The records of
+    // it still buffered, by any writer, are not ingested any more, nor replayed by a recovery.
+    bool Remove(std::string key);
+
+    void Delete(std::string key, RequestReply * reply);
+
+    // answer an MGET with one pass over the records in memory and one database lookup for the rest,
+    // packing at most `capacity` bytes of values into the reply
+    void MultiGet(Request * request, RequestReply * reply, uint32_t capacity);
+
+    // answer an MDELETE with a status per key
+    void MultiDelete(Request * request, RequestReply * reply);
+
+    // answer a SCAN from the database, with the records in memory merged in as the newer ones
+    void Scan(Request * request, RequestReply * reply, uint32_t capacity);
+
 public:
-    std::unique_ptr<RDMADevice> rdma_device_;
     DBType * db_;
-    int clerk_num_;
+    std::atomic<int> clerk_num_{0}; // connections set up by the acceptor helpers
     int port_;
+    Notify notify_;
     std::string path_;
     HashType map_;
+    // shared by the ingests, held alone by the deletes and direct puts that erase keys from map_
+    std::shared_mutex direct_mutex_;
+    ReadIndex index_;                      // recent records of map_, exported for one-sided gets
+    std::vector<const RDMAUtil::MemoryRegion *> index_regions_; // by device
 
     IOuring * ring_;
-    AtomicBitset bitmap_;
+    int log_fd_;
+    bool durable_ = false;              // whether the database outlives the process, for Recover()
+    std::atomic<uint64_t> next_seq_{1}; // of the next chunk taken
+    std::atomic<int> opening_{0};       // chunks given a sequence but not marked open yet
+    uint32_t epoch_ = 0;                // of the chunks taken since the last recovery
+    ChunkAllocator chunks_;
+    // chunks waiting to be written to the log by the uring thread: (buffer, length, chunk id, flag, offset
+    // in the slot). Full chunks come without a flag, the part of a spilled chunk a clerk syncs comes with
+    // the flag set once it is written.
+    moodycamel::ConcurrentQueue<std::tuple<void *, uint32_t, size_t, std::atomic<bool> *, uint32_t>> flush_queue_;
+    std::unique_ptr<std::atomic<int>[]> holds_; // of a sealed chunk, by the log write and the ingest
+    std::unique_ptr<uint8_t *[]> images_;       // of the sealed chunks, copied for the log and the ingest
+    std::unique_ptr<std::atomic<uint64_t>[]> open_; // sequence of the chunks writers append to, 0 for the rest
+
+    IngestQueue ingest_;   // sealed chunks, unless the clerks ingest them
+    int ingest_workers_;
+    int ingest_merge_;     // chunks a worker puts with one database write
+    std::atomic<int64_t> ingest_lag_us_{0};
     
     #ifdef DMABUF
         int dmabuf_fd_;
     #else
         uint8_t * dmabuf_mem_;
     #endif
+    std::vector<const RDMAUtil::MemoryRegion *> regions_; // the buffer above, registered once per device
+    uint8_t * pmr_; // local mapping of the buffer
+
+    uint8_t * spill_mem_; // chunks taken once the buffer has no free one, in host DRAM
+    std::vector<const RDMAUtil::MemoryRegion *> spill_regions_; // by device
+
+private:
+    // leave the fence of a delete or a direct put of `key` in the database, for Recover() to tell the
+    // records of the key that came before it
+    void PutFence(std::string & key, Operation op);
+
+    // re-ingest the acknowledged records the database may lack, from the chunks left in the buffer
+    // and the log images after the last checkpoint
+    void Recover();
 };
 
 } // namespace frontend
\ No newline at end of file
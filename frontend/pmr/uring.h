@@ -78,12 +78,27 @@ public:
         inflight_ += 1;
     }
 
-    void Write(void * buf, int size, __u64 data) {
+    // append `size` bytes, the next write goes `stride` bytes further if given
+    void Write(void * buf, int size, __u64 data, off_t stride = 0) {
+        WriteAt(buf, size, data, offset_);
+        offset_ += stride > 0 ? stride : size;
+    }
+
+    // write `size` bytes at `offset`, leaving the append offset as it is
+    void WriteAt(void * buf, int size, __u64 data, off_t offset) {
         auto sqe = io_uring_get_sqe(&ring_);
-        io_uring_prep_write(sqe, fd_, buf, size, offset_);
+        io_uring_prep_write(sqe, fd_, buf, size, offset);
         io_uring_sqe_set_data64(sqe, data);
         inflight_ += 1;
-        offset_ += size;
+    }
+
+    // where the next write goes
+    inline off_t Offset() const {
+        return offset_;
+    }
+
+    inline void Seek(off_t offset) {
+        offset_ = offset;
     }
 
     inline bool Full() {
@@ -1,9 +1,14 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-enum Operation {PUT, GET, UPDATE, DELETE, CLOSE, ALLOC};
-enum RequestStatus {OK, NOTFOUND, ERROR};
+enum Operation {PUT, GET, UPDATE, DELETE, CLOSE, ALLOC, WBATCH, MGET, MDELETE, LPUT, LGET, SCAN, NEXT};
+enum RequestStatus {OK, NOTFOUND, ERROR, LARGE};
 
 struct Request {
     uint32_t op : 8;
@@ -22,4 +27,152 @@ struct RequestReply {
     char value[0];
 };
 
-const int MAX_REQUEST = 4096;
\ No newline at end of file
+const int MAX_REQUEST = 4096;
+
+/*
+ * Large values travel outside of the request: an LPUT carries a ValueRef as its value, and the server
+ * reads the value from the client's memory. A get of a value that does not fit in the reply is
+ * answered LARGE with the uint32_t length of the value, an LGET then has the server write the value
+ * to the client's write buffer and reply with its length.
+ */
+struct ValueRef {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+};
+
+/*
+ * MGET and MDELETE carry many keys: the key_size bytes after the Request hold a uint32_t count, then
+ * a uint16_t length and the key for each of them. An MGET reply holds a uint32_t length and the value
+ * for each key, MULTI_MISSING for a key not found and MULTI_RETRY for one whose value did not fit in
+ * the reply any more. An MDELETE reply holds a status byte for each key.
+ */
+const uint32_t MULTI_MISSING = UINT32_MAX;
+const uint32_t MULTI_RETRY   = UINT32_MAX - 1;
+
+// start an MGET or MDELETE of no keys
+inline void MultiInit(Request * request, Operation op) {
+    request->op = op;
+    request->key_size = sizeof(uint32_t);
+    request->val_size = 0;
+    memset(request->keyvalue, 0, sizeof(uint32_t));
+}
+
+// append a key if the request stays within `limit` bytes
+inline bool MultiAdd(Request * request, const std::string & key, uint32_t limit) {
+    if(request->Length() + sizeof(uint16_t) + key.size() > limit) {
+        return false;
+    }
+    char * pos = request->keyvalue + request->key_size;
+    uint16_t len = key.size();
+    memcpy(pos, &len, sizeof(uint16_t));
+    memcpy(pos + sizeof(uint16_t), key.data(), len);
+    request->key_size += sizeof(uint16_t) + len;
+    uint32_t count;
+    memcpy(&count, request->keyvalue, sizeof(uint32_t));
+    count += 1;
+    memcpy(request->keyvalue, &count, sizeof(uint32_t));
+    return true;
+}
+
+// the keys of an MGET or MDELETE
+inline std::vector<std::string> MultiKeys(Request * request) {
+    uint32_t count;
+    memcpy(&count, request->keyvalue, sizeof(uint32_t));
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    const char * pos = request->keyvalue + sizeof(uint32_t);
+    const char * end = request->keyvalue + request->key_size;
+    for(uint32_t i = 0; i < count && pos + sizeof(uint16_t) <= end; i++) {
+        uint16_t len;
+        memcpy(&len, pos, sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+        if(pos + len > end) {
+            break;
+        }
+        keys.emplace_back(pos, len);
+        pos += len;
+    }
+    return keys;
+}
+
+/*
+ * SCAN asks for up to `limit` entries in key order from its key on, before the end key unless that
+ * is empty: the value of the request is a uint32_t limit followed by the end key. A reply is a page
+ * of a uint32_t count and a uint32_t flag set when the page ran full, then a uint32_t key length, a
+ * uint32_t value length, the key and the value for each entry. SCAN_LARGE stands for the value length
+ * of an entry whose value did not fit in any page, its value is left out. A client asks for the rest
+ * of a full page with a SCAN from right after its last key.
+ */
+const uint32_t SCAN_LARGE = UINT32_MAX;
+
+using ScanEntries = std::vector<std::pair<std::string, std::string>>;
+
+inline void ScanInit(Request * request, std::string_view start, std::string_view end, uint32_t limit) {
+    request->op = SCAN;
+    request->key_size = start.size();
+    request->val_size = sizeof(uint32_t) + end.size();
+    memcpy(request->keyvalue, start.data(), start.size());
+    memcpy(request->keyvalue + start.size(), &limit, sizeof(uint32_t));
+    memcpy(request->keyvalue + start.size() + sizeof(uint32_t), end.data(), end.size());
+}
+
+inline void ScanArgs(Request * request, std::string * start, std::string * end, uint32_t * limit) {
+    start->assign(request->keyvalue, request->key_size);
+    memcpy(limit, request->keyvalue + request->key_size, sizeof(uint32_t));
+    end->assign(request->keyvalue + request->key_size + sizeof(uint32_t), request->val_size - sizeof(uint32_t));
+}
+
+// pack entries into a page of at most `capacity` bytes, return the number packed, `more` marks the
+// page full even if all of them fit, as the range may hold entries after them
+inline uint32_t ScanPack(const ScanEntries & entries, bool more, RequestReply * reply, uint32_t capacity) {
+    uint32_t count = 0, full = more, used = 2 * sizeof(uint32_t);
+    for(auto & [key, val] : entries) {
+        uint32_t head = 2 * sizeof(uint32_t) + key.size();
+        // a value no page can hold is left out, the client gets it on its own
+        uint32_t length = head + val.size() > capacity - 2 * sizeof(uint32_t) ? SCAN_LARGE : val.size();
+        uint32_t need = head + (length == SCAN_LARGE ? 0 : length);
+        if(used + need > capacity) {
+            full = 1;
+            break;
+        }
+        uint32_t key_len = key.size();
+        memcpy(reply->value + used, &key_len, sizeof(uint32_t));
+        memcpy(reply->value + used + sizeof(uint32_t), &length, sizeof(uint32_t));
+        memcpy(reply->value + used + 2 * sizeof(uint32_t), key.data(), key.size());
+        if(length != SCAN_LARGE) {
+            memcpy(reply->value + used + head, val.data(), length);
+        }
+        used += need;
+        count += 1;
+    }
+    memcpy(reply->value, &count, sizeof(uint32_t));
+    memcpy(reply->value + sizeof(uint32_t), &full, sizeof(uint32_t));
+    reply->status = RequestStatus::OK;
+    reply->val_size = used;
+    return count;
+}
+
+// append the entries of a page, the indices of those left out for SCAN_LARGE go to `large`
+inline bool ScanUnpack(RequestReply * reply, ScanEntries * entries, std::vector<int> * large) {
+    uint32_t count, full;
+    memcpy(&count, reply->value, sizeof(uint32_t));
+    memcpy(&full, reply->value + sizeof(uint32_t), sizeof(uint32_t));
+    const char * pos = reply->value + 2 * sizeof(uint32_t);
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t key_len, length;
+        memcpy(&key_len, pos, sizeof(uint32_t));
+        memcpy(&length, pos + sizeof(uint32_t), sizeof(uint32_t));
+        pos += 2 * sizeof(uint32_t);
+        std::string key(pos, key_len);
+        pos += key_len;
+        if(length == SCAN_LARGE) {
+            large->push_back(entries->size());
+            entries->emplace_back(std::move(key), std::string());
+        } else {
+            entries->emplace_back(std::move(key), std::string(pos, length));
+            pos += length;
+        }
+    }
+    return full != 0;
+}
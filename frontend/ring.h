@@ -0,0 +1,383 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <cassert>
+#include <cstring>
+
+#include "rdmautil.h"
+#include "request.h"
+
+namespace frontend {
+
+/*
+ * Request and reply rings laid out in the registered send buffer of both ends of a connection:
+ *
+ *   [RING_REQ_HEAD]  requests produced by the client, written by the client into the clerk
+ *   [RING_REP_HEAD]  replies produced by the clerk, written by the clerk into the client
+ *   [RING_REQ_BASE]  RING_SLOTS request slots, staged by the client and written to the same offset
+ *   [RING_REP_BASE]  RING_SLOTS reply slots, staged by the clerk and written to the same offset
+ *
+ * A slot holds a RING_FRAME byte frame header, a message of up to RING_SLOT_SIZE bytes right after it
+ * and room for the marker byte of Notify::Frame.
+ *
+ * Both rings are single-producer single-consumer. Request i and its reply use slot i % RING_SLOTS,
+ * and a client never has more than RING_SLOTS requests without reply, so neither ring overruns.
+ * A slot is written before the head index on the same queue pair, the head index is the only word
+ * the consumer polls. The index is posted from the frame header of the last slot it covers, not from
+ * a single word, as a queue pair may have no inline data: the NIC reads it when it gets to the work
+ * request, and the producer writes that header again only once the consumer answered past the slot,
+ * which it did after the index was read. RDMADevice::open() hands out a zeroed send buffer, so both
+ * indices start at 0 before the peer can write them.
+ *
+ * With Notify::Imm the head indices are not used: a slot is written with immediate data carrying its
+ * sequence number and length, and the consumer learns about it from its receive completion queue.
+ * Each end keeps RING_SLOTS zero-length receives posted for that.
+ *
+ * With Notify::Frame the head indices are not used either: a message is written together with its
+ * frame header, which holds its length, and a marker byte right after it, in one work request. The
+ * consumer polls the header of the next slot for the length and then the marker, which lands last
+ * because a NIC places the bytes of a write in order. A consumer zeroes a slot once it is consumed, so
+ * no leftover of an earlier message is taken for a length or a marker.
+ *
+ * An end that found nothing to consume idles as the poll policy of its context says. Only with
+ * Notify::Imm it can block on its receive completion queue, with Notify::Poll blocking is a sleep.
+ */
+const int RING_SLOTS     = 64;
+const int RING_SLOT_SIZE = MAX_REQUEST;
+const int RING_REQ_HEAD  = 0;
+const int RING_REP_HEAD  = 64; // separate cache lines for the two directions
+const int RING_REQ_BASE  = 128;
+const int RING_FRAME     = 8;  // frame header in front of every message, keeps messages 8-byte aligned
+const int RING_STRIDE    = RING_FRAME + RING_SLOT_SIZE + 64; // a slot, with the marker byte and padding
+const int RING_REP_BASE  = RING_REQ_BASE + RING_SLOTS * RING_STRIDE;
+const int RING_END       = RING_REP_BASE + RING_SLOTS * RING_STRIDE; // the send buffer after it is free
+const int RING_FLUSH     = RDMAUtil::MAX_BATCH - 1; // replies per head update, one doorbell in total
+static_assert(RING_END <= RDMAUtil::SEND_BUF_SIZE, "rings exceed the send buffer");
+static_assert(RING_SLOTS <= RDMAUtil::MIN_QP_DEPTH, "a ring's receives must fit in any receive queue");
+
+// how the consumer of a ring learns about new entries: "poll" the head index, "imm" completions or "frame" markers
+enum class Notify {Poll, Imm, Frame};
+
+inline Notify ParseNotify(const std::string & mode) {
+    if(mode == "imm") {
+        return Notify::Imm;
+    }
+    return mode == "frame" ? Notify::Frame : Notify::Poll;
+}
+
+// immediate data of a ring entry: the low 16 bits of its sequence number and its length
+inline uint32_t MakeImm(uint32_t seq, uint32_t length) {
+    return (seq << 16) | length;
+}
+
+inline uint32_t ImmSeq(uint32_t imm) {
+    return imm >> 16;
+}
+
+inline uint32_t ImmLength(uint32_t imm) {
+    return imm & 0xffff;
+}
+static_assert(RING_SLOT_SIZE <= 0xffff, "slot length must fit in the immediate data");
+
+// count the entries notified since `arrived` and keep their lengths if asked, return the new count
+inline uint32_t PollArrived(RDMAUtil::RDMAContext * ctx, uint32_t arrived, uint32_t * length = nullptr) {
+    uint32_t imm[RDMAUtil::MAX_POLL];
+    int n = ctx->poll_imm(imm, RDMAUtil::MAX_POLL);
+    for(int i = 0; i < n; i++) {
+        assert(ImmSeq(imm[i]) == (arrived & 0xffff));
+        if(length) length[arrived % RING_SLOTS] = ImmLength(imm[i]);
+        arrived += 1;
+    }
+    return arrived;
+}
+
+struct FrameHeader {
+    uint32_t length; // of the message, never 0
+    uint32_t seq;    // of the message in its ring
+};
+static_assert(sizeof(FrameHeader) == RING_FRAME, "frame header size");
+
+// the marker byte after message `seq`, never 0 and different from the one of the slot's previous message
+inline uint8_t FrameMarker(uint32_t seq) {
+    return seq % 255 + 1;
+}
+
+// frame message `seq` of `length` bytes staged in `slot`, return the bytes to write
+inline uint32_t MakeFrame(uint8_t * slot, uint32_t seq, uint32_t length) {
+    assert(length > 0 && length <= RING_SLOT_SIZE);
+    FrameHeader * header = (FrameHeader *)slot;
+    header->length = length;
+    header->seq = seq;
+    slot[RING_FRAME + length] = FrameMarker(seq);
+    return RING_FRAME + length + 1;
+}
+
+// the length of message `seq` in `slot` once all of it arrived, 0 before
+inline uint32_t FrameArrived(uint8_t * slot, uint32_t seq) {
+    uint32_t length = *(volatile uint32_t *)slot;
+    if(length == 0 || length > RING_SLOT_SIZE || *(volatile uint8_t *)(slot + RING_FRAME + length) != FrameMarker(seq)) {
+        return 0;
+    }
+    asm volatile ("" : : : "memory"); // the message is read after the marker
+    assert(((FrameHeader *)slot)->seq == seq);
+    return length;
+}
+
+// clear a consumed slot for the next message written into it
+inline void FrameConsumed(uint8_t * slot, uint32_t length) {
+    memset(slot, 0, RING_FRAME + length + 1);
+}
+
+inline uint32_t LoadIndex(uint8_t * buf, int offset) {
+    uint32_t index = *(volatile uint32_t *)(buf + offset);
+    asm volatile ("" : : : "memory"); // the slot is read after the index
+    return index;
+}
+
+/*
+ * ClientRing: produces requests, consumes replies. At most `window` requests are in flight, each one
+ * may carry a handler that runs when Poll() consumes its reply. Replies are consumed in request
+ * order. A handler must not submit requests itself.
+ */
+class ClientRing {
+public:
+    using Handler = std::function<void(RequestReply *)>;
+
+    ClientRing() : ctx_(nullptr), buf_(nullptr), notify_(Notify::Poll), window_(RING_SLOTS), 
+                   req_head_(0), rep_tail_(0), rep_arrived_(0) {}
+
+    void Init(RDMAUtil::RDMAContext * ctx, int window = RING_SLOTS, Notify notify = Notify::Poll) {
+        ctx_ = ctx;
+        buf_ = ctx->get_send_buf();
+        notify_ = notify;
+        window_ = std::max(1, std::min(window, RING_SLOTS));
+        req_head_ = rep_tail_ = rep_arrived_ = 0;
+        poller_.SetPolicy(ctx->poll_policy);
+        if(notify_ == Notify::Imm) {
+            ctx_->post_recvs(RING_SLOTS);
+        }
+    }
+
+    inline uint32_t Inflight() {
+        return req_head_ - rep_tail_;
+    }
+
+    // offset in the send buffer where the next request is staged, after the frame header of its slot
+    inline size_t SlotOffset() {
+        return RING_REQ_BASE + (req_head_ % RING_SLOTS) * RING_STRIDE + RING_FRAME;
+    }
+
+    // the slot to stage the next request in, waits for replies while the window is full
+    inline Request * Next() {
+        while(Inflight() >= window_) {
+            if(Poll() == 0) Idle();
+        }
+        return (Request *)(buf_ + SlotOffset());
+    }
+
+    /*
+     * Send the request staged in Next() together with any work request the caller staged before,
+     * under a single doorbell.
+     */
+    void Submit(uint32_t length, Handler handler = nullptr) {
+        size_t offset = SlotOffset();
+        handlers_[req_head_ % RING_SLOTS] = std::move(handler);
+        if(notify_ == Notify::Imm) {
+            ctx_->batch_write2_imm(nullptr, length, MakeImm(req_head_, length), offset, offset, false);
+            req_head_ += 1;
+        } else if(notify_ == Notify::Frame) {
+            // the request and its frame in a single work request
+            offset -= RING_FRAME;
+            uint32_t framed = MakeFrame(buf_ + offset, req_head_, length);
+            ctx_->batch_write2(nullptr, framed, offset, offset, false);
+            req_head_ += 1;
+        } else {
+            ctx_->batch_write2(nullptr, length, offset, offset, false);
+            req_head_ += 1;
+            *(uint32_t *)(buf_ + offset - RING_FRAME) = req_head_;
+            ctx_->batch_write2(nullptr, sizeof(uint32_t), offset - RING_FRAME, RING_REQ_HEAD, false);
+        }
+        ctx_->post_batch();
+    }
+
+    // consume the replies that arrived, return the number of requests completed
+    int Poll() {
+        int completed = 0;
+        uint32_t rep_head;
+        if(notify_ == Notify::Imm) {
+            rep_head = rep_arrived_ = PollArrived(ctx_, rep_arrived_);
+        } else if(notify_ == Notify::Frame) {
+            rep_head = req_head_; // each reply is checked for its marker below
+        } else {
+            rep_head = LoadIndex(buf_, RING_REP_HEAD);
+        }
+        while(rep_tail_ != rep_head && rep_tail_ != req_head_) {
+            uint32_t slot = rep_tail_ % RING_SLOTS;
+            uint8_t * frame = buf_ + RING_REP_BASE + slot * RING_STRIDE;
+            uint32_t length = 0;
+            if(notify_ == Notify::Frame && (length = FrameArrived(frame, rep_tail_)) == 0) {
+                break;
+            }
+            RequestReply * reply = (RequestReply *)(frame + RING_FRAME);
+            if(handlers_[slot]) {
+                handlers_[slot](reply);
+                handlers_[slot] = nullptr;
+            }
+            if(notify_ == Notify::Frame) {
+                FrameConsumed(frame, length);
+            }
+            rep_tail_ += 1;
+            completed += 1;
+        }
+        if(completed > 0) {
+            poller_.Busy();
+        }
+        return completed;
+    }
+
+    // wait until every request in flight is completed
+    void Drain() {
+        while(Inflight() > 0) {
+            if(Poll() == 0) Idle();
+        }
+    }
+
+    // wait as MyOption::poll says after a Poll() that completed nothing
+    inline void Idle() {
+        if(notify_ == Notify::Imm) {
+            poller_.Idle(ctx_, false);
+        } else {
+            poller_.Idle();
+        }
+    }
+
+    inline const RDMAUtil::PollStats & Stats() const {
+        return poller_.Stats();
+    }
+
+private:
+    RDMAUtil::RDMAContext * ctx_;
+    uint8_t * buf_;
+    Notify notify_;
+    uint32_t window_;
+    uint32_t req_head_;    // requests sent
+    uint32_t rep_tail_;    // replies consumed
+    uint32_t rep_arrived_; // replies notified by Notify::Imm
+    Handler handlers_[RING_SLOTS];
+    RDMAUtil::Poller poller_;
+};
+
+/* ClerkRing: consumes requests, produces replies */
+class ClerkRing {
+public:
+    ClerkRing() : ctx_(nullptr), buf_(nullptr), notify_(Notify::Poll), req_tail_(0), req_arrived_(0), rep_head_(0) {}
+
+    void Init(RDMAUtil::RDMAContext * ctx, Notify notify = Notify::Poll) {
+        ctx_ = ctx;
+        buf_ = ctx->get_send_buf();
+        notify_ = notify;
+        req_tail_ = req_arrived_ = rep_head_ = 0;
+        poller_.SetPolicy(ctx->poll_policy);
+        if(notify_ == Notify::Imm) {
+            ctx_->post_recvs(RING_SLOTS);
+        }
+    }
+
+    // the oldest request not answered yet, nullptr if the ring is empty
+    inline Request * Peek() {
+        if(notify_ == Notify::Imm) {
+            if(req_arrived_ == req_tail_) {
+                req_arrived_ = PollArrived(ctx_, req_arrived_, length_);
+            }
+            if(req_arrived_ == req_tail_) {
+                return nullptr;
+            }
+        } else if(notify_ == Notify::Frame) {
+            uint32_t length = FrameArrived(RequestFrame(), req_tail_);
+            if(length == 0) {
+                return nullptr;
+            }
+            length_[req_tail_ % RING_SLOTS] = length;
+        } else if (LoadIndex(buf_, RING_REQ_HEAD) == req_tail_) {
+            return nullptr;
+        }
+        poller_.Busy();
+        return (Request *)(RequestFrame() + RING_FRAME);
+    }
+
+    // wait as MyOption::poll says after a Peek() that found nothing
+    inline void Idle() {
+        if(notify_ == Notify::Imm) {
+            poller_.Idle(ctx_, false);
+        } else {
+            poller_.Idle();
+        }
+    }
+
+    inline const RDMAUtil::PollStats & Stats() const {
+        return poller_.Stats();
+    }
+
+    // bytes written into the slot returned by Peek(), only known with Notify::Imm and Notify::Frame
+    inline uint32_t Length() {
+        return notify_ != Notify::Poll ? length_[req_tail_ % RING_SLOTS] : RING_SLOT_SIZE;
+    }
+
+    inline RequestReply * Reply() {
+        return (RequestReply *)(buf_ + RING_REP_BASE + (req_tail_ % RING_SLOTS) * RING_STRIDE + RING_FRAME);
+    }
+
+    // stage the reply to the request returned by Peek(), it goes out with the next Flush()
+    void Done(uint32_t reply_length) {
+        size_t offset = RING_REP_BASE + (req_tail_ % RING_SLOTS) * RING_STRIDE + RING_FRAME;
+        if(notify_ == Notify::Imm) {
+            ctx_->batch_write2_imm(nullptr, reply_length, MakeImm(req_tail_, reply_length), offset, offset, false);
+        } else if(notify_ == Notify::Frame) {
+            // the client writes this slot again only after it got the reply
+            FrameConsumed(RequestFrame(), length_[req_tail_ % RING_SLOTS]);
+            offset -= RING_FRAME;
+            uint32_t framed = MakeFrame(buf_ + offset, req_tail_, reply_length);
+            ctx_->batch_write2(nullptr, framed, offset, offset, false);
+        } else {
+            ctx_->batch_write2(nullptr, reply_length, offset, offset, false);
+        }
+        req_tail_ += 1;
+        if(req_tail_ - rep_head_ >= RING_FLUSH) {
+            Flush();
+        }
+    }
+
+    // publish every reply staged by Done() with one head update, or just one doorbell otherwise
+    void Flush() {
+        if (rep_head_ == req_tail_) {
+            return ;
+        }
+        rep_head_ = req_tail_;
+        if(notify_ == Notify::Poll) {
+            size_t frame = RING_REP_BASE + ((rep_head_ - 1) % RING_SLOTS) * RING_STRIDE;
+            *(uint32_t *)(buf_ + frame) = rep_head_;
+            ctx_->batch_write2(nullptr, sizeof(uint32_t), frame, RING_REP_HEAD, false);
+        }
+        ctx_->post_batch();
+    }
+
+private:
+    // the slot of the oldest request not answered yet, from its frame header on
+    inline uint8_t * RequestFrame() {
+        return buf_ + RING_REQ_BASE + (req_tail_ % RING_SLOTS) * RING_STRIDE;
+    }
+
+    RDMAUtil::RDMAContext * ctx_;
+    uint8_t * buf_;
+    Notify notify_;
+    uint32_t req_tail_;    // requests answered
+    uint32_t req_arrived_; // requests notified by Notify::Imm
+    uint32_t rep_head_;    // replies published
+    uint32_t length_[RING_SLOTS];
+    RDMAUtil::Poller poller_;
+};
+
+} // namespace frontend
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdio>
+
+#include "poller.h"
+
+namespace frontend {
+
+/* Clerk: the server side of one connection, driven by repeated Poll() calls */
+class Clerk {
+public:
+    virtual ~Clerk() {}
+
+    // serve the requests that arrived, return how many, or -1 once the client closed the connection
+    virtual int Poll() = 0;
+
+    // wait as MyOption::poll says after a Poll() that served nothing
+    virtual void Idle() = 0;
+
+    // idle time of the connection so far
+    virtual const RDMAUtil::PollStats & Stats() const = 0;
+};
+
+inline bool HasIdled(const RDMAUtil::PollStats & stats) {
+    for(int i = RDMAUtil::PAUSE; i < RDMAUtil::POLL_PHASES; i++) {
+        if(stats.ns[i] > 0) return true;
+    }
+    return false;
+}
+
+// legacy mode: a thread that polls a single connection
+inline void RunClerk(std::unique_ptr<Clerk> clk) {
+    int served;
+    while((served = clk->Poll()) >= 0) {
+        if(served == 0) clk->Idle();
+    }
+    if(HasIdled(clk->Stats())) {
+        clk->Stats().Print(stderr, "clerk");
+    }
+}
+
+/*
+ * ClerkScheduler: a fixed pool of workers polling many connections each. A new connection goes to
+ * the worker with the fewest connections. A worker that found no request for STEAL_ROUNDS rounds
+ * steals one connection from the busiest worker, so hot connections spread over idle workers.
+ * A worker locks its connection queue only to take the next connection off it or to put it back,
+ * so a thief can take a waiting connection while the worker is stuck in a slow Poll().
+ * Idle workers wait as `policy` says between rounds, blocking is a sleep as they poll many queues.
+ */
+class ClerkScheduler {
+public:
+    static const int STEAL_ROUNDS = 1024;
+
+    ClerkScheduler(int worker_num, RDMAUtil::PollPolicy policy) : workers_(worker_num) {
+        for(int i = 0; i < worker_num; i++) {
+            workers_[i].reset(new Worker());
+            workers_[i]->poller.SetPolicy(policy);
+        }
+        for(int i = 0; i < worker_num; i++) {
+            std::thread th(&ClerkScheduler::Run, this, i);
+            th.detach();
+        }
+    }
+
+    ClerkScheduler(const ClerkScheduler &) = delete;
+    ClerkScheduler &operator=(const ClerkScheduler &) = delete;
+
+    void Add(std::unique_ptr<Clerk> clk) {
+        Worker * target = workers_[0].get();
+        for(auto & w : workers_) {
+            if(w->count.load(std::memory_order_relaxed) < target->count.load(std::memory_order_relaxed)) {
+                target = w.get();
+            }
+        }
+        std::lock_guard<std::mutex> l(target->mu);
+        target->clerks.push_back(std::move(clk));
+        target->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    struct Worker {
+        Worker() : count(0), load(0) {}
+
+        std::mutex mu;                               // guards clerks
+        std::deque<std::unique_ptr<Clerk>> clerks;   // waiting to be polled, without the one in hand
+        std::atomic<size_t> count;   // clerks of the worker including the one in hand, for lock-free readers
+        std::atomic<uint64_t> load;  // moving average of requests per round, scaled by 16
+        RDMAUtil::Poller poller;     // only used by the worker thread
+    };
+
+    void Run(int id) {
+        Worker * self = workers_[id].get();
+        int idle_rounds = 0;
+
+        while(true) {
+            uint64_t served = 0;
+            // a round polls the clerks queued at its start, each once
+            size_t round;
+            {
+                std::lock_guard<std::mutex> l(self->mu);
+                round = self->clerks.size();
+            }
+            for(size_t i = 0; i < round; i++) {
+                std::unique_ptr<Clerk> clk;
+                {
+                    std::lock_guard<std::mutex> l(self->mu);
+                    if(self->clerks.empty()) { // stolen meanwhile
+                        break;
+                    }
+                    clk = std::move(self->clerks.front());
+                    self->clerks.pop_front();
+                }
+
+                int ret = clk->Poll();
+                if(ret < 0) { // the connection is closed
+                    if(HasIdled(self->poller.Stats())) {
+                        char who[32];
+                        snprintf(who, sizeof(who), "worker %d", id);
+                        self->poller.Stats().Print(stderr, who);
+                    }
+                    self->count.fetch_sub(1, std::memory_order_relaxed);
+                    continue;
+                }
+                served += ret;
+
+                std::lock_guard<std::mutex> l(self->mu);
+                self->clerks.push_back(std::move(clk));
+            }
+
+            uint64_t load = self->load.load(std::memory_order_relaxed);
+            self->load.store(load - load / 16 + served, std::memory_order_relaxed);
+
+            if(served > 0) {
+                idle_rounds = 0;
+                self->poller.Busy();
+            } else if(++idle_rounds >= STEAL_ROUNDS) {
+                idle_rounds = 0;
+                Steal(self);
+            } else {
+                self->poller.Idle();
+            }
+        }
+    }
+
+    // take one connection from the busiest worker that has more than one
+    void Steal(Worker * self) {
+        Worker * victim = nullptr;
+        for(auto & w : workers_) {
+            if(w.get() == self || w->count.load(std::memory_order_relaxed) < 2) {
+                continue;
+            }
+            if(victim == nullptr || w->load.load(std::memory_order_relaxed) > victim->load.load(std::memory_order_relaxed)) {
+                victim = w.get();
+            }
+        }
+        if(victim == nullptr || victim->load.load(std::memory_order_relaxed) == 0) {
+            return ;
+        }
+
+        // the victim only holds its lock to take or put back a clerk, the one it polls is not queued
+        std::unique_ptr<Clerk> clk;
+        {
+            std::lock_guard<std::mutex> l(victim->mu);
+            if(victim->clerks.empty() || victim->count.load(std::memory_order_relaxed) < 2) {
+                return ;
+            }
+            clk = std::move(victim->clerks.back());
+            victim->clerks.pop_back();
+            victim->count.fetch_sub(1, std::memory_order_relaxed);
+            victim->load.store(victim->load.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+
+        std::lock_guard<std::mutex> l(self->mu);
+        self->clerks.push_back(std::move(clk));
+        self->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+} // namespace frontend
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <cstdio>
+
+#include "../cs.h"
+
+using namespace RDMAUtil;
+using namespace SocketUtil;
+
+namespace frontend {
+
+/*
+ * UdClient: a client of MyOption::rpc "ud", for any front type but pmemaccess. It sends every
+ * request in a datagram to the server worker it was set up with, so the server keeps no queue pair
+ * per client. Requests and values have to fit in one datagram of the transport's MTU, a larger
+ * request fails. Once the server stayed silent for UD_IDLE_S, every request fails.
+ */
+class UdClient : Client {
+public:
+    UdClient(MyOption opt, int id = 1);
+
+    void Connect();
+
+    void AsyncPut(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, PUT, cb);
+    }
+
+    void AsyncUpdate(std::string_view key, std::string_view val, Callback cb = nullptr) {
+        AsyncWrite(key, val, UPDATE, cb);
+    }
+
+    void AsyncGet(std::string_view key, Callback cb);
+
+    void AsyncDelete(std::string_view key, Callback cb = nullptr);
+
+    int Poll();
+
+    void Drain();
+
+    void SendClose();
+
+    int GetClientID() {
+        return client_id_;
+    }
+
+    const RDMAUtil::PollStats & Stats() const {
+        return poller_.Stats();
+    }
+
+private:
+    // a request in flight, kept to be sent again until its reply arrived
+    struct Pending {
+        std::string msg;             // UdHeader and Request
+        ClientRing::Handler handler;
+        bool done;                   // the reply arrived, it completes once those before it did
+        std::string reply;
+    };
+
+    void AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb);
+
+    // send a request, waiting for a free slot of the window first
+    void Submit(Operation op, std::string_view key, std::string_view val, ClientRing::Handler handler);
+
+    // send every request in flight again
+    void Resend();
+
+    // complete `handler` with an error once the requests in flight completed
+    void Reject(ClientRing::Handler handler);
+
+    // give up on a server that did not reply for UD_IDLE_S, failing the requests in flight
+    void Expire();
+
+    std::unique_ptr<RDMAUtil::RDMADevice> device_;
+    std::unique_ptr<RDMAUtil::UDEndpoint> ep_;
+    RDMAUtil::Poller poller_;
+    int peer_;
+    uint32_t session_;  // the client number the server handed out
+    uint32_t next_seq_; // of the next request
+    uint32_t acked_;    // requests before it completed
+    uint64_t resends_;  // timeouts so far
+    bool expired_;      // the server is given up on
+    Pending pending_[UD_WINDOW];
+    std::chrono::steady_clock::time_point last_progress_; // or of the last resend
+    std::chrono::steady_clock::time_point last_reply_;    // or of the first request in flight
+
+    int client_id_;
+    int window_;
+    std::string ip_;
+    int port_;
+};
+
+} // namespace frontend
@@ -0,0 +1,220 @@
+#include <string>
+
+#include "client.h"
+
+namespace frontend {
+
+UdClient::UdClient(MyOption opt, int id) {
+    client_id_ = id;
+    ip_ = opt.ipaddr;
+    port_ = opt.ipport;
+    window_ = std::max(1, std::min(opt.window, UD_WINDOW));
+    next_seq_ = acked_ = 0;
+    resends_ = 0;
+    expired_ = false;
+
+    device_ = MakeDevice(opt);
+    assert(device_ != nullptr);
+    // the receives take the replies of a window, and the duplicates of one sent again
+    ep_ = device_->open_ud(2 * UD_WINDOW);
+    if(!ep_) {
+        fprintf(stderr, "fail to open a datagram endpoint\n");
+        exit(-1);
+    }
+    poller_.SetPolicy(PollPolicy::Parse(opt.poll));
+    for(auto & p : pending_) {
+        p.done = false;
+    }
+}
+
+void UdClient::Connect() {
+    // learn the address of the server worker, the connection is closed afterwards
+    auto socket = SocketUtil::Socket::make_socket(SocketUtil::CLIENT, port_, ip_);
+    int commu_fd = socket->GetFirst();
+    UdHello local = {ep_->Address(), 0}, remote;
+    uint8_t ready = 0;
+    if(!ExchangeHello(commu_fd, local, &remote) || read(commu_fd, &ready, 1) != 1 || !ready) {
+        fprintf(stderr, "fail to set up with the server\n");
+        exit(-1);
+    }
+    session_ = remote.client;
+    peer_ = ep_->AddPeer(remote.addr);
+    if(peer_ < 0) {
+        fprintf(stderr, "fail to resolve the server address\n");
+        exit(-1);
+    }
+}
+
+void UdClient::Submit(Operation op, std::string_view key, std::string_view val, ClientRing::Handler handler) {
+    uint32_t total_len = sizeof(UdHeader) + sizeof(Request) + key.size() + val.size();
+    if(total_len > ep_->MaxMessage()) {
+        Reject(std::move(handler));
+        return ;
+    }
+
+    while(next_seq_ - acked_ >= (uint32_t)window_) {
+        if(Poll() == 0) poller_.Idle(ep_.get(), false);
+    }
+    if(expired_) { // while waiting for the window
+        Reject(std::move(handler));
+        return ;
+    }
+    if(next_seq_ == acked_) { // the timeout runs from the first request in flight
+        last_progress_ = last_reply_ = std::chrono::steady_clock::now();
+    }
+
+    // keep the datagram until the reply arrived
+    Pending & p = pending_[next_seq_ % UD_WINDOW];
+    p.msg.resize(total_len);
+    UdHeader * header = (UdHeader *)p.msg.data();
+    header->client = session_;
+    header->seq = next_seq_;
+    Request * request = (Request *)(header + 1);
+    request->op = op;
+    request->key_size = key.size();
+    request->val_size = val.size();
+    memcpy(request->keyvalue, key.data(), key.size());
+    memcpy(request->keyvalue + key.size(), val.data(), val.size());
+    p.handler = std::move(handler);
+    p.done = false;
+    next_seq_ += 1;
+
+    // a lost datagram, or one that failed to send, is sent again on timeout
+    ep_->Send(peer_, p.msg.data(), total_len);
+}
+
+void UdClient::Reject(ClientRing::Handler handler) {
+    // in order, as if the server had failed it
+    Drain();
+    RequestReply reply;
+    reply.status = RequestStatus::ERROR;
+    reply.val_size = 0;
+    if(handler) {
+        handler(&reply);
+    }
+}
+
+void UdClient::Expire() {
+    expired_ = true;
+    RequestReply error;
+    error.status = RequestStatus::ERROR;
+    error.val_size = 0;
+    while(acked_ != next_seq_) {
+        Pending & p = pending_[acked_ % UD_WINDOW];
+        ClientRing::Handler handler = std::move(p.handler);
+        std::string reply = std::move(p.reply);
+        bool done = p.done;
+        p.handler = nullptr;
+        p.done = false;
+        acked_ += 1;
+        if(handler) {
+            handler(done ? (RequestReply *)reply.data() : &error);
+        }
+    }
+}
+
+void UdClient::AsyncWrite(std::string_view key, std::string_view val, Operation op, Callback cb) {
+    Submit(op, key, val, ReplyHandler(cb, false));
+}
+
+void UdClient::AsyncGet(std::string_view key, Callback cb) {
+    Submit(GET, key, std::string_view(), ReplyHandler(cb, true));
+}
+
+void UdClient::AsyncDelete(std::string_view key, Callback cb) {
+    Submit(DELETE, key, std::string_view(), ReplyHandler(cb, false));
+}
+
+int UdClient::Poll() {
+    Datagram msgs[MAX_POLL];
+    int n = ep_->Poll(msgs, MAX_POLL);
+    for(int i = 0; i < n; i++) {
+        UdHeader * header = (UdHeader *)msgs[i].data;
+        // drop corrupt replies and duplicates of completed requests
+        if(msgs[i].length >= sizeof(UdHeader) + sizeof(RequestReply) && header->client == session_ && 
+           header->seq - acked_ < next_seq_ - acked_) {
+            Pending & p = pending_[header->seq % UD_WINDOW];
+            if(!p.done) {
+                p.done = true;
+                p.reply.assign((char *)(header + 1), msgs[i].length - sizeof(UdHeader));
+            }
+        }
+        ep_->Repost(msgs[i].slot);
+    }
+
+    // complete in order, a request whose reply came early waits for those before it
+    int completed = 0;
+    while(acked_ != next_seq_ && pending_[acked_ % UD_WINDOW].done) {
+        Pending & p = pending_[acked_ % UD_WINDOW];
+        ClientRing::Handler handler = std::move(p.handler);
+        std::string reply = std::move(p.reply);
+        p.handler = nullptr;
+        p.done = false;
+        acked_ += 1;
+        if(handler) {
+            handler((RequestReply *)reply.data());
+        }
+        completed += 1;
+    }
+
+    if(completed > 0) {
+        poller_.Busy();
+        last_progress_ = last_reply_ = std::chrono::steady_clock::now();
+    } else if(acked_ != next_seq_ && 
+              std::chrono::steady_clock::now() - last_progress_ > std::chrono::microseconds(UD_TIMEOUT_US)) {
+        if(std::chrono::steady_clock::now() - last_reply_ > std::chrono::seconds(UD_IDLE_S)) {
+            // the server is gone, or ended the session of a client idle for as long
+            fprintf(stderr, "datagram client %d got no reply for %d s\n", client_id_, UD_IDLE_S);
+            completed = next_seq_ - acked_;
+            Expire();
+            return completed;
+        }
+        Resend();
+        last_progress_ = std::chrono::steady_clock::now();
+    }
+    return completed;
+}
+
+void UdClient::Resend() {
+    // go-back-N: the server drops everything after a lost request
+    for(uint32_t seq = acked_; seq != next_seq_; seq++) {
+        Pending & p = pending_[seq % UD_WINDOW];
+        if(!p.done) {
+            ep_->Send(peer_, p.msg.data(), p.msg.size());
+        }
+    }
+    resends_ += 1;
+}
+
+void UdClient::Drain() {
+    while(acked_ != next_seq_) {
+        if(Poll() == 0) poller_.Idle(ep_.get(), false);
+    }
+}
+
+void UdClient::SendClose() {
+    Drain();
+    if(expired_) {
+        ep_->RemovePeer(peer_);
+        return ;
+    }
+
+    bool closed = false;
+    Submit(CLOSE, std::string_view(), std::string_view(), [&closed](RequestReply *) {
+        closed = true;
+    });
+    // the reply to a close may be lost after the server ended the session, so it is not waited for forever
+    uint64_t start = resends_;
+    while(!closed && resends_ - start < UD_CLOSE_TRIES) {
+        if(Poll() == 0) poller_.Idle(ep_.get(), false);
+    }
+    if(!closed) {
+        Pending & p = pending_[acked_ % UD_WINDOW];
+        p.handler = nullptr;
+        p.done = false;
+        acked_ = next_seq_;
+    }
+    ep_->RemovePeer(peer_);
+}
+
+} // namespace frontend
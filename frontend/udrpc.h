@@ -0,0 +1,240 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rdmautil.h"
+#include "request.h"
+
+namespace frontend {
+
+/*
+ * Datagram RPC (MyOption::rpc "ud"): for very many clients, each server worker serves all of its
+ * clients on a single unreliable datagram queue pair instead of a connection per client. A client
+ * sets up over TCP only to learn its worker's address and its client number, the server keeps a few
+ * words and an address handle per client afterwards.
+ *
+ * A datagram is a UdHeader followed by a Request, or by the RequestReply to the request of the same
+ * sequence number. The server serves the requests of a client strictly in sequence order and drops
+ * any that arrives early, a client keeps at most UD_WINDOW requests in flight and sends all of them
+ * again when no reply arrived for UD_TIMEOUT_US (go-back-N). A request that arrives again after it
+ * was served is answered from the replies the server keeps of the last UD_WINDOW requests, so it is
+ * never applied twice. A session that sent nothing for UD_IDLE_S is ended as if its client closed it,
+ * and a client that got no reply for as long fails its requests instead of sending them forever.
+ */
+const int UD_WINDOW      = 16;   // requests in flight per client
+const int UD_SLOTS       = 256;  // datagram buffers of a server worker per direction
+const int UD_TIMEOUT_US  = 2000; // without a reply, requests in flight are sent again
+const int UD_CLOSE_TRIES = 8;    // a close is given up after that many timeouts, its session may be gone
+const int UD_IDLE_S      = 60;   // a session is ended, or given up by its client, after that long without traffic
+
+struct UdHeader {
+    uint32_t client; // handed out by the server at setup
+    uint32_t seq;    // of the request, a reply carries the one of its request
+};
+
+// what a client and its worker tell each other at setup, in network byte order on the wire
+struct UdHello {
+    RDMAUtil::ud_address addr;
+    uint32_t client;
+} __attribute__((packed));
+
+inline bool ExchangeHello(int fd, const UdHello & local, UdHello * remote) {
+    UdHello tmp = local;
+    tmp.addr.qp_num = htonl(local.addr.qp_num);
+    tmp.addr.qkey = htonl(local.addr.qkey);
+    tmp.addr.lid = htons(local.addr.lid);
+    tmp.client = htonl(local.client);
+    if(write(fd, &tmp, sizeof(tmp)) != sizeof(tmp) || read(fd, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        return false;
+    }
+    *remote = tmp;
+    remote->addr.qp_num = ntohl(tmp.addr.qp_num);
+    remote->addr.qkey = ntohl(tmp.addr.qkey);
+    remote->addr.lid = ntohs(tmp.addr.lid);
+    remote->client = ntohl(tmp.client);
+    return true;
+}
+
+/* UdHandler: applies the requests arriving at one worker, from all of its clients in arrival order */
+class UdHandler {
+public:
+    virtual ~UdHandler() {}
+
+    // serve `request`, whose key and value follow it in the datagram, into `reply`
+    virtual void Serve(Request * request, RequestReply * reply) = 0;
+};
+
+/* UdService: the server side of datagram RPC, a pool of workers each polling its own endpoint */
+class UdService {
+public:
+    using MakeHandler = std::function<std::unique_ptr<UdHandler>()>;
+
+    // start `workers` workers spread over `devices` in turn
+    UdService(const std::vector<RDMAUtil::RDMADevice *> & devices, int workers, RDMAUtil::PollPolicy policy, MakeHandler make) {
+        for(int i = 0; i < std::max(1, workers); i++) {
+            auto w = std::make_unique<Worker>();
+            w->ep = devices[i % devices.size()]->open_ud(UD_SLOTS);
+            if(!w->ep) {
+                fprintf(stderr, "fail to open a datagram endpoint\n");
+                exit(-1);
+            }
+            w->handler = make();
+            w->poller.SetPolicy(policy);
+            workers_.push_back(std::move(w));
+        }
+        for(auto & w : workers_) {
+            std::thread th(&UdService::Run, this, w.get());
+            th.detach();
+        }
+    }
+
+    UdService(const UdService &) = delete;
+    UdService &operator=(const UdService &) = delete;
+
+    // set up the client connected on `commu_fd` with a worker, thread-safe
+    void Setup(int commu_fd) {
+        Worker * w = workers_[next_worker_++ % workers_.size()].get();
+        UdHello local = {w->ep->Address(), next_client_++}, remote;
+        if(!ExchangeHello(commu_fd, local, &remote)) {
+            close(commu_fd);
+            return ;
+        }
+        int peer = w->ep->AddPeer(remote.addr);
+        if(peer >= 0) {
+            std::lock_guard<std::mutex> l(w->mu);
+            w->joining.emplace_back((uint32_t)local.client, peer);
+            w->has_joining.store(true, std::memory_order_release);
+        }
+        // the client sends its first request once it read this
+        uint8_t ready = peer >= 0;
+        if(write(commu_fd, &ready, 1) != 1 && peer >= 0) {
+            fprintf(stderr, "datagram client %u set up without ack\n", local.client);
+        }
+        close(commu_fd);
+    }
+
+private:
+    struct Session {
+        int peer;
+        uint32_t next_seq;               // requests before it are served
+        std::chrono::steady_clock::time_point active; // of its last request
+        std::string replies[UD_WINDOW];  // of the last UD_WINDOW requests, by sequence number
+    };
+
+    struct Worker {
+        std::unique_ptr<RDMAUtil::UDEndpoint> ep;
+        std::unique_ptr<UdHandler> handler;
+        RDMAUtil::Poller poller;
+        std::unordered_map<uint32_t, Session> sessions; // by client number, owned by the worker thread
+        std::mutex mu;
+        std::vector<std::pair<uint32_t, int>> joining;  // (client, peer) set up but not adopted yet
+        std::atomic<bool> has_joining{false};
+        std::chrono::steady_clock::time_point swept;   // when idle sessions were last ended
+    };
+
+    // end the sessions idle for UD_IDLE_S, their clients are gone without a close
+    void Sweep(Worker * w, std::chrono::steady_clock::time_point now) {
+        if(now - w->swept < std::chrono::seconds(1)) {
+            return ;
+        }
+        w->swept = now;
+        for(auto iter = w->sessions.begin(); iter != w->sessions.end(); ) {
+            if(now - iter->second.active > std::chrono::seconds(UD_IDLE_S)) {
+                w->ep->RemovePeer(iter->second.peer);
+                iter = w->sessions.erase(iter);
+            } else {
+                iter++;
+            }
+        }
+    }
+
+    void Run(Worker * w) {
+        RDMAUtil::Datagram msgs[RDMAUtil::MAX_POLL];
+        std::unique_ptr<uint8_t[]> reply_buf(new uint8_t[sizeof(UdHeader) + sizeof(RequestReply) + MAX_REQUEST]);
+        UdHeader * reply_header = (UdHeader *)reply_buf.get();
+        RequestReply * reply = (RequestReply *)(reply_header + 1);
+        uint32_t max_reply = w->ep->MaxMessage() - sizeof(UdHeader);
+
+        while(true) {
+            int n = w->ep->Poll(msgs, RDMAUtil::MAX_POLL);
+            auto now = std::chrono::steady_clock::now();
+            Sweep(w, now);
+            if(n == 0) {
+                w->poller.Idle(w->ep.get(), false);
+                continue;
+            }
+            w->poller.Busy();
+            // a client's first request may only come after it was set up
+            if(w->has_joining.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> l(w->mu);
+                for(auto [client, peer] : w->joining) {
+                    Session & s = w->sessions[client];
+                    s.peer = peer;
+                    s.active = now;
+                }
+                w->joining.clear();
+                w->has_joining.store(false, std::memory_order_relaxed);
+            }
+
+            for(int i = 0; i < n; i++) {
+                UdHeader * header = (UdHeader *)msgs[i].data;
+                auto iter = msgs[i].length >= sizeof(UdHeader) + sizeof(Request) ? w->sessions.find(header->client) : w->sessions.end();
+                if(iter == w->sessions.end()) { // corrupt, or of a closed client
+                    w->ep->Repost(msgs[i].slot);
+                    continue;
+                }
+                Session & s = iter->second;
+                s.active = now;
+                std::string & cached = s.replies[header->seq % UD_WINDOW];
+
+                if(header->seq == s.next_seq) {
+                    Request * request = (Request *)(header + 1);
+                    bool closing = request->op == CLOSE;
+                    if(request->Length() > msgs[i].length - sizeof(UdHeader)) {
+                        reply->status = RequestStatus::ERROR;
+                        reply->val_size = 0;
+                    } else {
+                        w->handler->Serve(request, reply);
+                    }
+                    if(sizeof(RequestReply) + reply->val_size > max_reply) {
+                        reply->status = RequestStatus::ERROR; // the value does not fit in a datagram
+                        reply->val_size = 0;
+                    }
+                    reply_header->client = header->client;
+                    reply_header->seq = header->seq;
+                    cached.assign((char *)reply, sizeof(RequestReply) + reply->val_size);
+                    s.next_seq += 1;
+                    w->ep->Send(s.peer, reply_header, sizeof(UdHeader), cached.data(), cached.size());
+                    if(closing) {
+                        w->ep->RemovePeer(s.peer);
+                        w->sessions.erase(iter);
+                    }
+                } else if(s.next_seq - header->seq <= UD_WINDOW) {
+                    // served before, its reply was lost
+                    UdHeader h = {header->client, header->seq};
+                    w->ep->Send(s.peer, &h, sizeof(UdHeader), cached.data(), cached.size());
+                }
+                // else an earlier request was lost, the client sends this one again after it
+                w->ep->Repost(msgs[i].slot);
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<int> next_worker_{0};
+    std::atomic<uint32_t> next_client_{1};
+};
+
+} // namespace frontend
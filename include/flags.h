@@ -11,16 +11,37 @@ struct MyOption {
     std::string cmb_device;
 
     // RDMA related
-    std::string rdma_device;
+    std::string rdma_device; // comma separated name[:port] list, connections are spread over them
     int port;
     int gid;
     std::string ipaddr;
     int ipport;
 
+    // transport related: "rdma" or "shm" (in-process loopback without a NIC)
+    std::string transport;
+    int shm_latency;   // ns injected per work request
+    int shm_bandwidth; // MB/s, 0 for unlimited
+
     // front end related
     std::string front_type;
     int client_num;
     bool lat_mode;
+    bool async_mode;
+    int window;        // requests in flight per client, at most RING_SLOTS
+    std::string notify; // "poll" the ring head index, "imm" for write with immediate, "frame" for a marker after each message
+    int worker_num;    // server threads polling the connections, 0 for a thread per connection
+    std::string poll;  // idling after empty polls "spin,pause,yield,block_ms", empty to spin only
+    std::string profile; // transport profile "mtu=4096,inline=64,...", empty to detect everything
+    bool read_path;    // pmraccess gets try RDMA reads of the server's index before asking the clerk
+    int lanes;         // connections per pmraccess or groupaccess client, requests are striped by key
+    std::string rpc;   // "rc" for a queue pair per connection, "ud" for datagrams to a few server workers
+    int combine;       // pmraccess puts notified together, 1 to notify every put on its own
+    int combine_bytes; // a group of combined puts is notified once it holds that many bytes
+    int linger_us;     // or once its first put waited that long
+    int ingest_workers; // threads putting sealed pmraccess chunks into the database, 0 for the clerks to do it
+    int ingest_merge;   // sealed chunks an ingest worker puts with one database write
+    int pmr_chunks;     // chunks of the PMR buffer pmraccess writes to, -1 for all of it
+    int spill_chunks;   // chunks of host DRAM the buffer spills to, -1 for all of the pool
 
     // database related
     std::string db_type;
@@ -45,9 +66,29 @@ const MyOption default_opt = {
     .ipaddr     = "192.168.2.1",
     .ipport     = 4040,
 
+    .transport     = "rdma",
+    .shm_latency   = 0,
+    .shm_bandwidth = 0,
+
     .front_type = "pmraccess",
     .client_num = 1,
     .lat_mode   = false,
+    .async_mode = false,
+    .window     = 16,
+    .notify     = "poll",
+    .worker_num = 0,
+    .poll       = "",
+    .profile    = "",
+    .read_path  = false,
+    .lanes      = 1,
+    .rpc        = "rc",
+    .combine       = 1,
+    .combine_bytes = 4096,
+    .linger_us     = 20,
+    .ingest_workers = 0,
+    .ingest_merge   = 1,
+    .pmr_chunks     = -1,
+    .spill_chunks   = -1,
 
     .db_type = "cuckoodb",
     .sync    = true,
@@ -1,6 +1,8 @@
 #include "../database/db.h"
 #include "../frontend/front.h"
 
+#include <thread>
+
 using namespace frontend;
 
 inline DBType * OpenDB(MyOption & opt) {
@@ -15,7 +17,9 @@ inline DBType * OpenDB(MyOption & opt) {
 }
 
 inline Client * NewClient(MyOption opt, int client_id) {
-    if(opt.front_type == "pmemaccess")
+    if(opt.rpc == "ud") // the same client for every front type, the server applies the requests its way
+        return (Client *)(new UdClient(opt, client_id));
+    else if(opt.front_type == "pmemaccess")
         return (Client *)(new PMemClient(opt, client_id));
     else if(opt.front_type == "pmraccess")
         return (Client *)(new PMRClient(opt, client_id));
@@ -36,4 +40,16 @@ inline Server * NewServer(MyOption opt, DBType * db) {
     else
         fprintf(stderr, "wrong front type\n");
     return nullptr;
+}
+
+// NIC-less runs: host the server in this process, clients reach it over the loopback transport
+inline void ServeInProcess(MyOption opt) {
+    std::thread th([opt]() mutable {
+        DBType * db = OpenDB(opt);
+        Server * s  = NewServer(opt, db);
+        if(s == nullptr)
+            exit(-1);
+        s->Listen();
+    });
+    th.detach();
 }
\ No newline at end of file
@@ -0,0 +1,74 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#include "arena.h"
+
+#include <cstring>
+#include <cstdio>
+#include <sys/mman.h>
+
+namespace RDMAUtil {
+    SendArena::SendArena(struct ibv_pd * pd, size_t buf_size, int per_chunk) :
+        pd_(pd), buf_size_(buf_size), per_chunk_(per_chunk) {}
+
+    SendArena::~SendArena() {
+        for (auto & chunk : chunks_) {
+            if (chunk.mr) ibv_dereg_mr(chunk.mr);
+            munmap(chunk.base, chunk.size);
+        }
+    }
+
+    bool SendArena::Get(Buffer * buf) {
+        {
+            std::lock_guard<std::mutex> l(mu_);
+            if (free_.empty() && !Grow()) {
+                return false;
+            }
+            *buf = free_.back();
+            free_.pop_back();
+        }
+        // the peer of the last owner may have written it, a ring starts from zeroed indices
+        memset(buf->addr, 0, buf_size_);
+        return true;
+    }
+
+    void SendArena::Put(uint8_t * addr) {
+        std::lock_guard<std::mutex> l(mu_);
+        for (auto & chunk : chunks_) {
+            if (addr >= chunk.base && addr < chunk.base + chunk.size) {
+                free_.push_back({addr, chunk.mr});
+                return ;
+            }
+        }
+    }
+
+    bool SendArena::Grow() {
+        size_t size = buf_size_ * per_chunk_;
+        void * base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            // no reserved huge pages, ask for transparent ones
+            base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                perror("mmap send arena");
+                return false;
+            }
+            madvise(base, size, MADV_HUGEPAGE);
+        }
+
+        Chunk chunk = {(uint8_t *)base, size, nullptr};
+        if (pd_) {
+            int mr_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+            if (!(chunk.mr = ibv_reg_mr(pd_, base, size, mr_access))) {
+                munmap(base, size);
+                return false;
+            }
+        }
+        chunks_.push_back(chunk);
+
+        for (int i = per_chunk_ - 1; i >= 0; i--) {
+            free_.push_back({chunk.base + i * buf_size_, chunk.mr});
+        }
+        return true;
+    }
+}
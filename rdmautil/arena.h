@@ -0,0 +1,58 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#ifndef __ARENA_UTIL__
+#define __ARENA_UTIL__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+#include <infiniband/verbs.h>
+
+namespace RDMAUtil {
+    /*
+     * SendArena: the send buffers of all contexts opened from a device. Buffers are carved out of
+     * chunks of `per_chunk` buffers, each chunk is backed by huge pages when the system has them and
+     * registered as a single memory region, so a new connection registers nothing. Loopback devices
+     * have no protection domain and use the chunks unregistered.
+     */
+    class SendArena {
+    public:
+        struct Buffer {
+            uint8_t * addr;
+            struct ibv_mr * mr; // the region of the chunk, nullptr without a protection domain
+        };
+
+        SendArena(struct ibv_pd * pd, size_t buf_size, int per_chunk);
+        ~SendArena();
+
+        SendArena(const SendArena &) = delete;
+        SendArena &operator=(const SendArena &) = delete;
+
+        // a zeroed buffer, false if no chunk can be mapped or registered
+        bool Get(Buffer * buf);
+
+        void Put(uint8_t * addr);
+
+    private:
+        struct Chunk {
+            uint8_t * base;
+            size_t size;
+            struct ibv_mr * mr;
+        };
+
+        bool Grow();
+
+        std::mutex mu_;
+        struct ibv_pd * pd_;
+        size_t buf_size_;
+        int per_chunk_;
+        std::vector<Chunk> chunks_;
+        std::vector<Buffer> free_;
+    };
+}
+
+#endif // __ARENA_UTIL__
@@ -0,0 +1,131 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#include "loopback.h"
+#include "rdmautil.h"
+
+#include <chrono>
+#include <unordered_map>
+
+namespace RDMAUtil {
+    static std::mutex registry_mu;
+    static std::unordered_map<uint32_t, RDMAContext *> registry;
+    static uint32_t next_qp_num = 1;
+
+    uint32_t LoopbackWire::Register(RDMAContext * ctx) {
+        std::lock_guard<std::mutex> l(registry_mu);
+        uint32_t qp_num = next_qp_num++;
+        registry[qp_num] = ctx;
+        return qp_num;
+    }
+
+    void LoopbackWire::Unregister(uint32_t qp_num) {
+        std::lock_guard<std::mutex> l(registry_mu);
+        registry.erase(qp_num);
+    }
+
+    RDMAContext * LoopbackWire::Lookup(uint32_t qp_num) {
+        std::lock_guard<std::mutex> l(registry_mu);
+        auto iter = registry.find(qp_num);
+        return iter == registry.end() ? nullptr : iter->second;
+    }
+
+    uint64_t LoopbackWire::NowNs() {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    LoopbackWire::LoopbackWire(uint64_t latency_ns, uint64_t bandwidth_mbps) :
+        latency_ns_(latency_ns), bandwidth_mbps_(bandwidth_mbps), link_free_at_(0), stop_(false) {
+        if (latency_ns_ > 0 || bandwidth_mbps_ > 0) {
+            worker_ = std::thread(&LoopbackWire::Run, this);
+        }
+    }
+
+    LoopbackWire::~LoopbackWire() {
+        if (worker_.joinable()) {
+            {
+                std::lock_guard<std::mutex> l(mu_);
+                stop_ = true;
+            }
+            cv_.notify_one();
+            worker_.join();
+        }
+    }
+
+    void LoopbackWire::Post(Packet && pkt) {
+        pkt.src->lb_inflight.fetch_add(1);
+        if (!worker_.joinable()) {
+            Deliver(pkt);
+            return ;
+        }
+
+        if (pkt.kind != Kind::Read) {
+            pkt.payload.assign(pkt.data, pkt.data + pkt.length);
+            pkt.data = pkt.payload.data();
+        }
+        {
+            std::lock_guard<std::mutex> l(mu_);
+            uint64_t start = std::max(NowNs(), link_free_at_);
+            link_free_at_ = start + (bandwidth_mbps_ > 0 ? pkt.length * 1000 / bandwidth_mbps_ : 0);
+            pkt.deliver_at = link_free_at_ + latency_ns_;
+            queue_.push_back(std::move(pkt));
+        }
+        cv_.notify_one();
+    }
+
+    void LoopbackWire::Deliver(Packet & pkt) {
+        switch (pkt.kind) {
+        case Kind::Write:
+            // like a NIC, the last byte of a write lands last, a receiver may poll it
+            if (pkt.length > 1) memcpy(pkt.dst, pkt.data, pkt.length - 1);
+            std::atomic_thread_fence(std::memory_order_release);
+            if (pkt.length > 0) *(volatile uint8_t *)(pkt.dst + pkt.length - 1) = pkt.data[pkt.length - 1];
+            break;
+        case Kind::Read:
+            if (pkt.length > 0) memcpy(pkt.dst, pkt.data, pkt.length);
+            break;
+        case Kind::WriteImm: // intended passdown
+        case Kind::Send: {
+            // like rnr_retry = 7, wait for the peer to post a receive
+            RDMAContext * peer = pkt.peer;
+            uint32_t head = peer->lb_recv_head.load(std::memory_order_relaxed);
+            while (head == peer->lb_recv_tail.load(std::memory_order_acquire)) asm("pause");
+            uint32_t slot = head % MAX_QP_DEPTH;
+            if (pkt.kind == Kind::WriteImm) {
+                if (pkt.length > 0) memcpy(pkt.dst, pkt.data, pkt.length);
+                peer->lb_recv_imm[slot] = pkt.imm;
+            } else {
+                size_t len = std::min<size_t>(pkt.length, peer->lb_recv_len[slot]);
+                memcpy(peer->send_buf + peer->lb_recv_off[slot], pkt.data, len);
+            }
+            peer->lb_recv_head.store(head + 1, std::memory_order_release);
+            break;
+        }
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+
+        if (pkt.wr_id) {
+            pkt.src->lb_send_credit.fetch_add(pkt.wr_id, std::memory_order_relaxed);
+            pkt.src->lb_send_cqe.fetch_add(1, std::memory_order_release);
+        }
+        pkt.src->lb_inflight.fetch_sub(1, std::memory_order_release);
+    }
+
+    void LoopbackWire::Run() {
+        while (true) {
+            Packet pkt;
+            {
+                std::unique_lock<std::mutex> l(mu_);
+                cv_.wait(l, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return ;
+                pkt = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            while (NowNs() < pkt.deliver_at) asm("pause");
+            Deliver(pkt);
+        }
+    }
+}
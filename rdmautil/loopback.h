@@ -0,0 +1,81 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#ifndef __LOOPBACK_UTIL__
+#define __LOOPBACK_UTIL__
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+
+namespace RDMAUtil {
+    struct RDMAContext;
+
+    /*
+     * The wire of the shared-memory loopback transport. Peers of a loopback device live in the same
+     * address space, so the addresses exchanged in a connection_certificate are plain pointers and a
+     * one-sided operation is a memcpy into the peer.
+     *
+     * Without injected latency or bandwidth limit a work request is delivered at post time. Otherwise
+     * every work request of the device goes through one wire thread in posting order: it is delivered
+     * after the serialization delay of the bandwidth limit plus the injected latency, and its completion
+     * is only visible afterwards, like a NIC port.
+     */
+    class LoopbackWire {
+    public:
+        enum class Kind {Write, WriteImm, Send, Read};
+
+        struct Packet {
+            Kind kind;
+            RDMAContext * src;        // the posting context, completed when `wr_id` is nonzero
+            RDMAContext * peer;       // the remote context, consumes a posted recv for Kind::Send and Kind::WriteImm
+            uint8_t * dst;            // destination of Kind::Write and Kind::Read
+            const uint8_t * data;     // source, a Kind::Read is copied at delivery time
+            size_t length;
+            std::vector<uint8_t> payload; // posted writes and sends are copied at post time
+            uint64_t wr_id;           // send queue slots freed by the completion, 0 if unsignaled
+            uint32_t imm;             // immediate data of Kind::WriteImm
+            uint64_t deliver_at;      // steady clock in ns
+        };
+
+        LoopbackWire(uint64_t latency_ns, uint64_t bandwidth_mbps);
+
+        ~LoopbackWire();
+
+        LoopbackWire(const LoopbackWire &) = delete;
+        LoopbackWire &operator=(const LoopbackWire &) = delete;
+
+        void Post(Packet && pkt);
+
+        // connection bookkeeping: loopback queue pair numbers resolve to the peer context
+        static uint32_t Register(RDMAContext * ctx);
+
+        static void Unregister(uint32_t qp_num);
+
+        static RDMAContext * Lookup(uint32_t qp_num);
+
+        static uint64_t NowNs();
+
+    private:
+        void Deliver(Packet & pkt);
+
+        void Run();
+
+        uint64_t latency_ns_;
+        uint64_t bandwidth_mbps_; // MB/s, i.e. bytes per microsecond
+        uint64_t link_free_at_;   // the time the wire finishes serializing the last packet
+
+        std::mutex mu_;
+        std::condition_variable cv_;
+        std::deque<Packet> queue_;
+        bool stop_;
+        std::thread worker_;
+    };
+}
+
+#endif // __LOOPBACK_UTIL__
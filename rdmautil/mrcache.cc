@@ -0,0 +1,110 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#include "mrcache.h"
+
+namespace RDMAUtil {
+    static inline bool covers(struct ibv_mr * mr, uintptr_t start, uintptr_t end) {
+        uintptr_t base = (uintptr_t)mr->addr;
+        return base <= start && end <= base + mr->length;
+    }
+
+    MRCache::MRCache(struct ibv_pd * pd, size_t capacity, bool on_demand) :
+        pd_(pd), capacity_(capacity), registered_(0) {
+        // nothing writes into caller memory, the peer only reads it
+        access_ = IBV_ACCESS_REMOTE_READ | (on_demand ? IBV_ACCESS_ON_DEMAND : 0);
+    }
+
+    MRCache::~MRCache() {
+        for (auto & entry : lru_) {
+            ibv_dereg_mr(entry.mr);
+        }
+    }
+
+    struct ibv_mr * MRCache::Pin(const void * addr, size_t length) {
+        uintptr_t start = (uintptr_t)addr;
+        uintptr_t end = start + length;
+
+        std::lock_guard<std::mutex> l(mu_);
+        // the region starting closest below `start`
+        auto it = starts_.upper_bound(start);
+        if (it != starts_.begin() && covers(std::prev(it)->second->mr, start, end)) {
+            Lru::iterator entry = std::prev(it)->second;
+            entry->pins += 1;
+            lru_.splice(lru_.begin(), lru_, entry);
+            return entry->mr;
+        }
+
+        uintptr_t page_start = start & ~(PAGE_SIZE - 1);
+        uintptr_t page_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        size_t size = page_end - page_start;
+        // make room from the least recently pinned regions nobody uses
+        for (auto victim = lru_.end(); registered_ + size > capacity_ && victim != lru_.begin(); ) {
+            --victim;
+            if (victim->pins == 0) {
+                Drop(victim++);
+            }
+        }
+        if (registered_ + size > capacity_) {
+            return nullptr;
+        }
+
+        struct ibv_mr * mr = ibv_reg_mr(pd_, (void *)page_start, size, access_);
+        if (!mr) {
+            return nullptr;
+        }
+        registered_ += size;
+        lru_.push_front({mr, 1, true});
+        mrs_.emplace(mr, lru_.begin());
+        // a shorter region starting at the same page is not found any more, and goes once unpinned
+        auto [pos, inserted] = starts_.emplace(page_start, lru_.begin());
+        if (!inserted) {
+            Lru::iterator shorter = pos->second;
+            pos->second = lru_.begin();
+            shorter->cached = false;
+            if (shorter->pins == 0) {
+                Drop(shorter);
+            }
+        }
+        return mr;
+    }
+
+    void MRCache::Unpin(struct ibv_mr * mr) {
+        std::lock_guard<std::mutex> l(mu_);
+        Lru::iterator entry = mrs_.at(mr);
+        entry->pins -= 1;
+        if (entry->pins == 0 && !entry->cached) {
+            Drop(entry);
+        }
+    }
+
+    void MRCache::Invalidate(const void * addr, size_t length) {
+        uintptr_t start = (uintptr_t)addr;
+        uintptr_t end = start + length;
+
+        std::lock_guard<std::mutex> l(mu_);
+        for (auto it = starts_.begin(); it != starts_.end() && it->first < end; ) {
+            Lru::iterator entry = it->second;
+            if (start < it->first + entry->mr->length) {
+                it = starts_.erase(it);
+                entry->cached = false;
+                if (entry->pins == 0) {
+                    Drop(entry);
+                }
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void MRCache::Drop(Lru::iterator entry) {
+        if (entry->cached) {
+            starts_.erase((uintptr_t)entry->mr->addr);
+        }
+        registered_ -= entry->mr->length;
+        mrs_.erase(entry->mr);
+        ibv_dereg_mr(entry->mr);
+        lru_.erase(entry);
+    }
+}
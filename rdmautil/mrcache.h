@@ -0,0 +1,70 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#ifndef __MRCACHE_UTIL__
+#define __MRCACHE_UTIL__
+
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#include <infiniband/verbs.h>
+
+namespace RDMAUtil {
+    /*
+     * MRCache: registers caller-owned memory on demand so that work requests can gather from it or
+     * let the peer read it without a copy. A miss registers the pages around the range, later requests
+     * within those pages hit and pay a lookup instead of a registration. A region is pinned by the
+     * requests using it, and regions nobody pins are evicted least recently used first once keeping
+     * them would exceed `capacity` bytes. A request finding no room fails, and the caller copies.
+     *
+     * With on-demand paging the NIC follows the mappings of the process, otherwise a region keeps the
+     * pages it was made for: memory given back to the system (munmap, or free of an mmap-backed
+     * allocation) has to be dropped with Invalidate() before the range is mapped again.
+     */
+    class MRCache {
+    public:
+        static constexpr size_t PAGE_SIZE = 4096;
+
+        MRCache(struct ibv_pd * pd, size_t capacity, bool on_demand);
+        ~MRCache();
+
+        MRCache(const MRCache &) = delete;
+        MRCache &operator=(const MRCache &) = delete;
+
+        // a region covering [addr, addr + length) the peer may read, pinned until Unpin(), nullptr if
+        // it cannot be registered
+        struct ibv_mr * Pin(const void * addr, size_t length);
+
+        // drop a pin of Pin() once no work request uses the region any more
+        void Unpin(struct ibv_mr * mr);
+
+        // forget every region overlapping [addr, addr + length), those still pinned once unpinned
+        void Invalidate(const void * addr, size_t length);
+
+    private:
+        struct Entry {
+            struct ibv_mr * mr;
+            int pins;
+            bool cached; // found by Pin(), not yet invalidated or replaced
+        };
+        using Lru = std::list<Entry>; // most recently pinned first
+
+        void Drop(Lru::iterator entry);
+
+        std::mutex mu_;
+        struct ibv_pd * pd_;
+        size_t capacity_;
+        int access_;
+        size_t registered_;
+        Lru lru_;
+        std::map<uintptr_t, Lru::iterator> starts_;               // the cached regions by start address
+        std::unordered_map<struct ibv_mr *, Lru::iterator> mrs_; // every region, pinned ones too
+    };
+}
+
+#endif // __MRCACHE_UTIL__
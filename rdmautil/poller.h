@@ -0,0 +1,170 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#ifndef __POLLER_UTIL__
+#define __POLLER_UTIL__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <chrono>
+#include <thread>
+
+namespace RDMAUtil {
+    /*
+     * How a poller waits after polls that found nothing: it spins for `spin` empty polls, spins with
+     * a pause instruction for `pause` more, yields the cpu for `yield` more, and afterwards blocks for
+     * at most `block_ms` per empty poll. A zeroed policy spins forever, which is the default.
+     */
+    struct PollPolicy {
+        uint32_t spin;
+        uint32_t pause;
+        uint32_t yield;
+        int block_ms;
+
+        // "spin,pause,yield,block_ms", an empty string spins forever
+        static PollPolicy Parse(const std::string & str) {
+            PollPolicy policy = {0, 0, 0, 0};
+            if (!str.empty() && sscanf(str.c_str(), "%u,%u,%u,%d", &policy.spin, &policy.pause,
+                                       &policy.yield, &policy.block_ms) != 4) {
+                fprintf(stderr, "bad poll policy \"%s\", spinning instead\n", str.c_str());
+                policy = {0, 0, 0, 0};
+            }
+            return policy;
+        }
+    };
+
+    enum PollPhase {SPIN, PAUSE, YIELD, BLOCK, POLL_PHASES};
+
+    // where a poller spent the time it found nothing to do
+    struct PollStats {
+        uint64_t ns[POLL_PHASES];
+        uint64_t wakeups; // blocking waits ended by a completion event rather than the timeout
+
+        void Print(FILE * out, const char * who) const {
+            fprintf(out, "%s idle ms: spin %.1f pause %.1f yield %.1f block %.1f (%lu wakeups)\n", who,
+                    ns[SPIN] / 1e6, ns[PAUSE] / 1e6, ns[YIELD] / 1e6, ns[BLOCK] / 1e6, wakeups);
+        }
+    };
+
+    /*
+     * Poller: walks through the phases of a PollPolicy while polls keep coming back empty, and starts
+     * over from spinning once a poll found work. Time is only read when the phase changes.
+     *
+     * Blocking on a completion queue takes two empty polls: the first one arms the queue, the second
+     * one waits for its event. The caller polls in between, so an entry that completed before the
+     * queue was armed is never slept over.
+     */
+    class Poller {
+    public:
+        Poller() : policy_{0, 0, 0, 0}, empty_(0), phase_(SPIN), since_(0), armed_(false), stats_{} {}
+
+        void SetPolicy(PollPolicy policy) {
+            policy_ = policy;
+        }
+
+        // a poll found work
+        inline void Busy() {
+            if (empty_ > 0) {
+                Enter(SPIN);
+                empty_ = 0;
+                armed_ = false;
+            }
+        }
+
+        /*
+         * A poll of `ctx`'s send or receive completion queue found nothing. `Ctx` provides
+         * arm_cq(send) and wait_cq(timeout_ms, send), see RDMAContext.
+         */
+        template <typename Ctx>
+        inline void Idle(Ctx * ctx, bool send) {
+            if (Wait() != BLOCK) {
+                return ;
+            }
+            if (!armed_) {
+                armed_ = ctx->arm_cq(send) == 0;
+                if (armed_) return ;
+            }
+            armed_ = false;
+            if (ctx->wait_cq(policy_.block_ms, send) > 0) {
+                stats_.wakeups += 1;
+            }
+        }
+
+        // a poll of something without completion events found nothing, blocking sleeps instead
+        inline void Idle() {
+            if (Wait() == BLOCK) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(policy_.block_ms));
+            }
+        }
+
+        // the idle time accounted up to the last phase change
+        const PollStats & Stats() const {
+            return stats_;
+        }
+
+    private:
+        inline PollPhase Phase(uint64_t empty) const {
+            if (empty <= policy_.spin) return SPIN;
+            empty -= policy_.spin;
+            if (empty <= policy_.pause) return PAUSE;
+            empty -= policy_.pause;
+            if (empty <= policy_.yield || policy_.block_ms <= 0) return YIELD;
+            return BLOCK;
+        }
+
+        // count an empty poll and spend its phase, except for blocking which is up to the caller
+        inline PollPhase Wait() {
+            empty_ += 1;
+            if (policy_.spin == 0 && policy_.pause == 0 && policy_.yield == 0 && policy_.block_ms <= 0) {
+                asm volatile ("nop");
+                return SPIN;
+            }
+            if (empty_ == 1) {
+                since_ = NowNs();
+            }
+            PollPhase phase = Phase(empty_);
+            if (phase != phase_) {
+                Enter(phase);
+            }
+            switch (phase) {
+            case SPIN:
+                asm volatile ("nop");
+                break;
+            case PAUSE:
+                asm volatile ("pause" : : : "memory");
+                break;
+            case YIELD:
+                std::this_thread::yield();
+                break;
+            default:
+                break;
+            }
+            return phase;
+        }
+
+        inline void Enter(PollPhase phase) {
+            if (since_ != 0) {
+                uint64_t now = NowNs();
+                stats_.ns[phase_] += now - since_;
+                since_ = phase == SPIN ? 0 : now;
+            }
+            phase_ = phase;
+        }
+
+        static inline uint64_t NowNs() {
+            using namespace std::chrono;
+            return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        PollPolicy policy_;
+        uint64_t empty_;  // polls in a row that found nothing
+        PollPhase phase_;
+        uint64_t since_;  // start of the current phase in ns, 0 while not measuring
+        bool armed_;      // the completion queue was armed by the previous empty poll
+        PollStats stats_;
+    };
+}
+
+#endif // __POLLER_UTIL__
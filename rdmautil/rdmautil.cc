@@ -4,6 +4,9 @@
 
 #include "rdmautil.h"
 #include <infiniband/verbs.h>
+#include <poll.h>
+#include <algorithm>
+#include <cassert>
 
 namespace RDMAUtil {
     int RDMAContext::default_connect(int socket) {
@@ -13,19 +16,28 @@ namespace RDMAUtil {
             return -1;
         }
 
+        if (loopback) {
+            // no queue pair state machine, just find the peer context
+            if (!(peer = LoopbackWire::Lookup(remote.qp_num))) {
+                fprintf(stderr, "Loopback peer %u not found\n", remote.qp_num);
+                return -1;
+            }
+            return 0;
+        }
+
         auto init_attr = RDMADevice::get_default_qp_init_state_attr();
         if (auto [status, err] = modify_qp(*init_attr, RDMADevice::get_default_qp_init_state_attr_mask()); status != Status::Ok) {
             fprintf(stderr, "Modify QP to Init failed, error code: %d\n", err);
             return err;
         }
 
-        auto rtr_attr = RDMADevice::get_default_qp_rtr_attr(remote, device->get_ib_port(), device->get_gid_idx());
+        auto rtr_attr = RDMADevice::get_default_qp_rtr_attr(local, remote, device->get_profile(), device->get_ib_port(), device->get_gid_idx());
         if (auto [status, err] = modify_qp(*rtr_attr, RDMADevice::get_default_qp_rtr_attr_mask()); status != Status::Ok) {
             fprintf(stderr, "Modify QP to RTR failed, error code: %d\n", err);
             return err;
         }
 
-        auto rts_attr = RDMADevice::get_default_qp_rts_attr();
+        auto rts_attr = RDMADevice::get_default_qp_rts_attr(device->get_profile());
         if (auto [status, err] = modify_qp(*rts_attr, RDMADevice::get_default_qp_rts_attr_mask()); status != Status::Ok) {
             fprintf(stderr, "Modify QP to RTS failed, error code: %d\n", err);
             return err;
@@ -51,9 +63,16 @@ namespace RDMAUtil {
         tmp.addr = htonll(local.addr);
         tmp.rkey = htonl(local.rkey);
         tmp.length = htonl(local.length);
+        tmp.addr2 = htonll(local.addr2);
+        tmp.rkey2 = htonl(local.rkey2);
+        tmp.length2 = htonl(local.length2);
+        tmp.addr3 = htonll(local.addr3);
+        tmp.rkey3 = htonl(local.rkey3);
+        tmp.length3 = htonl(local.length3);
         tmp.qp_num = htonl(local.qp_num);
         tmp.lid = htons(local.lid);
         memcpy(tmp.gid, local.gid, 16);
+        tmp.mtu = local.mtu;
         if (write(sockfd, &tmp, normal) != normal) {
             return Status::WriteError;
         }
@@ -68,9 +87,16 @@ namespace RDMAUtil {
         remote.addr = ntohll(tmp.addr);
         remote.rkey = ntohl(tmp.rkey);
         remote.length = ntohl(tmp.length);
+        remote.addr2 = ntohll(tmp.addr2);
+        remote.rkey2 = ntohl(tmp.rkey2);
+        remote.length2 = ntohl(tmp.length2);
+        remote.addr3 = ntohll(tmp.addr3);
+        remote.rkey3 = ntohl(tmp.rkey3);
+        remote.length3 = ntohl(tmp.length3);
         remote.qp_num = ntohl(tmp.qp_num);
         remote.lid = ntohs(tmp.lid);
         memcpy(remote.gid, tmp.gid, 16);
+        remote.mtu = tmp.mtu;
         return Status::Ok;
     }
 
@@ -80,6 +106,10 @@ namespace RDMAUtil {
             memcpy(send_buf + local_offset, msg, msg_len);
         }
 
+        if (loopback) {
+            return lb_post_one(LoopbackWire::Kind::Send, send_buf + local_offset, msg_len, nullptr, signal);
+        }
+
         struct ibv_sge sg;
         struct ibv_send_wr sr;
         memset(&sr, 0, sizeof(ibv_send_wr));
@@ -94,15 +124,21 @@ namespace RDMAUtil {
         sr.next = NULL;
         sr.send_flags = signal ? IBV_SEND_SIGNALED : 0;
 
-        struct ibv_send_wr *bad_wr;
-        if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
-            fprintf(stderr, "Post query failed\n");
-            return ret;
-        }
-        return 0;
+        return post_one(sr, signal);
     }
 
     int RDMAContext::post_recv(size_t msg_len, size_t offset) {
+        if (loopback) {
+            uint32_t tail = lb_recv_tail.load(std::memory_order_relaxed);
+            if (tail - lb_recv_polled >= qp_depth) {
+                return ENOMEM;
+            }
+            lb_recv_off[tail % MAX_QP_DEPTH] = offset;
+            lb_recv_len[tail % MAX_QP_DEPTH] = msg_len;
+            lb_recv_tail.store(tail + 1, std::memory_order_release);
+            return 0;
+        }
+
         struct ibv_recv_wr *bad_wr;
         
         struct ibv_sge sg;
@@ -124,137 +160,304 @@ namespace RDMAUtil {
 
     int RDMAContext::post_read(size_t msg_len, size_t local_offset, size_t remote_offset, bool signal) 
     {
-        struct ibv_sge sg;
-        struct ibv_send_wr sr;
-        memset(&sr, 0, sizeof(ibv_send_wr));
-        sg.addr	  = reinterpret_cast<uint64_t>(write_buf + dmaoff + local_offset);
-        sg.length = msg_len;
-        sg.lkey	  = write_mr->lkey;
+        uint32_t rkey;
+        uint64_t remote_addr = remote_write_addr(remote_offset, &rkey);
+        return post_rdma_read(write_buf + dmaoff + local_offset, write_mr, msg_len, remote_addr, rkey, signal);
+    }
 
-        sr.wr_id      = 0;
-        sr.sg_list    = &sg;
-        sr.num_sge    = 1;
-        sr.opcode     = IBV_WR_RDMA_READ;
-        sr.next = NULL;
-        sr.send_flags = signal ? IBV_SEND_SIGNALED : 0;
-        sr.wr.rdma.remote_addr = remote.addr + remote_offset;
-        sr.wr.rdma.rkey = remote.rkey;
+    int RDMAContext::post_read1(size_t msg_len, size_t local_offset, size_t remote_offset, bool signal) 
+    {
+        uint32_t rkey;
+        uint64_t remote_addr = remote_write_addr(remote_offset, &rkey);
+        return post_rdma_read(send_buf + local_offset, send_mr, msg_len, remote_addr, rkey, signal);
+    }
 
-        struct ibv_send_wr *bad_wr;
-        if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
-            fprintf(stderr, "Post query failed\n");
-            return ret;
+    int RDMAContext::post_read2(size_t msg_len, size_t local_offset, size_t remote_offset, bool signal) 
+    {
+        return post_rdma_read(send_buf + local_offset, send_mr, msg_len, remote.addr2 + remote_offset, remote.rkey2, signal);
+    }
+
+    bool RDMAContext::expose(const void *addr, size_t len, uint64_t *remote_addr, uint32_t *rkey, struct ibv_mr **pin)
+    {
+        *remote_addr = reinterpret_cast<uint64_t>(addr);
+        *rkey = 0;
+        *pin = nullptr;
+        if (loopback) {
+            return true;
         }
-        return 0;
+
+        const uint8_t *start = (const uint8_t *)addr;
+        if (start >= send_buf && start + len <= send_buf + SEND_BUF_SIZE) {
+            *rkey = send_mr->rkey;
+        } else if (auto mr = device->get_mr_cache()->Pin(start, len); mr) {
+            *rkey = mr->rkey;
+            *pin = mr;
+        } else {
+            return false;
+        }
+        return true;
     }
 
-    // use local write_buf, write to remote write_buf
-    int RDMAContext::post_write(const uint8_t *msg, size_t msg_len, size_t local_offset,
-                                 size_t remote_offset, bool signal) 
+    void RDMAContext::unpin(struct ibv_mr *mr)
     {
-        uint8_t * address = write_buf + dmaoff + local_offset;
-        if (msg) {
-            memcpy(address, msg, msg_len);
+        if (mr) {
+            device->get_mr_cache()->Unpin(mr);
         }
-        
+    }
+
+    int RDMAContext::post_read_at(size_t msg_len, size_t local_offset, uint64_t remote_addr, uint32_t rkey, bool signal)
+    {
+        return post_rdma_read(write_buf + dmaoff + local_offset, write_mr, msg_len, remote_addr, rkey, signal);
+    }
+
+    int RDMAContext::post_read_at1(size_t msg_len, size_t local_offset, uint64_t remote_addr, uint32_t rkey, bool signal)
+    {
+        return post_rdma_read(send_buf + local_offset, send_mr, msg_len, remote_addr, rkey, signal);
+    }
+
+    int RDMAContext::post_rdma_read(uint8_t *address, struct ibv_mr *mr, size_t msg_len, uint64_t remote_addr, uint32_t rkey, bool signal) 
+    {
+        if (loopback) {
+            return lb_post_one(LoopbackWire::Kind::Read, (uint8_t *)remote_addr, msg_len, address, signal);
+        }
+
         struct ibv_sge sg;
         struct ibv_send_wr sr;
         memset(&sr, 0, sizeof(ibv_send_wr));
         sg.addr	  = reinterpret_cast<uint64_t>(address);
         sg.length = msg_len;
-        sg.lkey	  = write_mr->lkey;
+        sg.lkey	  = mr->lkey;
 
         sr.wr_id      = 0;
         sr.sg_list    = &sg;
         sr.num_sge    = 1;
-        sr.opcode     = IBV_WR_RDMA_WRITE;
+        sr.opcode     = IBV_WR_RDMA_READ;
         sr.next = NULL;
         sr.send_flags = signal ? IBV_SEND_SIGNALED : 0;
+        sr.wr.rdma.remote_addr = remote_addr;
+        sr.wr.rdma.rkey = rkey;
 
-        if(msg_len <= MAX_INLINE_SIZE)
-            sr.send_flags |= IBV_SEND_INLINE;
-
-        sr.wr.rdma.remote_addr = remote.addr + remote_offset;
-        sr.wr.rdma.rkey = remote.rkey;
+        return post_one(sr, signal);
+    }
 
-        struct ibv_send_wr *bad_wr;
-        if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
-            fprintf(stderr, "Post query failed\n");
+    // use local write_buf, write to remote write_buf
+    int RDMAContext::post_write(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                 size_t remote_offset, bool signal) 
+    {
+        if (auto ret = batch_write(msg, msg_len, local_offset, remote_offset, signal); ret != 0) {
             return ret;
         }
-        return 0;
+        return post_batch();
     }
 
     // use local write_buf, write to remote send_buf
     int RDMAContext::post_write0(const uint8_t *msg, size_t msg_len, size_t local_offset,
                                  size_t remote_offset, bool signal) 
+    {
+        if (auto ret = batch_write0(msg, msg_len, local_offset, remote_offset, signal); ret != 0) {
+            return ret;
+        }
+        return post_batch();
+    }
+
+    // use local send_buf, write to remote write_buf
+    int RDMAContext::post_write1(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                 size_t remote_offset, bool signal) 
+    {
+        if (auto ret = batch_write1(msg, msg_len, local_offset, remote_offset, signal); ret != 0) {
+            return ret;
+        }
+        return post_batch();
+    }
+
+    // use local send_buf, write to remote send_buf
+    int RDMAContext::post_write2(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                 size_t remote_offset, bool signal) 
+    {
+        if (auto ret = batch_write2(msg, msg_len, local_offset, remote_offset, signal); ret != 0) {
+            return ret;
+        }
+        return post_batch();
+    }
+
+    int RDMAContext::batch_write(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                 size_t remote_offset, bool signal) 
     {
         uint8_t * address = write_buf + dmaoff + local_offset;
-        
         if (msg) {
             memcpy(address, msg, msg_len);
         }
+        uint32_t rkey;
+        uint64_t remote_addr = remote_write_addr(remote_offset, &rkey);
+        return batch_rdma_write(address, write_mr, msg_len, remote_addr, rkey, signal);
+    }
 
-        struct ibv_sge sg;
-        struct ibv_send_wr sr;
-        memset(&sr, 0, sizeof(ibv_send_wr));
-        sg.addr	  = reinterpret_cast<uint64_t>(address);
-        sg.length = msg_len;
-        sg.lkey	  = write_mr->lkey;
-
-        sr.wr_id      = 0;
-        sr.sg_list    = &sg;
-        sr.num_sge    = 1;
-        sr.opcode     = IBV_WR_RDMA_WRITE;
-        sr.next = NULL;
-        sr.send_flags = signal ? IBV_SEND_SIGNALED : 0;
-
-        if(msg_len <= MAX_INLINE_SIZE)
-            sr.send_flags |= IBV_SEND_INLINE;
+    int RDMAContext::batch_write0(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                  size_t remote_offset, bool signal) 
+    {
+        uint8_t * address = write_buf + dmaoff + local_offset;
+        if (msg) {
+            memcpy(address, msg, msg_len);
+        }
+        return batch_rdma_write(address, write_mr, msg_len, remote.addr0 + remote_offset, remote.rkey0, signal);
+    }
 
-        sr.wr.rdma.remote_addr = remote.addr0 + remote_offset;
-        sr.wr.rdma.rkey = remote.rkey0;
+    int RDMAContext::batch_write1(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                  size_t remote_offset, bool signal) 
+    {
+        uint8_t * address = send_buf + local_offset;
+        if (msg) {
+            memcpy(address, msg, msg_len);
+        }
+        uint32_t rkey;
+        uint64_t remote_addr = remote_write_addr(remote_offset, &rkey);
+        return batch_rdma_write(address, send_mr, msg_len, remote_addr, rkey, signal);
+    }
 
-        struct ibv_send_wr *bad_wr;
-        if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
-            fprintf(stderr, "Post query failed\n");
-            return ret;
+    int RDMAContext::batch_write2(const uint8_t *msg, size_t msg_len, size_t local_offset,
+                                  size_t remote_offset, bool signal) 
+    {
+        uint8_t * address = send_buf + local_offset;
+        if (msg) {
+            memcpy(address, msg, msg_len);
         }
-        return 0;
+        return batch_rdma_write(address, send_mr, msg_len, remote.addr0 + remote_offset, remote.rkey0, signal);
     }
 
-    // use local send_buf, write to remote write_buf
-    int RDMAContext::post_write1(const uint8_t *msg, size_t msg_len, size_t local_offset,
-                                 size_t remote_offset, bool signal) 
+    // use local send_buf, write to remote send_buf and complete a receive of the remote with `imm`
+    int RDMAContext::batch_write2_imm(const uint8_t *msg, size_t msg_len, uint32_t imm, size_t local_offset,
+                                      size_t remote_offset, bool signal) 
     {
         uint8_t * address = send_buf + local_offset;
         if (msg) {
             memcpy(address, msg, msg_len);
         }
-        
-        struct ibv_sge sg;
-        struct ibv_send_wr sr;
-        memset(&sr, 0, sizeof(ibv_send_wr));
+        return batch_rdma_write(address, send_mr, msg_len, remote.addr0 + remote_offset, remote.rkey0, signal,
+                                IBV_WR_RDMA_WRITE_WITH_IMM, imm);
+    }
 
+    int RDMAContext::batch_writev(const Slice *slices, int n, size_t remote_offset, bool signal)
+    {
+        assert(n > 0 && n <= MAX_SGE);
+        struct ibv_sge sge[MAX_SGE];
+        struct ibv_mr *pins[MAX_SGE];
+        int pinned = 0;
+        for (int i = 0; i < n; i++) {
+            sge[i].addr = reinterpret_cast<uint64_t>(slices[i].addr);
+            sge[i].length = slices[i].length;
+            sge[i].lkey = 0;
+            if (loopback) {
+                continue;
+            }
+
+            uint8_t *start = (uint8_t *)slices[i].addr;
+            if (start >= send_buf && start + slices[i].length <= send_buf + SEND_BUF_SIZE) {
+                sge[i].lkey = send_mr->lkey;
+            } else if (write_mr && !dmabuf && start >= write_buf && start + slices[i].length <= write_buf + local.length) {
+                sge[i].lkey = write_mr->lkey;
+            } else if (auto mr = device->get_mr_cache()->Pin(start, slices[i].length); mr) {
+                sge[i].lkey = mr->lkey;
+                pins[pinned++] = mr;
+            } else {
+                while (pinned > 0) unpin(pins[--pinned]);
+                return -1;
+            }
+        }
+        uint32_t rkey;
+        uint64_t remote_addr = remote_write_addr(remote_offset, &rkey);
+        if (auto ret = batch_rdma_writev(sge, n, remote_addr, rkey, signal); ret != 0) {
+            while (pinned > 0) unpin(pins[--pinned]);
+            return ret;
+        }
+        // the work request just staged took the last sequence number
+        for (int i = 0; i < pinned; i++) {
+            pin_mr[pin_tail % (MAX_QP_DEPTH * MAX_SGE)] = pins[i];
+            pin_wr[pin_tail % (MAX_QP_DEPTH * MAX_SGE)] = wr_posted;
+            pin_tail += 1;
+        }
+        return 0;
+    }
+
+    int RDMAContext::batch_rdma_write(uint8_t *address, struct ibv_mr *mr, size_t msg_len,
+                                      uint64_t remote_addr, uint32_t rkey, bool signal,
+                                      enum ibv_wr_opcode opcode, uint32_t imm)
+    {
+        struct ibv_sge sg;
         sg.addr	  = reinterpret_cast<uint64_t>(address);
         sg.length = msg_len;
-        sg.lkey	  = write_mr->lkey;
+        sg.lkey	  = mr ? mr->lkey : 0;
+        return batch_rdma_writev(&sg, 1, remote_addr, rkey, signal, opcode, imm);
+    }
 
-        sr.wr_id      = 0;
-        sr.sg_list    = &sg;
-        sr.num_sge    = 1;
-        sr.opcode     = IBV_WR_RDMA_WRITE;
+    int RDMAContext::batch_rdma_writev(const struct ibv_sge *sge, int num_sge, uint64_t remote_addr, uint32_t rkey,
+                                       bool signal, enum ibv_wr_opcode opcode, uint32_t imm)
+    {
+        if (batch_len == MAX_BATCH) {
+            // the chain is full, ring the doorbell for what we have
+            if (auto ret = post_batch(); ret != 0) {
+                return ret;
+            }
+        }
+
+        struct ibv_send_wr &sr = batch_wr[batch_len];
+        memset(&sr, 0, sizeof(ibv_send_wr));
+        size_t msg_len = 0;
+        for (int i = 0; i < num_sge; i++) {
+            batch_sge[batch_len][i] = sge[i];
+            msg_len += sge[i].length;
+        }
+
+        sr.wr_id      = next_wr_id(signal);
+        sr.sg_list    = batch_sge[batch_len];
+        sr.num_sge    = num_sge;
+        sr.opcode     = opcode;
         sr.next = NULL;
-        sr.send_flags = signal ? IBV_SEND_SIGNALED : 0;
+        sr.send_flags = sr.wr_id ? IBV_SEND_SIGNALED : 0;
+        sr.imm_data   = htonl(imm);
 
-        if(msg_len <= MAX_INLINE_SIZE)
+        if(msg_len <= (size_t)inline_size)
             sr.send_flags |= IBV_SEND_INLINE;
 
-        sr.wr.rdma.remote_addr = remote.addr + remote_offset;
-        sr.wr.rdma.rkey = remote.rkey;
+        sr.wr.rdma.remote_addr = remote_addr;
+        sr.wr.rdma.rkey = rkey;
 
+        if (batch_len > 0) {
+            batch_wr[batch_len - 1].next = &sr;
+        }
+        batch_len += 1;
+        return 0;
+    }
+
+    int RDMAContext::post_batch() {
+        if (batch_len == 0) {
+            return 0;
+        }
+
+        int n = batch_len;
+        batch_len = 0;
+        if (auto ret = acquire_credits(n); ret != 0) {
+            return ret;
+        }
+
+        if (loopback) {
+            for (int i = 0; i < n; i++) {
+                // a gather is a run of writes, only the last one completes and carries the immediate
+                uint8_t *dst = (uint8_t *)batch_wr[i].wr.rdma.remote_addr;
+                int last = batch_wr[i].num_sge - 1;
+                for (int j = 0; j <= last; j++) {
+                    struct ibv_sge &sg = batch_sge[i][j];
+                    bool imm = j == last && batch_wr[i].opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+                    lb_post(imm ? LoopbackWire::Kind::WriteImm : LoopbackWire::Kind::Write, (uint8_t *)sg.addr, sg.length,
+                            dst, j == last ? batch_wr[i].wr_id : 0, ntohl(batch_wr[i].imm_data));
+                    dst += sg.length;
+                }
+            }
+            return 0;
+        }
+
+        // one doorbell for the whole chain
         struct ibv_send_wr *bad_wr;
-        if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
+        if (auto ret = ibv_post_send(qp, &batch_wr[0], &bad_wr); ret != 0) {
             fprintf(stderr, "Post query failed\n");
             return ret;
         }
@@ -264,6 +467,15 @@ namespace RDMAUtil {
     int RDMAContext::post_cas(uint64_t old_val, uint64_t new_val, size_t local_offset,
         size_t remote_offset, bool signal) {
         // the orignal value is writen in the local offset 
+        if (loopback) {
+            // same operand order as the verbs work request below
+            uint64_t expected = new_val;
+            __atomic_compare_exchange_n((uint64_t *)(remote.addr + remote_offset), &expected, old_val,
+                                        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            memcpy(write_buf + dmaoff + local_offset, &expected, sizeof(uint64_t));
+            return lb_post_one(LoopbackWire::Kind::Write, nullptr, 0, nullptr, signal);
+        }
+
         struct ibv_sge sg;
         struct ibv_send_wr sr;
         memset(&sr, 0, sizeof(ibv_send_wr));
@@ -282,6 +494,41 @@ namespace RDMAUtil {
         sr.wr.atomic.compare_add = new_val;
         sr.wr.atomic.swap        = old_val; 
 
+        return post_one(sr, signal);
+    }
+
+    uint64_t RDMAContext::next_wr_id(bool signal) {
+        wr_posted += 1;
+        unsignaled += 1;
+        if (signal || unsignaled >= SIGNAL_INTERVAL) {
+            uint64_t covered = unsignaled;
+            unsignaled = 0;
+            return covered;
+        }
+        return 0;
+    }
+
+    int RDMAContext::acquire_credits(uint32_t n) {
+        while (sq_credits < n) {
+            if (poll_completions(MAX_POLL) < 0) {
+                return -1;
+            }
+        }
+        sq_credits -= n;
+        return 0;
+    }
+
+    int RDMAContext::post_one(struct ibv_send_wr &sr, bool signal) {
+        // keep the posting order the signaling decisions were made in
+        if (auto ret = post_batch(); ret != 0) {
+            return ret;
+        }
+        if (auto ret = acquire_credits(1); ret != 0) {
+            return ret;
+        }
+        sr.wr_id = next_wr_id(signal);
+        sr.send_flags = (sr.send_flags & ~IBV_SEND_SIGNALED) | (sr.wr_id ? IBV_SEND_SIGNALED : 0);
+
         struct ibv_send_wr *bad_wr;
         if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
             fprintf(stderr, "Post query failed\n");
@@ -290,59 +537,249 @@ namespace RDMAUtil {
         return 0;
     }
 
-    int RDMAContext::poll_completion_once(bool send) {
-        struct ibv_wc wc;
+    int RDMAContext::lb_post(LoopbackWire::Kind kind, const uint8_t *src, size_t msg_len, uint8_t *dst, uint64_t wr_id, uint32_t imm) {
+        LoopbackWire::Packet pkt;
+        pkt.kind = kind;
+        pkt.src = this;
+        pkt.peer = peer;
+        pkt.dst = dst;
+        pkt.data = src;
+        pkt.length = msg_len;
+        pkt.wr_id = wr_id;
+        pkt.imm = imm;
+        device->get_wire()->Post(std::move(pkt));
+        return 0;
+    }
+
+    int RDMAContext::lb_post_one(LoopbackWire::Kind kind, const uint8_t *src, size_t msg_len, uint8_t *dst, bool signal) {
+        if (auto ret = post_batch(); ret != 0) {
+            return ret;
+        }
+        if (auto ret = acquire_credits(1); ret != 0) {
+            return ret;
+        }
+        return lb_post(kind, src, msg_len, dst, next_wr_id(signal));
+    }
+
+    int RDMAContext::poll_completions(int n, bool send) {
+        if (loopback) {
+            if (!send) {
+                uint32_t take = std::min<uint32_t>(lb_recv_head.load(std::memory_order_acquire) - lb_recv_polled, n);
+                lb_recv_polled += take;
+                return take;
+            }
+            uint32_t avail = lb_send_cqe.load(std::memory_order_acquire);
+            uint32_t take;
+            do {
+                take = std::min<uint32_t>(avail, n);
+            } while (take > 0 && !lb_send_cqe.compare_exchange_weak(avail, avail - take, std::memory_order_acq_rel));
+            sq_credits += lb_send_credit.exchange(0, std::memory_order_acquire);
+            return take;
+        }
+
+        struct ibv_wc wc[MAX_POLL];
         auto cq = send ? out_cq : in_cq;
+        int ret = ibv_poll_cq(cq, std::min(n, MAX_POLL), wc);
+        for (int i = 0; i < ret; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            }
+            if (send) {
+                sq_credits += wc[i].wr_id;
+                wr_done += wc[i].wr_id;
+            }
+        }
+        // a completion covers the work requests posted before it, their pinned slices are read
+        while (pin_head != pin_tail && pin_wr[pin_head % (MAX_QP_DEPTH * MAX_SGE)] <= wr_done) {
+            unpin(pin_mr[pin_head % (MAX_QP_DEPTH * MAX_SGE)]);
+            pin_head += 1;
+        }
+        return ret;
+    }
+
+    int RDMAContext::post_recvs(int n) {
+        if (loopback) {
+            for (int i = 0; i < n; i++) {
+                if (auto ret = post_recv(0, 0); ret != 0) {
+                    return ret;
+                }
+            }
+            return 0;
+        }
+
+        // zero-length receives, chained for a single post
+        struct ibv_recv_wr wr[MAX_POLL];
+        while (n > 0) {
+            int len = std::min(n, MAX_POLL);
+            memset(wr, 0, sizeof(ibv_recv_wr) * len);
+            for (int i = 0; i < len; i++) {
+                wr[i].next = i + 1 < len ? &wr[i + 1] : NULL;
+            }
+            struct ibv_recv_wr *bad_wr;
+            if (auto ret = ibv_post_recv(qp, &wr[0], &bad_wr); ret != 0) {
+                return ret;
+            }
+            n -= len;
+        }
+        return 0;
+    }
+
+    int RDMAContext::poll_imm(uint32_t *imm, int n) {
+        int ret;
+        if (loopback) {
+            uint32_t first = lb_recv_polled;
+            ret = poll_completions(n, false);
+            for (int i = 0; i < ret; i++) {
+                imm[i] = lb_recv_imm[(first + i) % MAX_QP_DEPTH];
+            }
+        } else {
+            struct ibv_wc wc[MAX_POLL];
+            ret = ibv_poll_cq(in_cq, std::min(n, MAX_POLL), wc);
+            for (int i = 0; i < ret; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "Work completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                }
+                imm[i] = ntohl(wc[i].imm_data);
+            }
+        }
 
-        return ibv_poll_cq(cq, 1, &wc);
+        if (ret > 0) {
+            if (auto err = post_recvs(ret); err != 0) {
+                return -1;
+            }
+        }
+        return ret;
+    }
+
+    int RDMAContext::poll_completion_once(bool send) {
+        return poll_completions(1, send);
     }
 
     int RDMAContext::poll_one_completion(bool send) {
-        struct ibv_wc wc;
-        auto cq = send ? out_cq : in_cq;
+        Poller poller;
+        poller.SetPolicy(poll_policy);
         int ret;
-        do {
-            ret = ibv_poll_cq(cq, 1, &wc);
-        } while(ret == 0);
+        while ((ret = poll_completions(1, send)) == 0) {
+            poller.Idle(this, send);
+        }
 
         return ret;
     }
 
+    int RDMAContext::arm_cq(bool send) {
+        if (loopback) {
+            return 0;
+        }
+        return ibv_req_notify_cq(send ? out_cq : in_cq, 0);
+    }
+
+    int RDMAContext::wait_cq(int timeout_ms, bool send) {
+        if (loopback) {
+            auto pending = [this, send]() {
+                if (send) return lb_send_cqe.load(std::memory_order_acquire) > 0;
+                return lb_recv_head.load(std::memory_order_acquire) != lb_recv_polled;
+            };
+            for (int waited = 0; waited < timeout_ms * 10; waited++) {
+                if (pending()) return 1;
+                usleep(100);
+            }
+            return 0;
+        }
+
+        struct pollfd pfd = {channel->fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret <= 0) {
+            return ret;
+        }
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(channel, &ev_cq, &ev_ctx) != 0) {
+            return -1;
+        }
+        ibv_ack_cq_events(ev_cq, 1);
+        return 1;
+    }
+
+    auto RDMADevice::open_ud(int slots) -> std::unique_ptr<UDEndpoint> {
+        auto ep = std::make_unique<UDEndpoint>(ctx, pd, ib_port, gid_idx, profile.mtu, slots);
+        if (!ep->Init()) {
+            return nullptr;
+        }
+        return ep;
+    }
+
+    void RDMAContext::release_send_buf() {
+        device->get_arena()->Put(send_buf);
+        send_buf = nullptr;
+    }
+
+    int RDMAContext::drain_completions() {
+        while (sq_credits + unsignaled < qp_depth) {
+            if (poll_completions(MAX_POLL) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
 
     auto RDMADevice::open() -> std::pair<std::unique_ptr<RDMAContext>, Status>
     {   
-        int mr_access = get_default_mr_access();
-        struct ibv_qp_init_attr attr = get_default_qp_init_attr();
+        struct ibv_qp_init_attr attr = get_default_qp_init_attr(profile);
 
         auto rdma_ctx = RDMAContext::make_rdma_context();
         rdma_ctx->ctx = ctx;
+        rdma_ctx->qp_depth = profile.qp_depth;
+        rdma_ctx->inline_size = profile.inline_size;
+        rdma_ctx->sq_credits = profile.qp_depth;
+        rdma_ctx->poll_policy = poll_policy;
+
+        rdma_ctx->device = this;
+
+        SendArena::Buffer send_buf;
+        if (!arena->Get(&send_buf)) { // zeroed before the peer can write it
+            return {nullptr, Status::CannotRegMR};
+        }
+        rdma_ctx->send_buf = send_buf.addr;
+        rdma_ctx->send_mr = send_buf.mr;
+
+        if (wire) {
+            rdma_ctx->loopback = true;
+            rdma_ctx->local.addr0 = (uint64_t)rdma_ctx->send_buf;
+            rdma_ctx->local.length0 = SEND_BUF_SIZE;
+            rdma_ctx->local.qp_num = LoopbackWire::Register(rdma_ctx.get());
+            rdma_ctx->write_buf = nullptr;
+            return {std::move(rdma_ctx), Status::Ok};
+        }
+
+        rdma_ctx->pd = pd;
 
-        if (!(rdma_ctx->pd = ibv_alloc_pd(ctx))) {
-            return {nullptr, Status::CannotAllocPD};
+        if (!(rdma_ctx->channel = ibv_create_comp_channel(ctx))) {
+            return {nullptr, Status::CannotCreateChannel};
         }
 
-        if (!(rdma_ctx->in_cq = ibv_create_cq(ctx, MAX_CQE, nullptr, nullptr, 0))) {
+        if (!(rdma_ctx->in_cq = ibv_create_cq(ctx, profile.cqe, nullptr, rdma_ctx->channel, 0))) {
             return {nullptr, Status::CannotCreateCQ};
         }
 
-        if (!(rdma_ctx->out_cq = ibv_create_cq(ctx, MAX_CQE, nullptr, nullptr, 0))) {
+        if (!(rdma_ctx->out_cq = ibv_create_cq(ctx, profile.cqe, nullptr, rdma_ctx->channel, 0))) {
             return {nullptr, Status::CannotCreateCQ};
         }
 
-        rdma_ctx->send_buf = new uint8_t[SEND_BUF_SIZE];
-        rdma_ctx->send_mr = ibv_reg_mr(rdma_ctx->pd, rdma_ctx->send_buf, SEND_BUF_SIZE, mr_access);
-        if (!rdma_ctx->send_mr) {
-            return {nullptr, Status::CannotRegMR};
-        }
         rdma_ctx->local.addr0 = (uint64_t)rdma_ctx->send_buf;
         rdma_ctx->local.rkey0 = rdma_ctx->send_mr->rkey;
         rdma_ctx->local.length0 = SEND_BUF_SIZE;
 
         attr.send_cq = rdma_ctx->out_cq;
         attr.recv_cq = rdma_ctx->in_cq;
-        if (!(rdma_ctx->qp = ibv_create_qp(rdma_ctx->pd, &attr))) {
-            return {nullptr, Status::CannotCreateQP};
+        // the device caps inline data without telling, ask for less until it agrees
+        while (!(rdma_ctx->qp = ibv_create_qp(rdma_ctx->pd, &attr))) {
+            if (attr.cap.max_inline_data == 0) {
+                return {nullptr, Status::CannotCreateQP};
+            }
+            attr.cap.max_inline_data /= 2;
         }
+        rdma_ctx->inline_size = attr.cap.max_inline_data;
 
         union ibv_gid my_gid;
         if (gid_idx >= 0) {
@@ -358,13 +795,126 @@ namespace RDMAUtil {
             return {nullptr, Status::CannotQueryPort};
         }
         rdma_ctx->local.lid = pattr.lid;
+        rdma_ctx->local.mtu = mtu_to_enum(profile.mtu);
 
         rdma_ctx->write_buf = nullptr;
-        rdma_ctx->device = this;
         return {std::move(rdma_ctx), Status::Ok};
     }
 
-    auto RDMADevice::get_default_qp_init_attr() -> struct ibv_qp_init_attr
+    void RDMADevice::set_profile(const TransportProfile & wanted) {
+        profile = wanted;
+        int active_mtu = port_attr.active_mtu ? mtu_to_bytes(port_attr.active_mtu) : 4096;
+        if (profile.mtu <= 0 || profile.mtu > active_mtu) profile.mtu = active_mtu;
+        profile.mtu = mtu_to_bytes(mtu_to_enum(profile.mtu));
+        if (profile.inline_size <= 0) profile.inline_size = MAX_INLINE_SIZE;
+        if (profile.qp_depth == 0) profile.qp_depth = MAX_QP_DEPTH;
+        profile.qp_depth = std::max(MIN_QP_DEPTH, std::min(profile.qp_depth, MAX_QP_DEPTH));
+        if (device_attr.max_qp_wr > 0) profile.qp_depth = std::min<uint32_t>(profile.qp_depth, device_attr.max_qp_wr);
+        if (profile.cqe <= 0) profile.cqe = MAX_CQE;
+        if (device_attr.max_cqe > 0) profile.cqe = std::min(profile.cqe, device_attr.max_cqe);
+        // every signaled send and every receive of a full queue pair must fit
+        profile.cqe = std::max<int>(profile.cqe, profile.qp_depth);
+        int max_rd_atomic = std::min(device_attr.max_qp_rd_atom, device_attr.max_qp_init_rd_atom);
+        if (profile.rd_atomic <= 0) profile.rd_atomic = std::max(max_rd_atomic, 1);
+        if (max_rd_atomic > 0) profile.rd_atomic = std::min(profile.rd_atomic, max_rd_atomic);
+        // the fields of the queue pair attributes are 5 and 3 bits wide
+        profile.timeout = profile.timeout < 0 ? 14 : std::min(profile.timeout, 31);
+        profile.retry_cnt = profile.retry_cnt < 0 ? 7 : std::min(profile.retry_cnt, 7);
+        profile.rnr_retry = profile.rnr_retry < 0 ? 7 : std::min(profile.rnr_retry, 7);
+        profile.min_rnr_timer = profile.min_rnr_timer < 0 ? 0x12 : std::min(profile.min_rnr_timer, 31);
+    }
+
+    auto TransportProfile::Parse(const std::string & str) -> TransportProfile {
+        TransportProfile profile = {};
+        size_t start = 0;
+        while (start < str.size()) {
+            size_t end = str.find(',', start);
+            if (end == std::string::npos) end = str.size();
+            std::string item = str.substr(start, end - start);
+            start = end + 1;
+
+            size_t eq = item.find('=');
+            if (eq == std::string::npos) {
+                fprintf(stderr, "ignoring profile item %s\n", item.c_str());
+                continue;
+            }
+            std::string key = item.substr(0, eq);
+            int value = atoi(item.c_str() + eq + 1);
+            if (key == "mtu") profile.mtu = value;
+            else if (key == "inline") profile.inline_size = value;
+            else if (key == "depth") profile.qp_depth = value;
+            else if (key == "cqe") profile.cqe = value;
+            else if (key == "rd_atomic") profile.rd_atomic = value;
+            else if (key == "timeout") profile.timeout = value;
+            else if (key == "retry") profile.retry_cnt = value;
+            else if (key == "rnr_retry") profile.rnr_retry = value;
+            else if (key == "rnr_timer") profile.min_rnr_timer = value;
+            else fprintf(stderr, "ignoring profile item %s\n", item.c_str());
+        }
+        return profile;
+    }
+
+    auto TransportProfile::ToString() const -> std::string {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "mtu=%d,inline=%d,depth=%u,cqe=%d,rd_atomic=%d,timeout=%d,retry=%d,rnr_retry=%d,rnr_timer=%d",
+                 mtu, inline_size, qp_depth, cqe, rd_atomic, timeout, retry_cnt, rnr_retry, min_rnr_timer);
+        return buf;
+    }
+
+    auto RDMADevice::register_region(void *mem, int memsize) -> const MemoryRegion *
+    {
+        auto region = std::make_unique<MemoryRegion>();
+        region->buf = (uint8_t *)mem;
+        region->addr = (uint64_t)mem;
+        region->rkey = 0;
+        region->length = memsize;
+        region->dmabuf = false;
+        region->dmaoff = 0;
+        region->mr = nullptr;
+
+        if (!wire) {
+            region->mr = ibv_reg_mr(pd, mem, memsize, get_default_mr_access());
+            if (!region->mr) {
+                fprintf(stderr, "fail to register memory region\n");
+                return nullptr;
+            }
+            region->addr = (uint64_t)region->mr->addr;
+            region->rkey = region->mr->rkey;
+            region->length = region->mr->length;
+        }
+
+        regions.push_back(std::move(region));
+        return regions.back().get();
+    }
+
+    auto RDMADevice::register_region(int fd, uint64_t offset, int memsize) -> const MemoryRegion *
+    {
+        auto region = std::make_unique<MemoryRegion>();
+        region->buf = (uint8_t *)mmap(0, memsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        region->addr = (uint64_t)region->buf + offset;
+        region->rkey = 0;
+        region->length = memsize;
+        region->dmabuf = true;
+        region->dmaoff = offset;
+        region->mr = nullptr;
+
+        if (!wire) {
+            region->mr = ibv_reg_dmabuf_mr(pd, 0, memsize, 0, fd, get_default_mr_access());
+            if (!region->mr) {
+                perror("ibv_reg_dmabuf_mr");
+                munmap(region->buf, memsize);
+                return nullptr;
+            }
+            region->addr = (uint64_t)region->mr->addr + offset;
+            region->rkey = region->mr->rkey;
+            region->length = region->mr->length;
+        }
+
+        regions.push_back(std::move(region));
+        return regions.back().get();
+    }
+
+    auto RDMADevice::get_default_qp_init_attr(const TransportProfile &profile) -> struct ibv_qp_init_attr
     {
         struct ibv_qp_init_attr attr;
         memset(&attr, 0, sizeof(struct ibv_qp_init_attr));
@@ -372,11 +922,11 @@ namespace RDMAUtil {
         attr.qp_type = IBV_QPT_RC;
         // ibv_send_helper will set signals accordingly
         attr.sq_sig_all = 0;
-        attr.cap.max_send_wr = MAX_QP_DEPTH;
-        attr.cap.max_recv_wr = MAX_QP_DEPTH;
-        attr.cap.max_send_sge = 1;
+        attr.cap.max_send_wr = profile.qp_depth;
+        attr.cap.max_recv_wr = profile.qp_depth;
+        attr.cap.max_send_sge = MAX_SGE;
         attr.cap.max_recv_sge = 1;
-        attr.cap.max_inline_data = MAX_INLINE_SIZE;
+        attr.cap.max_inline_data = profile.inline_size;
         return attr;
     }
 
@@ -395,7 +945,9 @@ namespace RDMAUtil {
         return attr;
     }
 
-    auto RDMADevice::get_default_qp_rtr_attr(const connection_certificate &remote,
+    auto RDMADevice::get_default_qp_rtr_attr(const connection_certificate &local,
+                                             const connection_certificate &remote,
+                                             const TransportProfile &profile,
                                              const int ib_port = 1,
                                              const int sgid_idx = -1)
         -> std::unique_ptr<struct ibv_qp_attr>
@@ -404,11 +956,13 @@ namespace RDMAUtil {
         memset(attr.get(), 0, sizeof(struct ibv_qp_attr));
 
         attr->qp_state = IBV_QPS_RTR;
-        attr->path_mtu = IBV_MTU_256;
+        // a peer without an MTU in its certificate is of the 256 bytes days
+        int remote_mtu = remote.mtu > 0 ? (int)remote.mtu : (int)IBV_MTU_256;
+        attr->path_mtu = (enum ibv_mtu)std::min<int>(local.mtu, remote_mtu);
         attr->dest_qp_num = remote.qp_num;
         attr->rq_psn = 0;
-        attr->max_dest_rd_atomic = 1;
-        attr->min_rnr_timer = 0x12;
+        attr->max_dest_rd_atomic = profile.rd_atomic;
+        attr->min_rnr_timer = profile.min_rnr_timer;
 
         attr->ah_attr.is_global = 0;
         attr->ah_attr.dlid = remote.lid;
@@ -428,18 +982,18 @@ namespace RDMAUtil {
         return attr;
     }
 
-    auto RDMADevice::get_default_qp_rts_attr()
+    auto RDMADevice::get_default_qp_rts_attr(const TransportProfile &profile)
         -> std::unique_ptr<struct ibv_qp_attr>
     {
         auto attr = std::make_unique<struct ibv_qp_attr>();
         memset(attr.get(), 0, sizeof(struct ibv_qp_attr));
 
         attr->qp_state = IBV_QPS_RTS;
-        attr->timeout = 14;
-        attr->retry_cnt = 7;
-        attr->rnr_retry = 7;
+        attr->timeout = profile.timeout;
+        attr->retry_cnt = profile.retry_cnt;
+        attr->rnr_retry = profile.rnr_retry;
         attr->sq_psn = 0;
-        attr->max_rd_atomic = 1;
+        attr->max_rd_atomic = profile.rd_atomic;
         return attr;
     }
 }
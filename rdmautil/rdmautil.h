@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <vector>
 #include <functional>
 #include <iostream>
 #include <cstring>
@@ -19,6 +20,13 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <atomic>
+
+#include "loopback.h"
+#include "poller.h"
+#include "arena.h"
+#include "mrcache.h"
+#include "ud.h"
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 static inline uint64_t htonll(uint64_t x) { return bswap_64(x); }
@@ -31,10 +39,59 @@ static inline uint64_t ntohll(uint64_t x) { return x; }
 #endif
 
 namespace RDMAUtil {
-    static constexpr uint32_t MAX_QP_DEPTH = 8;
+    // defaults and upper bounds of a TransportProfile
+    static constexpr uint32_t MAX_QP_DEPTH = 128;
+    static constexpr uint32_t MIN_QP_DEPTH = 64;  // a ring's worth of receives, see frontend/ring.h
     static constexpr int MAX_INLINE_SIZE  = 128;
     static constexpr int SEND_BUF_SIZE = 1 * 1024 * 1024;
-    static constexpr int MAX_CQE       = 32;
+    static constexpr int MAX_CQE       = 256;
+    static constexpr int MAX_BATCH     = 16;
+    static constexpr int MAX_POLL      = 16;  // completions drained per ibv_poll_cq
+    static constexpr int ARENA_BUFS    = 16;  // send buffers per registered chunk of the send arena
+    static constexpr int MAX_SGE       = 4;   // slices gathered by one work request
+    static constexpr size_t MR_CACHE_CAPACITY = 256 * 1024 * 1024; // caller memory registered per device
+    // selective signaling: at most SIGNAL_INTERVAL work requests share one completion
+    static constexpr uint32_t SIGNAL_INTERVAL = 16;
+    static_assert(MAX_BATCH + SIGNAL_INTERVAL <= MIN_QP_DEPTH, "a full batch must fit behind unsignaled work requests");
+
+    /*
+     * Queue pair parameters of the contexts of a device. Zero fields are filled in by
+     * RDMADevice::set_profile(): mtu with the active MTU of the port, rd_atomic with what the device
+     * supports, and the rest with the defaults above. The timers and retry counts mean something at
+     * zero, so they are left to the device at -1 instead. An mtu between the valid sizes is rounded
+     * down. inline_size is an upper bound, the queue pair is created with the largest inline size
+     * the device accepts below it. Both ends of a connection use the smaller of their MTUs.
+     */
+    struct TransportProfile {
+        int mtu;            // path MTU in bytes: 256, 512, 1024, 2048 or 4096
+        int inline_size;    // bytes
+        uint32_t qp_depth;  // work requests per send or receive queue, MIN_QP_DEPTH to MAX_QP_DEPTH
+        int cqe;            // completion queue entries
+        int rd_atomic;      // outstanding RDMA reads and atomics per queue pair
+        int timeout = -1;   // local ack timeout, 4.096us * 2^timeout, 0 waits forever
+        int retry_cnt = -1;
+        int rnr_retry = -1; // 7 retries forever
+        int min_rnr_timer = -1;
+
+        // "key=value,..." with the keys mtu, inline, depth, cqe, rd_atomic, timeout, retry, rnr_retry
+        // and rnr_timer, an empty string leaves every field to the device
+        static TransportProfile Parse(const std::string & str);
+
+        std::string ToString() const;
+    };
+
+    // the largest valid MTU up to `mtu` bytes, at least IBV_MTU_256
+    inline auto mtu_to_enum(int mtu) -> enum ibv_mtu {
+        if (mtu >= 4096) return IBV_MTU_4096;
+        if (mtu >= 2048) return IBV_MTU_2048;
+        if (mtu >= 1024) return IBV_MTU_1024;
+        if (mtu >= 512)  return IBV_MTU_512;
+        return IBV_MTU_256;
+    }
+
+    inline auto mtu_to_bytes(int mtu) -> int {
+        return 128 << mtu; // enum ibv_mtu counts from IBV_MTU_256 = 1
+    }
 
     enum class Status {
             Ok,
@@ -45,6 +102,7 @@ namespace RDMAUtil {
             CannotOpenDevice,
             CannotAllocPD,
             CannotCreateCQ,
+            CannotCreateChannel,
             CannotRegMR,
             CannotCreateQP,
             CannotQueryPort,
@@ -78,6 +136,8 @@ namespace RDMAUtil {
             return "CannotAllocPD";
         case Status::CannotCreateCQ:
             return "CannotCreateCQ";
+        case Status::CannotCreateChannel:
+            return "CannotCreateChannel";
         case Status::CannotRegMR:
             return "CannotRegMR";
         case Status::CannotCreateQP:
@@ -114,19 +174,48 @@ namespace RDMAUtil {
         uint64_t addr;
         uint32_t rkey;
         uint32_t length;
+        uint64_t addr2;  // a region exported for remote reads, length2 is 0 without one
+        uint32_t rkey2;
+        uint32_t length2;
+        uint64_t addr3;  // a region the write buffer continues in from offset `length`, length3 is 0 without one
+        uint32_t rkey3;
+        uint32_t length3;
 
         uint32_t qp_num; // local queue pair number
         uint16_t lid;    // LID of the ib port
         uint8_t gid[16]; // mandatory for RoCE
+        uint8_t mtu;     // enum ibv_mtu of the profile
     } __attribute__((packed));
     
+    // a memory region registered once per device, shared by every context attached to it
+    struct MemoryRegion {
+        struct ibv_mr *mr; // nullptr on loopback devices
+        uint8_t *buf;      // local mapping of the region
+        uint64_t addr;     // address peers access, the registered address plus `dmaoff`
+        uint32_t rkey;
+        uint32_t length;
+        bool dmabuf;       // `buf` maps a dmabuf
+        uint64_t dmaoff;
+    };
+
+    // caller memory a work request gathers from
+    struct Slice {
+        const void *addr;
+        size_t length;
+    };
+
     class RDMADevice;
-    // Aggregation of pointers to ibv_context, ibv_pd, ibv_cq, ibv_mr and ibv_qp, which are used for further operations
+    /*
+      Aggregation of pointers to ibv_context, ibv_pd, ibv_cq, ibv_mr and ibv_qp, which are used for further operations.
+      The protection domain and the send buffer region belong to the device, so does the write buffer
+      region once attached with attach_write_buf().
+    */
     struct RDMAContext {
         struct ibv_context *ctx;
         struct ibv_pd *pd;
         struct ibv_cq *out_cq;
         struct ibv_cq *in_cq;
+        struct ibv_comp_channel *channel; // completion events of both queues
         struct ibv_qp *qp;
         RDMADevice *device;
 
@@ -139,6 +228,44 @@ namespace RDMAUtil {
         uint8_t * write_buf;
         bool dmabuf;
         uint64_t dmaoff;
+        bool shared_write; // the write buffer region belongs to the device
+
+        // shared-memory loopback transport, only valid when `loopback` is set
+        bool loopback;
+        RDMAContext *peer;
+        std::atomic<uint32_t> lb_send_cqe;
+        std::atomic<uint32_t> lb_send_credit;
+        std::atomic<uint32_t> lb_inflight;
+        std::atomic<uint32_t> lb_recv_head; // posted receives, consumed by the peer's sends
+        std::atomic<uint32_t> lb_recv_tail;
+        uint32_t lb_recv_polled;            // consumed receives whose completion was polled
+        uint64_t lb_recv_off[MAX_QP_DEPTH];
+        uint32_t lb_recv_len[MAX_QP_DEPTH];
+        uint32_t lb_recv_imm[MAX_QP_DEPTH];
+
+        // from the device profile, inline_size is what the queue pair was created with
+        uint32_t qp_depth;
+        int inline_size;
+
+        // send queue slots we may still post to, and work requests posted since the last signaled one
+        uint32_t sq_credits;
+        uint32_t unsignaled;
+
+        // work requests posted and completed so far, and the regions batch_writev() pinned for the
+        // work request of each sequence number until it completed, oldest first
+        uint64_t wr_posted;
+        uint64_t wr_done;
+        struct ibv_mr *pin_mr[MAX_QP_DEPTH * MAX_SGE];
+        uint64_t pin_wr[MAX_QP_DEPTH * MAX_SGE];
+        uint32_t pin_head, pin_tail;
+
+        // how waits for a completion behave once nothing completes for a while
+        PollPolicy poll_policy;
+
+        // work requests staged by batch_write* and chained for a single post_batch() doorbell
+        struct ibv_send_wr batch_wr[MAX_BATCH];
+        struct ibv_sge batch_sge[MAX_BATCH][MAX_SGE];
+        int batch_len;
 
         RDMAContext() = default;
         RDMAContext(const RDMAContext &) = delete;
@@ -153,14 +280,23 @@ namespace RDMAUtil {
         }
 
         ~RDMAContext() {
+            if (loopback) {
+                // the wire may still copy out of our buffers
+                while (lb_inflight.load(std::memory_order_acquire) > 0) asm("pause");
+                LoopbackWire::Unregister(local.qp_num);
+            }
             if (qp) ibv_destroy_qp(qp);
+            for (; pin_head != pin_tail; pin_head++) {
+                unpin(pin_mr[pin_head % (MAX_QP_DEPTH * MAX_SGE)]);
+            }
             if (out_cq) ibv_destroy_cq(out_cq);
             if (in_cq) ibv_destroy_cq(in_cq);
-            if (pd) ibv_dealloc_pd(pd);
-            if (send_mr) ibv_dereg_mr(send_mr);
-            if (write_mr) ibv_dereg_mr(write_mr);
-            if (dmabuf) munmap(write_buf, local.length);
-            if (send_buf) delete [] send_buf;
+            if (channel) ibv_destroy_comp_channel(channel);
+            if (!shared_write) {
+                if (write_mr) ibv_dereg_mr(write_mr);
+                if (dmabuf) munmap(write_buf, local.length);
+            }
+            if (send_buf) release_send_buf();
         }
 
         inline uint8_t * get_send_buf(){
@@ -177,7 +313,53 @@ namespace RDMAUtil {
 
         auto exchange_certificate(int sockfd) -> Status;
 
+        // use a region registered with RDMADevice::register_region() as write buffer
+        void attach_write_buf(const MemoryRegion * region) {
+            local.addr = region->addr;
+            local.rkey = region->rkey;
+            local.length = region->length;
+            write_mr = region->mr;
+            write_buf = region->buf;
+            dmabuf = region->dmabuf;
+            dmaoff = region->dmaoff;
+            shared_write = true;
+        }
+
+        // export a region registered with RDMADevice::register_region() for the peer to read
+        void attach_export(const MemoryRegion * region) {
+            local.addr2 = region->addr;
+            local.rkey2 = region->rkey;
+            local.length2 = region->length;
+        }
+
+        // continue the write buffer the peer writes to in a region registered with RDMADevice::register_region()
+        void attach_spill(const MemoryRegion * region) {
+            local.addr3 = region->addr;
+            local.rkey3 = region->rkey;
+            local.length3 = region->length;
+        }
+
+        // where `remote_offset` of the write buffer of the peer is
+        inline uint64_t remote_write_addr(size_t remote_offset, uint32_t *rkey) const {
+            if (remote_offset >= remote.length && remote.length3 > 0) {
+                *rkey = remote.rkey3;
+                return remote.addr3 + remote_offset - remote.length;
+            }
+            *rkey = remote.rkey;
+            return remote.addr + remote_offset;
+        }
+
         int register_write_buf(void * mem, int memsize) {
+            if (loopback) {
+                local.addr = (uint64_t)mem;
+                local.rkey = 0;
+                local.length = memsize;
+                write_buf = (uint8_t *) mem;
+                dmabuf = false;
+                dmaoff = 0;
+                return 0;
+            }
+
             int mr_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
             write_mr = ibv_reg_mr(pd, mem, memsize, mr_access);
             if(!write_mr) {
@@ -196,6 +378,16 @@ namespace RDMAUtil {
         }
 
         int register_write_buf(int fd, uint64_t offset, int memsize) {
+            if (loopback) {
+                write_buf = (uint8_t *)mmap(0, memsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                local.addr = (uint64_t)write_buf + offset;
+                local.rkey = 0;
+                local.length = memsize;
+                dmabuf = true;
+                dmaoff = offset;
+                return 0;
+            }
+
             int mr_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
             write_mr = ibv_reg_dmabuf_mr(pd, 0, memsize, 0, fd, mr_access);
             if(!write_mr) {
@@ -219,17 +411,119 @@ namespace RDMAUtil {
 
         int post_read(size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true) ;
 
+        // read the remote write buffer into the local send buffer
+        int post_read1(size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true) ;
+
+        // read the region exported by the peer into the local send buffer
+        int post_read2(size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true) ;
+
+        /*
+          Reads of caller memory: expose() gives the address and rkey the peer reads [addr, addr + len)
+          with, false if it cannot be registered. Memory outside the send buffer is registered for
+          remote reads through the MRCache of the device, *pin is then the region to unpin() once the
+          peer read it, and nullptr otherwise. The memory must stay unchanged until then.
+          post_read_at() reads a range exposed by the peer into the local write buffer,
+          post_read_at1() into the local send buffer.
+        */
+        bool expose(const void *addr, size_t len, uint64_t *remote_addr, uint32_t *rkey, struct ibv_mr **pin);
+
+        void unpin(struct ibv_mr *mr);
+
+        int post_read_at(size_t msg_len, size_t local_offset, uint64_t remote_addr, uint32_t rkey, bool signal = true);
+
+        int post_read_at1(size_t msg_len, size_t local_offset, uint64_t remote_addr, uint32_t rkey, bool signal = true);
+
         int post_write(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true) ;
 
         int post_write0(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true);
 
         int post_write1(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true);
 
+        int post_write2(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true);
+
+        /*
+          Doorbell batching: batch_write, batch_write0, batch_write1 and batch_write2 stage the same work request as
+          their post_write counterparts, post_batch() links the staged work requests and rings the
+          doorbell once. Staged writes are placed in order at the remote side.
+        */
+        int batch_write(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = false);
+
+        int batch_write0(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = false);
+
+        int batch_write1(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = false);
+
+        int batch_write2(const uint8_t *msg, size_t msg_len, size_t local_offset = 0, size_t remote_offset = 0, bool signal = false);
+
+        int post_batch();
+
+        /*
+          Gather up to MAX_SGE slices into one write to the remote write buffer, like batch_write1 does
+          for a single slice of the send buffer. Slices outside the send and write buffers are posted
+          from where they are, registered through the MRCache of the device and pinned there until a
+          completion covers the write, and must stay unchanged until the write completed. Nothing is
+          staged if a slice cannot be registered.
+        */
+        int batch_writev(const Slice *slices, int n, size_t remote_offset = 0, bool signal = false);
+
+        /*
+          Write with immediate: batch_write2_imm stages the same write as batch_write2, which also consumes
+          a receive posted by the peer and completes it with `imm`. post_recvs() posts zero-length receives
+          for such writes, poll_imm() returns up to n immediates of completed receives in arrival order and
+          posts as many receives again.
+        */
+        int batch_write2_imm(const uint8_t *msg, size_t msg_len, uint32_t imm, size_t local_offset = 0, size_t remote_offset = 0, bool signal = false);
+
+        int post_recvs(int n);
+
+        int poll_imm(uint32_t *imm, int n);
+
         int post_cas(uint64_t old_val, uint64_t new_val, size_t local_offset = 0, size_t remote_offset = 0, bool signal = true) ;
 
+        /*
+          Selective signaling: `signal` forces a completion, otherwise only every SIGNAL_INTERVAL-th
+          work request is signaled. Its wr_id carries the number of send queue slots it covers, which
+          are given back as credits when the completion is polled. Posting waits for credits.
+        */
+        int poll_completions(int n, bool send = true);
+
         int poll_completion_once(bool send = true);
 
+        // wait for one completion, idling as poll_policy says
         int poll_one_completion(bool send = true);
+
+        /*
+          Completion events: arm_cq() requests an event for the next completion of a queue,
+          wait_cq() waits at most `timeout_ms` for it. wait_cq() returns 1 on an event, 0 on timeout
+          and -1 on error. Loopback contexts have no events, arm_cq() is a no-op and wait_cq()
+          sleeps in short steps until a completion is pending.
+        */
+        int arm_cq(bool send = false);
+
+        int wait_cq(int timeout_ms, bool send = false);
+
+        // wait until every signaled work request has completed
+        int drain_completions();
+
+    private:
+        void release_send_buf();
+
+        uint64_t next_wr_id(bool signal);
+
+        int acquire_credits(uint32_t n);
+
+        int post_one(struct ibv_send_wr &sr, bool signal);
+
+        int batch_rdma_write(uint8_t *address, struct ibv_mr *mr, size_t msg_len, uint64_t remote_addr, uint32_t rkey, bool signal,
+                             enum ibv_wr_opcode opcode = IBV_WR_RDMA_WRITE, uint32_t imm = 0);
+
+        int batch_rdma_writev(const struct ibv_sge *sge, int num_sge, uint64_t remote_addr, uint32_t rkey, bool signal,
+                              enum ibv_wr_opcode opcode = IBV_WR_RDMA_WRITE, uint32_t imm = 0);
+
+        int lb_post(LoopbackWire::Kind kind, const uint8_t *src, size_t msg_len, uint8_t *dst, uint64_t wr_id, uint32_t imm = 0);
+
+        int post_rdma_read(uint8_t *address, struct ibv_mr *mr, size_t msg_len, uint64_t remote_addr, uint32_t rkey, bool signal);
+
+        int lb_post_one(LoopbackWire::Kind kind, const uint8_t *src, size_t msg_len, uint8_t *dst, bool signal);
     };
 
     /*
@@ -242,8 +536,17 @@ namespace RDMAUtil {
         struct ibv_device **devices;
         struct ibv_device *device;
         struct ibv_context *ctx;
+        struct ibv_pd *pd; // shared by every context of the device
         int ib_port;
         int gid_idx;
+        std::unique_ptr<LoopbackWire> wire;
+        PollPolicy poll_policy;
+        TransportProfile profile;
+        struct ibv_port_attr port_attr;     // zeroed on loopback devices
+        struct ibv_device_attr device_attr;
+        std::unique_ptr<SendArena> arena;
+        std::unique_ptr<MRCache> mr_cache; // nullptr on loopback devices
+        std::vector<std::unique_ptr<MemoryRegion>> regions;
 
     public:
         static auto make_rdma(const std::string &dev_name, int ib_port, int gid_idx)
@@ -266,6 +569,17 @@ namespace RDMAUtil {
                     if (auto ctx = ibv_open_device(ret->devices[i]); ctx) {
                         ret->device = ret->devices[i];
                         ret->ctx = ctx;
+                        if (!(ret->pd = ibv_alloc_pd(ctx))) {
+                            fprintf(stderr, "fail to allocate protection domain\n");
+                            return nullptr;
+                        }
+                        if (ibv_query_port(ctx, ib_port, &ret->port_attr) || ibv_query_device(ctx, &ret->device_attr)) {
+                            fprintf(stderr, "fail to query device\n");
+                            return nullptr;
+                        }
+                        ret->set_profile(TransportProfile{});
+                        ret->arena = std::make_unique<SendArena>(ret->pd, SEND_BUF_SIZE, ARENA_BUFS);
+                        ret->mr_cache = std::make_unique<MRCache>(ret->pd, MR_CACHE_CAPACITY, ret->on_demand());
                         return std::move(ret);
                     }
                 }
@@ -275,16 +589,45 @@ namespace RDMAUtil {
             return nullptr;
         }
 
+        /*
+          Make a NIC-less device whose contexts talk to each other through process memory, with
+          `latency_ns` injected per work request and the wire limited to `bandwidth_mbps` MB/s.
+          Zero disables either limit.
+        */
+        static auto make_loopback(uint64_t latency_ns, uint64_t bandwidth_mbps)
+            -> std::unique_ptr<RDMADevice>
+        {
+            auto ret = std::make_unique<RDMADevice>();
+            ret->dev_name = "loopback";
+            ret->ib_port = 1;
+            ret->gid_idx = -1;
+            ret->wire = std::make_unique<LoopbackWire>(latency_ns, bandwidth_mbps);
+            memset(&ret->port_attr, 0, sizeof(ret->port_attr));
+            memset(&ret->device_attr, 0, sizeof(ret->device_attr));
+            ret->set_profile(TransportProfile{});
+            ret->arena = std::make_unique<SendArena>(nullptr, SEND_BUF_SIZE, ARENA_BUFS);
+            return ret;
+        }
+
         // never explicitly instantiated
         RDMADevice() :
             dev_name(""),
             devices(nullptr),
             device(nullptr),
             ctx(nullptr),
+            pd(nullptr),
             ib_port(-1),
-            gid_idx(-1) {};
+            gid_idx(-1),
+            poll_policy{0, 0, 0, 0} {};
         
         ~RDMADevice() {
+            for (auto & region : regions) {
+                if (region->mr) ibv_dereg_mr(region->mr);
+                if (region->dmabuf) munmap(region->buf, region->length);
+            }
+            arena.reset();
+            mr_cache.reset();
+            if (pd) ibv_dealloc_pd(pd);
             if (devices) ibv_free_device_list(devices);
             if (ctx) ibv_close_device(ctx);
         }
@@ -301,6 +644,49 @@ namespace RDMAUtil {
             return gid_idx;
         }
 
+        inline auto get_wire() const noexcept -> LoopbackWire * {
+            return wire.get();
+        }
+
+        inline auto get_arena() const noexcept -> SendArena * {
+            return arena.get();
+        }
+
+        inline auto get_mr_cache() const noexcept -> MRCache * {
+            return mr_cache.get();
+        }
+
+        // whether regions of caller memory can follow its mappings, so remapped memory needs no invalidation
+        bool on_demand() const {
+            struct ibv_device_attr_ex attr;
+            uint32_t rc = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ;
+            return ibv_query_device_ex(ctx, nullptr, &attr) == 0 && (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+                   (attr.odp_caps.per_transport_caps.rc_odp_caps & rc) == rc;
+        }
+
+        /*
+          Register a memory region once for all contexts of the device, which attach it with
+          RDMAContext::attach_write_buf(). The region lives as long as the device.
+        */
+        auto register_region(void *mem, int memsize) -> const MemoryRegion *;
+
+        auto register_region(int fd, uint64_t offset, int memsize) -> const MemoryRegion *;
+
+        /*
+          Set the profile of the contexts opened afterwards. Zero fields are detected, the rest is
+          capped by what the port and device support.
+        */
+        void set_profile(const TransportProfile & wanted);
+
+        inline auto get_profile() const noexcept -> const TransportProfile & {
+            return profile;
+        }
+
+        // the poll policy of the contexts opened afterwards
+        inline void set_poll_policy(PollPolicy policy) noexcept {
+            poll_policy = policy;
+        }
+
         /*
           Open an initialized RDMA device made from `make_rdma`
           @membuf: memory region to be registered
@@ -312,11 +698,17 @@ namespace RDMAUtil {
         auto open()
             -> std::pair<std::unique_ptr<RDMAContext>, Status>;
 
+        /*
+          Open an unreliable datagram endpoint with `slots` send and receive buffers of the profile's
+          MTU, nullptr on failure. It lives no longer than the device.
+        */
+        auto open_ud(int slots) -> std::unique_ptr<UDEndpoint>;
+
         static auto get_default_mr_access() -> int {
             return IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
         }
 
-        static auto get_default_qp_init_attr() -> struct ibv_qp_init_attr;
+        static auto get_default_qp_init_attr(const TransportProfile &profile) -> struct ibv_qp_init_attr;
 
         static auto get_default_qp_init_state_attr(const int ib_port = 1)
             -> std::unique_ptr<struct ibv_qp_attr>;
@@ -324,7 +716,9 @@ namespace RDMAUtil {
             return IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
         }
 
-        static auto get_default_qp_rtr_attr(const connection_certificate &remote,
+        static auto get_default_qp_rtr_attr(const connection_certificate &local,
+                                            const connection_certificate &remote,
+                                            const TransportProfile &profile,
                                             const int ib_port,
                                             const int sgid_idx)
             -> std::unique_ptr<struct ibv_qp_attr>;
@@ -333,7 +727,7 @@ namespace RDMAUtil {
                 IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
         }
 
-        static auto get_default_qp_rts_attr() -> std::unique_ptr<struct ibv_qp_attr>;
+        static auto get_default_qp_rts_attr(const TransportProfile &profile) -> std::unique_ptr<struct ibv_qp_attr>;
         
         static auto get_default_qp_rts_attr_mask() -> int {
             return IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
@@ -3,6 +3,7 @@
 */
 
 #include "socketutil.h"
+#include <errno.h>
 
 namespace SocketUtil {
 
@@ -22,12 +23,8 @@ Socket::~Socket() {
 int Socket::NewChannel(int port) {
     assert(socktype == SERVER);
 
-    // accept a new connect
+    // accept a new connect, the socket is listening since make_socket
     int new_commu_sock;
-    if (listen(listen_sock, 3) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
 
     // accept a connection and create a new socket for communication
     struct sockaddr_in address;
@@ -73,7 +70,7 @@ std::unique_ptr<Socket> Socket::make_socket(SockType s, int port, std::string ip
             exit(EXIT_FAILURE);
         }
         
-        if (listen(new_socket->listen_sock, 3) < 0) {
+        if (listen(new_socket->listen_sock, BACKLOG) < 0) {
             perror("listen");
             exit(EXIT_FAILURE);
         }
@@ -100,10 +97,14 @@ std::unique_ptr<Socket> Socket::make_socket(SockType s, int port, std::string ip
             exit(EXIT_FAILURE);
         }
 
-        // connect to a server
-        if (connect(new_socket->commu_sock[0], (struct sockaddr*)&address, sizeof(address)) < 0) {
-            perror("connect");
-            exit(EXIT_FAILURE);
+        // connect to a server, which may be still starting up
+        int retry = 0;
+        while (connect(new_socket->commu_sock[0], (struct sockaddr*)&address, sizeof(address)) < 0) {
+            if (errno != ECONNREFUSED || ++retry > CONNECT_RETRY) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            usleep(10000);
         }
     }
     
@@ -25,6 +25,8 @@ enum SockType {CLIENT = 0, SERVER};
 class Socket {
 public:
     static const int MTU = 256;
+    static const int CONNECT_RETRY = 200; // 10 ms apart
+    static const int BACKLOG = 128;       // clients connecting together wait in the accept queue
     
     Socket(SockType t) : socktype(t) {
         listen_sock = -1;
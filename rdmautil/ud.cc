@@ -0,0 +1,324 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#include "ud.h"
+
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/mman.h>
+
+namespace RDMAUtil {
+    // loopback endpoints by queue pair number
+    static std::mutex lb_registry_mu;
+    static std::unordered_map<uint32_t, UDEndpoint *> lb_registry;
+    static uint32_t lb_next_qp_num = 1;
+
+    UDEndpoint::UDEndpoint(struct ibv_context * ctx, struct ibv_pd * pd, int ib_port, int gid_idx, uint32_t mtu, int slots) :
+        ctx_(ctx), pd_(pd), ib_port_(ib_port), gid_idx_(gid_idx), mtu_(mtu), slots_(slots),
+        slot_size_(GRH_SIZE + mtu), buf_(nullptr), mr_(nullptr), channel_(nullptr), send_cq_(nullptr),
+        recv_cq_(nullptr), qp_(nullptr), local_{}, max_inline_(0), sent_(0), completed_(0) {}
+
+    UDEndpoint::~UDEndpoint() {
+        if (!ctx_) {
+            std::lock_guard<std::mutex> l(lb_registry_mu);
+            lb_registry.erase(local_.qp_num);
+        }
+        for (auto & peer : peers_) {
+            if (peer.ah) ibv_destroy_ah(peer.ah);
+        }
+        if (qp_) ibv_destroy_qp(qp_);
+        if (send_cq_) ibv_destroy_cq(send_cq_);
+        if (recv_cq_) ibv_destroy_cq(recv_cq_);
+        if (channel_) ibv_destroy_comp_channel(channel_);
+        if (mr_) ibv_dereg_mr(mr_);
+        if (buf_) munmap(buf_, 2 * slots_ * slot_size_);
+    }
+
+    bool UDEndpoint::Init() {
+        size_t size = 2 * slots_ * slot_size_;
+        void * mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap ud buffer");
+            return false;
+        }
+        buf_ = (uint8_t *)mem;
+
+        if (!ctx_) {
+            std::lock_guard<std::mutex> l(lb_registry_mu);
+            local_.qp_num = lb_next_qp_num++;
+            local_.qkey = QKEY;
+            lb_registry[local_.qp_num] = this;
+            for (int i = 0; i < slots_; i++) {
+                lb_posted_.push_back(i);
+            }
+            return true;
+        }
+
+        if (!(mr_ = ibv_reg_mr(pd_, buf_, size, IBV_ACCESS_LOCAL_WRITE))) {
+            fprintf(stderr, "fail to register ud buffer\n");
+            return false;
+        }
+        if (!(channel_ = ibv_create_comp_channel(ctx_)) ||
+            !(send_cq_ = ibv_create_cq(ctx_, slots_, nullptr, nullptr, 0)) ||
+            !(recv_cq_ = ibv_create_cq(ctx_, slots_, nullptr, channel_, 0))) {
+            fprintf(stderr, "fail to create ud completion queues\n");
+            return false;
+        }
+
+        struct ibv_qp_init_attr init = {};
+        init.send_cq = send_cq_;
+        init.recv_cq = recv_cq_;
+        init.qp_type = IBV_QPT_UD;
+        init.cap.max_send_wr = slots_;
+        init.cap.max_recv_wr = slots_;
+        init.cap.max_send_sge = 1;
+        init.cap.max_recv_sge = 1;
+        init.cap.max_inline_data = 128;
+        while (!(qp_ = ibv_create_qp(pd_, &init)) && init.cap.max_inline_data > 0) {
+            init.cap.max_inline_data /= 2;
+        }
+        if (!qp_) {
+            fprintf(stderr, "fail to create ud queue pair\n");
+            return false;
+        }
+        max_inline_ = init.cap.max_inline_data;
+
+        // no connection to set up, the queue pair goes to RTS right away
+        struct ibv_qp_attr attr = {};
+        attr.qp_state = IBV_QPS_INIT;
+        attr.pkey_index = 0;
+        attr.port_num = ib_port_;
+        attr.qkey = QKEY;
+        if (ibv_modify_qp(qp_, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+            fprintf(stderr, "Modify UD QP to Init failed\n");
+            return false;
+        }
+        attr = {};
+        attr.qp_state = IBV_QPS_RTR;
+        if (ibv_modify_qp(qp_, &attr, IBV_QP_STATE)) {
+            fprintf(stderr, "Modify UD QP to RTR failed\n");
+            return false;
+        }
+        attr = {};
+        attr.qp_state = IBV_QPS_RTS;
+        attr.sq_psn = 0;
+        if (ibv_modify_qp(qp_, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+            fprintf(stderr, "Modify UD QP to RTS failed\n");
+            return false;
+        }
+
+        struct ibv_port_attr pattr;
+        if (ibv_query_port(ctx_, ib_port_, &pattr)) {
+            return false;
+        }
+        local_.qp_num = qp_->qp_num;
+        local_.qkey = QKEY;
+        local_.lid = pattr.lid;
+        if (gid_idx_ >= 0) {
+            union ibv_gid gid;
+            if (ibv_query_gid(ctx_, ib_port_, gid_idx_, &gid)) {
+                return false;
+            }
+            memcpy(local_.gid, &gid, 16);
+        }
+
+        for (int i = 0; i < slots_; i++) {
+            if (Repost(i) != 0) {
+                return false;
+            }
+        }
+        return ibv_req_notify_cq(recv_cq_, 0) == 0;
+    }
+
+    int UDEndpoint::AddPeer(const ud_address & addr) {
+        Peer peer = {nullptr, addr.qp_num, addr.qkey, true};
+        if (ctx_) {
+            struct ibv_ah_attr ah_attr = {};
+            ah_attr.dlid = addr.lid;
+            ah_attr.sl = 0;
+            ah_attr.src_path_bits = 0;
+            ah_attr.port_num = ib_port_;
+            if (gid_idx_ >= 0) {
+                ah_attr.is_global = 1;
+                memcpy(&ah_attr.grh.dgid, addr.gid, 16);
+                ah_attr.grh.hop_limit = 1;
+                ah_attr.grh.sgid_index = gid_idx_;
+            }
+            if (!(peer.ah = ibv_create_ah(pd_, &ah_attr))) {
+                return -1;
+            }
+        }
+
+        std::lock_guard<std::mutex> l(peers_mu_);
+        for (size_t i = 0; i < peers_.size(); i++) {
+            if (!peers_[i].used) {
+                peers_[i] = peer;
+                return i;
+            }
+        }
+        peers_.push_back(peer);
+        return peers_.size() - 1;
+    }
+
+    void UDEndpoint::RemovePeer(int peer) {
+        std::lock_guard<std::mutex> l(peers_mu_);
+        if (peers_[peer].ah) ibv_destroy_ah(peers_[peer].ah);
+        peers_[peer] = {nullptr, 0, 0, false};
+    }
+
+    int UDEndpoint::ReapSends(uint64_t most) {
+        struct ibv_wc wc[16];
+        while (sent_ - completed_ >= most) {
+            int n = ibv_poll_cq(send_cq_, 16, wc);
+            if (n < 0) {
+                return -1;
+            }
+            for (int i = 0; i < n; i++) {
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "UD send completion error: %s\n", ibv_wc_status_str(wc[i].status));
+                }
+            }
+            completed_ += n;
+        }
+        return 0;
+    }
+
+    int UDEndpoint::Send(int peer, const void * head, uint32_t head_len, const void * body, uint32_t body_len) {
+        if (head_len + body_len > mtu_) {
+            return -1;
+        }
+        Peer dst;
+        {
+            std::lock_guard<std::mutex> l(peers_mu_);
+            dst = peers_[peer];
+        }
+
+        if (!ctx_) {
+            std::lock_guard<std::mutex> l(lb_registry_mu);
+            auto iter = lb_registry.find(dst.qp_num);
+            if (iter != lb_registry.end()) { // like the network, a datagram to nowhere is lost
+                iter->second->Deliver(head, head_len, body, body_len);
+            }
+            return 0;
+        }
+
+        // every send is signaled, its slot is reused only once it completed
+        if (ReapSends(slots_) != 0) {
+            return -1;
+        }
+        uint8_t * slot = SendSlot(sent_ % slots_);
+        memcpy(slot, head, head_len);
+        if (body_len > 0) memcpy(slot + head_len, body, body_len);
+
+        struct ibv_sge sg;
+        sg.addr = (uint64_t)slot;
+        sg.length = head_len + body_len;
+        sg.lkey = mr_->lkey;
+
+        struct ibv_send_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.sg_list = &sg;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED | (sg.length <= max_inline_ ? IBV_SEND_INLINE : 0);
+        wr.wr.ud.ah = dst.ah;
+        wr.wr.ud.remote_qpn = dst.qp_num;
+        wr.wr.ud.remote_qkey = dst.qkey;
+        if (ibv_post_send(qp_, &wr, &bad_wr)) {
+            return -1;
+        }
+        sent_ += 1;
+        return 0;
+    }
+
+    void UDEndpoint::Deliver(const void * head, uint32_t head_len, const void * body, uint32_t body_len) {
+        {
+            std::lock_guard<std::mutex> l(lb_mu_);
+            if (lb_posted_.empty()) {
+                return ;
+            }
+            int slot = lb_posted_.front();
+            lb_posted_.pop_front();
+            uint8_t * data = RecvSlot(slot) + GRH_SIZE;
+            memcpy(data, head, head_len);
+            if (body_len > 0) memcpy(data + head_len, body, body_len);
+            lb_arrived_.push_back({data, head_len + body_len, slot});
+        }
+        lb_cv_.notify_one();
+    }
+
+    int UDEndpoint::Poll(Datagram * msgs, int n) {
+        if (!ctx_) {
+            std::lock_guard<std::mutex> l(lb_mu_);
+            int got = 0;
+            while (got < n && !lb_arrived_.empty()) {
+                msgs[got++] = lb_arrived_.front();
+                lb_arrived_.pop_front();
+            }
+            return got;
+        }
+
+        struct ibv_wc wc[16];
+        int got = ibv_poll_cq(recv_cq_, std::min(n, 16), wc);
+        for (int i = 0; i < got; i++) {
+            int slot = wc[i].wr_id;
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "UD receive completion error: %s\n", ibv_wc_status_str(wc[i].status));
+            }
+            msgs[i] = {RecvSlot(slot) + GRH_SIZE, wc[i].byte_len - GRH_SIZE, slot};
+        }
+        return got;
+    }
+
+    int UDEndpoint::Repost(int slot) {
+        if (!ctx_) {
+            std::lock_guard<std::mutex> l(lb_mu_);
+            lb_posted_.push_back(slot);
+            return 0;
+        }
+
+        struct ibv_sge sg;
+        sg.addr = (uint64_t)RecvSlot(slot);
+        sg.length = slot_size_;
+        sg.lkey = mr_->lkey;
+
+        struct ibv_recv_wr wr, *bad_wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = slot;
+        wr.sg_list = &sg;
+        wr.num_sge = 1;
+        return ibv_post_recv(qp_, &wr, &bad_wr);
+    }
+
+    int UDEndpoint::arm_cq(bool send) {
+        if (!ctx_ || send) {
+            return 0;
+        }
+        return ibv_req_notify_cq(recv_cq_, 0);
+    }
+
+    int UDEndpoint::wait_cq(int timeout_ms, bool /* send */) {
+        // only the receive queue is ever armed
+        if (!ctx_) {
+            std::unique_lock<std::mutex> l(lb_mu_);
+            return lb_cv_.wait_for(l, std::chrono::milliseconds(timeout_ms), [this] { return !lb_arrived_.empty(); });
+        }
+
+        struct pollfd pfd = {channel_->fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret <= 0) {
+            return ret;
+        }
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        if (ibv_get_cq_event(channel_, &ev_cq, &ev_ctx) != 0) {
+            return -1;
+        }
+        ibv_ack_cq_events(ev_cq, 1);
+        return 1;
+    }
+}
@@ -0,0 +1,138 @@
+/*
+    CopyRight (c) Luo Yongping
+*/
+
+#ifndef __UD_UTIL__
+#define __UD_UTIL__
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+namespace RDMAUtil {
+    // where an unreliable datagram endpoint receives, exchanged out of band like a connection_certificate
+    struct ud_address {
+        uint32_t qp_num;
+        uint32_t qkey;
+        uint16_t lid;
+        uint8_t gid[16];
+    } __attribute__((packed));
+
+    // a datagram returned by UDEndpoint::Poll(), valid until its slot is posted again with Repost()
+    struct Datagram {
+        uint8_t * data;
+        uint32_t length;
+        int slot;
+    };
+
+    /*
+     * UDEndpoint: an unreliable datagram queue pair with a registered buffer of `slots` send and
+     * `slots` receive buffers of one MTU each. It keeps no state per peer but an address handle, so a
+     * single endpoint talks to any number of peers without a queue pair context each. A datagram is
+     * at most one MTU long, it may be lost, and it is dropped when the receiver has no receive posted:
+     * reliability is up to the caller.
+     *
+     * Endpoints of a loopback device (no `ctx`) are found by queue pair number within the process, a
+     * datagram is copied into the receiver when it is sent, without the injected latency of the wire.
+     */
+    class UDEndpoint {
+    public:
+        static constexpr uint32_t QKEY = 0x11111111;
+        static constexpr int GRH_SIZE = 40; // in front of every datagram received by a NIC
+
+        // made by RDMADevice::open_ud()
+        UDEndpoint(struct ibv_context * ctx, struct ibv_pd * pd, int ib_port, int gid_idx, uint32_t mtu, int slots);
+        ~UDEndpoint();
+
+        UDEndpoint(const UDEndpoint &) = delete;
+        UDEndpoint &operator=(const UDEndpoint &) = delete;
+
+        // create the queue pair and post every receive, false on failure
+        bool Init();
+
+        inline const ud_address & Address() const {
+            return local_;
+        }
+
+        // the longest datagram
+        inline uint32_t MaxMessage() const {
+            return mtu_;
+        }
+
+        // resolve `addr` for Send(), -1 on failure
+        int AddPeer(const ud_address & addr);
+
+        void RemovePeer(int peer);
+
+        // send `head` followed by `body` to `peer` in one datagram of at most MaxMessage() bytes, 0 on success
+        int Send(int peer, const void * head, uint32_t head_len, const void * body = nullptr, uint32_t body_len = 0);
+
+        // take up to `n` received datagrams, return how many
+        int Poll(Datagram * msgs, int n);
+
+        // post the receive of a slot returned by Poll() again
+        int Repost(int slot);
+
+        // for Poller::Idle(), only the receive queue can be waited for
+        int arm_cq(bool send);
+
+        int wait_cq(int timeout_ms, bool send);
+
+    private:
+        struct Peer {
+            struct ibv_ah * ah;
+            uint32_t qp_num;
+            uint32_t qkey;
+            bool used;
+        };
+
+        inline uint8_t * SendSlot(int i) {
+            return buf_ + i * slot_size_;
+        }
+
+        inline uint8_t * RecvSlot(int i) {
+            return buf_ + (slots_ + i) * slot_size_;
+        }
+
+        // reap send completions until fewer than `most` sends are outstanding
+        int ReapSends(uint64_t most);
+
+        // loopback: copy a datagram into the endpoint, dropped without a receive posted
+        void Deliver(const void * head, uint32_t head_len, const void * body, uint32_t body_len);
+
+        struct ibv_context * ctx_;
+        struct ibv_pd * pd_;
+        int ib_port_;
+        int gid_idx_;
+        uint32_t mtu_;
+        int slots_;
+        size_t slot_size_;
+
+        uint8_t * buf_;
+        struct ibv_mr * mr_;
+        struct ibv_comp_channel * channel_;
+        struct ibv_cq * send_cq_;
+        struct ibv_cq * recv_cq_;
+        struct ibv_qp * qp_;
+        ud_address local_;
+        uint32_t max_inline_;
+        uint64_t sent_;      // sends posted
+        uint64_t completed_; // sends completed
+
+        std::mutex peers_mu_; // peers are added by other threads than the one sending
+        std::vector<Peer> peers_;
+
+        // loopback receives
+        std::mutex lb_mu_;
+        std::condition_variable lb_cv_;
+        std::deque<int> lb_posted_;
+        std::deque<Datagram> lb_arrived_;
+    };
+}
+
+#endif // __UD_UTIL__
@@ -12,4 +12,8 @@ mv query.dat ../workload/query2.dat
 
 # YCSB-B
 ./YCSB-Gen-prefix/src/YCSB-Gen-build/ycsbc -P ./YCSB-Gen-prefix/src/YCSB-Gen/workloads/workloadb.spec --queryonly
-mv query.dat ../workload/query3.dat
\ No newline at end of file
+mv query.dat ../workload/query3.dat
+
+# YCSB-E
+./YCSB-Gen-prefix/src/YCSB-Gen-build/ycsbc -P ./YCSB-Gen-prefix/src/YCSB-Gen/workloads/workloade.spec --queryonly
+mv query.dat ../workload/query4.dat
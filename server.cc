@@ -8,15 +8,43 @@ int main(int argc, char ** argv) {
     cmdline::parser a;
     a.add<std::string>("fronttype", 'f', "front type", false, default_opt.front_type);
     a.add<std::string>("dbtype", 'd', "database type", false, default_opt.db_type);
+    a.add<std::string>("notify", 'n', "ring notification: poll, imm or frame", false, default_opt.notify);
+    a.add<int>("workers", 0, "server polling threads, 0 for one per connection", false, default_opt.worker_num);
+    a.add<std::string>("poll", 0, "idling after empty polls: spin,pause,yield,block_ms", false, default_opt.poll);
+    a.add<std::string>("profile", 0, "transport profile: mtu,inline,depth,cqe,rd_atomic,timeout,retry,rnr_retry,rnr_timer", false, default_opt.profile);
+    a.add<std::string>("device", 0, "RDMA devices: name[:port],...", false, default_opt.rdma_device);
+    a.add<std::string>("rpc", 0, "rc for a connection per client, ud for datagrams", false, default_opt.rpc);
+    a.add<int>("ingest", 0, "pmraccess ingest workers, 0 to ingest on the clerks", false, default_opt.ingest_workers);
+    a.add<int>("ingestmerge", 0, "sealed chunks put into the database with one write", false, default_opt.ingest_merge);
+    a.add<int>("chunks", 0, "chunks of the PMR buffer used, -1 for all", false, default_opt.pmr_chunks);
+    a.add<int>("spill", 0, "chunks of host DRAM the buffer spills to, -1 for all", false, default_opt.spill_chunks);
     a.parse_check(argc, argv);
     
     MyOption opt = default_opt;
     opt.front_type = a.get<std::string>("fronttype");
     opt.db_type = a.get<std::string>("dbtype");
+    opt.notify = a.get<std::string>("notify");
+    opt.worker_num = a.get<int>("workers");
+    opt.poll = a.get<std::string>("poll");
+    opt.profile = a.get<std::string>("profile");
+    opt.rdma_device = a.get<std::string>("device");
+    opt.rpc = a.get<std::string>("rpc");
+    opt.ingest_workers = a.get<int>("ingest");
+    opt.ingest_merge = a.get<int>("ingestmerge");
+    opt.pmr_chunks = a.get<int>("chunks");
+    opt.spill_chunks = a.get<int>("spill");
 
     std::cerr << "FrontType : \t" << opt.front_type << std::endl
               << "DBType    : \t" << opt.db_type << std::endl
-              << "Sync      : \t" << (opt.sync == true ? "true" : "false") << std::endl;
+              << "Sync      : \t" << (opt.sync == true ? "true" : "false") << std::endl
+              << "Notify    : \t" << opt.notify << std::endl
+              << "Workers   : \t" << opt.worker_num << std::endl
+              << "Poll      : \t" << (opt.poll.empty() ? "spin" : opt.poll) << std::endl
+              << "Profile   : \t" << (opt.profile.empty() ? "detect" : opt.profile) << std::endl
+              << "Devices   : \t" << opt.rdma_device << std::endl
+              << "RPC       : \t" << opt.rpc << std::endl
+              << "Ingest    : \t" << opt.ingest_workers << " (merge " << opt.ingest_merge << ")" << std::endl
+              << "Chunks    : \t" << opt.pmr_chunks << " (spill " << opt.spill_chunks << ")" << std::endl;
     
     DBType * db = OpenDB(opt);
     Server * s  = NewServer(opt, db);
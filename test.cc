@@ -1,5 +1,9 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "instance.h"
 #include "generator.h"
@@ -100,6 +104,390 @@ void TestDelete(Client * c) {
     }
 }
 
+void TestMultiGet(Client * c) {
+    const int start = 4000000;
+    const int end = start + TEST_SCALE;
+    const int batch = 50;
+    for(int i = start; i < end; i += 2) {
+        std::string k = BuildKey(i);
+        c->SendPut(k.c_str(), k.c_str());
+    }
+
+    // every other key is missing
+    for(int i = start; i < end; i += batch) {
+        std::vector<std::string> keys, vals;
+        std::vector<bool> found;
+        for(int j = i; j < std::min(i + batch, end); j++) {
+            keys.push_back(BuildKey(j));
+        }
+        c->SendMultiGet(keys, &vals, &found);
+        for(size_t j = 0; j < keys.size(); j++) {
+            if(found[j] != ((i + j - start) % 2 == 0) || (found[j] && vals[j] != keys[j])) {
+                std::cout << "\t Assert Failed " << keys[j] << "=" << vals[j] << std::endl;
+                throw global_e;
+            }
+        }
+    }
+}
+
+void TestMultiDelete(Client * c) {
+    const int start = 8000000;
+    const int end = start + TEST_SCALE;
+    const int batch = 50;
+    for(int i = start; i < end; i++) {
+        std::string k = BuildKey(i);
+        c->SendPut(k, k);
+    }
+
+    // delete every other key
+    std::vector<std::string> deleted;
+    for(int i = start; i < end; i += 2) {
+        deleted.push_back(BuildKey(i));
+    }
+    int n = c->SendMultiDelete(deleted);
+    if(n != (int)deleted.size()) {
+        std::cout << "\t Assert Failed " << n << " of " << deleted.size() << " keys deleted" << std::endl;
+        throw global_e;
+    }
+
+    for(int i = start; i < end; i += batch) {
+        std::vector<std::string> keys, vals;
+        std::vector<bool> found;
+        for(int j = i; j < std::min(i + batch, end); j++) {
+            keys.push_back(BuildKey(j));
+        }
+        c->SendMultiGet(keys, &vals, &found);
+        for(size_t j = 0; j < keys.size(); j++) {
+            if(found[j] != ((i + j - start) % 2 == 1) || (found[j] && vals[j] != keys[j])) {
+                std::cout << "\t Assert Failed " << keys[j] << "=" << vals[j] << std::endl;
+                throw global_e;
+            }
+        }
+    }
+}
+
+// keys another client put, still in its chunks, deleted or overwritten with a large value by this one.
+// The records of the other client ingested afterwards must not bring the old values back.
+void TestMultiDeleteOthers(Client * c, MyOption opt) {
+    const int start = 12000000;
+    const int count = 200;
+    std::unique_ptr<Client> other(NewClient(opt, 1));
+    other->Connect();
+    for(int i = start; i < start + count; i++) {
+        std::string k = BuildKey(i);
+        other->SendPut(k, k);
+    }
+
+    std::vector<std::string> deleted;
+    for(int i = start + 1; i < start + count; i++) {
+        deleted.push_back(BuildKey(i));
+    }
+    int n = c->SendMultiDelete(deleted);
+    if(n != (int)deleted.size()) {
+        std::cout << "\t Assert Failed " << n << " of " << deleted.size() << " keys deleted" << std::endl;
+        throw global_e;
+    }
+    std::string large(2 * MAX_ASYNC_SIZE, 'L');
+    c->SendPut(BuildKey(start), large);
+
+    // seal the chunks of the other client, so that its records of the keys get ingested
+    std::string filler(1000, 'f');
+    for(int i = 0; i < 4 * MAX_ASYNC_SIZE / 1000; i++) {
+        other->SendPut(BuildKey(start + count + i), filler);
+    }
+    other->SendClose();
+
+    auto check = [&](const char * when) {
+        std::string v;
+        if(!c->SendGet(BuildKey(start), &v) || v != large) {
+            std::cout << "\t Assert Failed " << BuildKey(start) << " of " << v.size() << " bytes " << when << std::endl;
+            throw global_e;
+        }
+        for(auto & k : deleted) {
+            if(c->SendGet(k, &v)) {
+                std::cout << "\t Assert Failed " << k << "=" << v << " back " << when << std::endl;
+                throw global_e;
+            }
+        }
+    };
+    check("while ingesting");
+    sleep(1); // for every chunk to be ingested, the keys are then read from the database
+    check("once ingested");
+}
+
+void TestLargeValue(Client * c) {
+    const int start = 5000000;
+    // within a slot, beyond a slot, beyond a chunk, and beyond a segment of the clerk
+    const int sizes[] = {100, 5000, 40000, 300000};
+    std::vector<std::string> values;
+    for(int size : sizes) {
+        std::string v(size, '\0');
+        for(int j = 0; j < size; j++) {
+            v[j] = (j % 7 == 0) ? '\0' : (char)(j * 31 + size);
+        }
+        values.push_back(v);
+    }
+
+    for(int i = start; i < start + TEST_SCALE / 100 + 1; i++) {
+        std::string k = BuildKey(i);
+        std::string & v = values[i % values.size()];
+        c->SendPut(k, v);
+    }
+
+    for(int i = start; i < start + TEST_SCALE / 100 + 1; i++) {
+        std::string k = BuildKey(i);
+        std::string v;
+        c->SendGet(k, &v);
+        if(v != values[i % values.size()]) {
+            std::cout << "\t Assert Failed " << k << " of " << v.size() << " bytes" << std::endl;
+            throw global_e;
+        }
+    }
+}
+
+void TestScan(Client * c) {
+    const int start = 6000000;
+    const int end = start + TEST_SCALE;
+    for(int i = start; i < end; i++) {
+        std::string k = BuildKey(i);
+        c->SendPut(k, k);
+    }
+
+    // a limit within the range, then one beyond it
+    for(int limit : {TEST_SCALE / 2, TEST_SCALE * 2}) {
+        ScanEntries entries;
+        if(!c->SendScan(BuildKey(start), BuildKey(end), limit, &entries) || entries.size() != (size_t)std::min(limit, TEST_SCALE)) {
+            std::cout << "\t Assert Failed " << entries.size() << " entries for limit " << limit << std::endl;
+            throw global_e;
+        }
+        for(size_t j = 0; j < entries.size(); j++) {
+            std::string k = BuildKey(start + j);
+            if(entries[j].first != k || entries[j].second != k) {
+                std::cout << "\t Assert Failed " << entries[j].first << "=" << entries[j].second << std::endl;
+                throw global_e;
+            }
+        }
+    }
+}
+
+void TestOversize(Client * c) {
+    const int start = 7000000;
+    // a value larger than any client takes fails, and the client goes on with the next request
+    std::string k = BuildKey(start), v;
+    bool failed = false;
+    c->AsyncPut(k, std::string(MAX_VALUE + 1, 'x'), [&failed](bool ok, std::string *) {
+        failed = !ok;
+    });
+    c->Drain();
+    if(!failed || c->SendGet(k, &v)) {
+        std::cout << "\t Assert Failed " << k << " of an oversized value" << std::endl;
+        throw global_e;
+    }
+
+    k = BuildKey(start + 1);
+    c->SendPut(k, k);
+    if(!c->SendGet(k, &v) || v != k) {
+        std::cout << "\t Assert Failed " << k << "=" << v << std::endl;
+        throw global_e;
+    }
+}
+
+// keys overwritten in chunk after chunk, which ingest workers (--ingest) may put into the database out
+// of order, and a value too large for a chunk put while older records of its key wait to be ingested
+void TestIngestOrder(Client * c) {
+    const int start = 11000000;
+    const int keys = 50, rounds = 8;
+    auto value = [](const std::string & k, int round) {
+        return std::string(1000, (char)('a' + round)) + k;
+    };
+    for(int r = 0; r < rounds; r++) {
+        for(int i = start; i < start + keys; i++) {
+            std::string k = BuildKey(i);
+            c->AsyncPut(k, value(k, r), nullptr);
+        }
+    }
+    std::string large(2 * MAX_ASYNC_SIZE, 'L');
+    c->SendPut(BuildKey(start), large);
+    c->Drain();
+
+    auto check = [&](const char * when) {
+        for(int i = start; i < start + keys; i++) {
+            std::string k = BuildKey(i);
+            std::string v;
+            std::string expected = (i == start) ? large : value(k, rounds - 1);
+            if(!c->SendGet(k, &v) || v != expected) {
+                std::cout << "\t Assert Failed " << k << " of " << v.size() << " bytes " << when << std::endl;
+                throw global_e;
+            }
+        }
+    };
+    check("while ingesting");
+    sleep(1); // for every chunk to be ingested, the keys are then read from the database
+    check("once ingested");
+}
+
+// more records than the chunks of a shrunk PMR buffer hold at once, so that chunks spill to host DRAM
+void TestSpill(Client * c) {
+    const int start = 10000000;
+    const int count = 16 * MAX_ASYNC_SIZE / 500;
+    auto value = [](const std::string & k) {
+        std::string v;
+        while(v.size() < 500) {
+            v += k;
+        }
+        return v;
+    };
+    for(int i = start; i < start + count; i++) {
+        std::string k = BuildKey(i);
+        c->AsyncPut(k, value(k), nullptr);
+    }
+    c->Drain();
+
+    for(int i = start; i < start + count; i++) {
+        std::string k = BuildKey(i);
+        std::string v;
+        if(!c->SendGet(k, &v) || v != value(k)) {
+            std::cout << "\t Assert Failed " << k << " of " << v.size() << " bytes" << std::endl;
+            throw global_e;
+        }
+    }
+}
+
+// the allocator of pmraccess run out of chunks: takes fail or wait, and racing clerks never share one
+void TestChunkAllocator(Client *) {
+    const uint32_t chunks = 4, spill = 2;
+    ChunkAllocator allocator(chunks, spill);
+    std::vector<uint32_t> taken;
+    for(uint32_t i = 0; i < chunks + spill; i++) {
+        taken.push_back(allocator.Take());
+    }
+    for(uint32_t i = 0; i < chunks + spill; i++) {
+        if(allocator.TierOf(taken[i]) != (i < chunks ? ChunkAllocator::PMR : ChunkAllocator::SPILL)) {
+            std::cout << "\t Assert Failed chunk " << taken[i] << " of the wrong tier" << std::endl;
+            throw global_e;
+        }
+    }
+    if(allocator.TryTake(ChunkAllocator::PMR) != ChunkAllocator::NIL ||
+       allocator.TryTake(ChunkAllocator::SPILL) != ChunkAllocator::NIL || allocator.FreeCount() != 0) {
+        std::cout << "\t Assert Failed a chunk left after taking all of them" << std::endl;
+        throw global_e;
+    }
+
+    // a take waits until a chunk is given back
+    std::atomic<uint32_t> waited{ChunkAllocator::NIL};
+    std::thread waiter([&]() { waited = allocator.Take(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    if(waited != ChunkAllocator::NIL) {
+        std::cout << "\t Assert Failed chunk " << waited << " taken while none is free" << std::endl;
+        throw global_e;
+    }
+    allocator.Give(taken.back());
+    waiter.join();
+    if(waited != taken.back()) {
+        std::cout << "\t Assert Failed chunk " << waited << " instead of " << taken.back() << std::endl;
+        throw global_e;
+    }
+    for(uint32_t chunk : taken) {
+        allocator.Give(chunk);
+    }
+
+    // a writer of a buffer of one chunk switches to it and finds no spare, without waiting for one
+    {
+        ChunkAllocator single(1);
+        ChunkCache cache(&single);
+        uint32_t chunk = cache.Take();
+        if(cache.TryTake() != ChunkAllocator::NIL) {
+            std::cout << "\t Assert Failed a spare besides the only chunk" << std::endl;
+            throw global_e;
+        }
+        single.Free(chunk);
+    }
+
+    // clerks with caches take and free more chunks than there are, each held by one of them at a time
+    const int clerks = 4, rounds = 20000;
+    std::unique_ptr<std::atomic<int>[]> holders(new std::atomic<int>[chunks + spill]);
+    for(uint32_t i = 0; i < chunks + spill; i++) {
+        holders[i] = -1;
+    }
+    std::atomic<bool> shared{false};
+    std::vector<std::thread> threads;
+    for(int t = 0; t < clerks; t++) {
+        threads.emplace_back([&, t]() {
+            ChunkCache cache(&allocator);
+            for(int i = 0; i < rounds; i++) {
+                uint32_t chunk = (i % 2 == 0) ? cache.Take() : cache.TryTake();
+                if(chunk == ChunkAllocator::NIL) {
+                    continue;
+                }
+                int free = -1;
+                if(!holders[chunk].compare_exchange_strong(free, t)) {
+                    shared = true;
+                }
+                holders[chunk] = -1;
+                allocator.Free(chunk);
+            }
+        });
+    }
+    for(auto & thread : threads) {
+        thread.join();
+    }
+    if(shared) {
+        std::cout << "\t Assert Failed a chunk taken by two clerks at once" << std::endl;
+        throw global_e;
+    }
+    if(allocator.FreeCount(ChunkAllocator::PMR) != (int32_t)chunks ||
+       allocator.FreeCount(ChunkAllocator::SPILL) != (int32_t)spill ||
+       allocator.InUse(ChunkAllocator::PMR) != 0 || allocator.InUse(ChunkAllocator::SPILL) != 0) {
+        std::cout << "\t Assert Failed chunks lost: " << allocator.FreeCount(ChunkAllocator::PMR) << " and "
+                  << allocator.FreeCount(ChunkAllocator::SPILL) << " free" << std::endl;
+        throw global_e;
+    }
+}
+
+const int RESTART_START = 9000000;
+const std::string RESTART_LARGE(2 * MAX_ASYNC_SIZE, 'R');
+
+// put keys into a server that is killed afterwards without a close, the tests run on the one recovering
+void PutBeforeRestart(MyOption opt) {
+    ServeInProcess(opt);
+    std::unique_ptr<Client> c(NewClient(opt, 0));
+    c->Connect();
+    for(int i = RESTART_START; i < RESTART_START + TEST_SCALE; i++) {
+        std::string k = BuildKey(i);
+        c->SendPut(k, k);
+    }
+    // a delete and a direct put, whose keys still have records in the chunks recovery finds
+    std::vector<std::string> deleted{BuildKey(RESTART_START)};
+    c->SendMultiDelete(deleted);
+    c->SendPut(BuildKey(RESTART_START + 1), RESTART_LARGE);
+    // a record in an open chunk of a DRAM buffer is lost with the process, later puts seal the chunks
+    std::string filler(1000, 'f');
+    for(int i = 0; i < 8 * MAX_ASYNC_SIZE / 1000; i++) {
+        c->SendPut(BuildKey(RESTART_START + TEST_SCALE + i), filler);
+    }
+    sleep(1); // for the images of the sealed chunks to reach the log
+    _exit(0);
+}
+
+void TestRestart(Client * c) {
+    std::string v;
+    if(c->SendGet(BuildKey(RESTART_START), &v)) {
+        std::cout << "\t Assert Failed " << BuildKey(RESTART_START) << " deleted but back after a restart" << std::endl;
+        throw global_e;
+    }
+    if(!c->SendGet(BuildKey(RESTART_START + 1), &v) || v != RESTART_LARGE) {
+        std::cout << "\t Assert Failed " << BuildKey(RESTART_START + 1) << " of " << v.size() << " bytes after a restart" << std::endl;
+        throw global_e;
+    }
+    for(int i = RESTART_START + 2; i < RESTART_START + TEST_SCALE; i++) {
+        std::string k = BuildKey(i);
+        if(!c->SendGet(k, &v) || v != k) {
+            std::cout << "\t Assert Failed " << k << "=" << v << " after a restart" << std::endl;
+            throw global_e;
+        }
+    }
+}
+
 class Testbed {
 public: 
     using TestType = std::function<void(Client *)>;
@@ -139,15 +527,91 @@ private:
 int main(int argc, char ** argv) {
     cmdline::parser a;
     a.add<std::string>("fronttype", 'f', "front type", false, default_opt.front_type);
+    a.add<std::string>("dbtype", 'd', "database type", false, default_opt.db_type);
+    a.add<std::string>("transport", 't', "rdma or shm", false, default_opt.transport);
+    a.add<std::string>("dir", 0, "database directory", false, default_opt.dir);
+    a.add<int>("shmlat", 0, "shm injected latency (ns)", false, default_opt.shm_latency);
+    a.add<int>("shmbw", 0, "shm bandwidth (MB/s)", false, default_opt.shm_bandwidth);
+    a.add<std::string>("notify", 'n', "ring notification: poll, imm or frame", false, default_opt.notify);
+    a.add<int>("workers", 0, "server polling threads, 0 for one per connection", false, default_opt.worker_num);
+    a.add<std::string>("poll", 0, "idling after empty polls: spin,pause,yield,block_ms", false, default_opt.poll);
+    a.add<std::string>("profile", 0, "transport profile: mtu,inline,depth,cqe,rd_atomic,timeout,retry,rnr_retry,rnr_timer", false, default_opt.profile);
+    a.add<bool>("readpath", 0, "pmraccess gets read the server's index with RDMA first", false, default_opt.read_path);
+    a.add<int>("lanes", 0, "connections per client, requests are striped over them by key", false, default_opt.lanes);
+    a.add<std::string>("device", 0, "RDMA devices: name[:port],...", false, default_opt.rdma_device);
+    a.add<std::string>("rpc", 0, "rc for a connection per client, ud for datagrams", false, default_opt.rpc);
+    a.add<int>("combine", 0, "pmraccess puts notified together, 1 for none", false, default_opt.combine);
+    a.add<int>("combinebytes", 0, "bytes of combined puts that trigger a notification", false, default_opt.combine_bytes);
+    a.add<int>("linger", 0, "microseconds a combined put waits at most for others", false, default_opt.linger_us);
+    a.add<int>("ingest", 0, "pmraccess ingest workers, 0 to ingest on the clerks", false, default_opt.ingest_workers);
+    a.add<int>("ingestmerge", 0, "sealed chunks put into the database with one write", false, default_opt.ingest_merge);
+    a.add<int>("chunks", 0, "chunks of the PMR buffer used, -1 for all", false, default_opt.pmr_chunks);
+    a.add<int>("spill", 0, "chunks of host DRAM the buffer spills to, -1 for all", false, default_opt.spill_chunks);
+    a.add("restart", 0, "first put keys into a server that is killed, for pmraccess on leveldb over shm");
     a.parse_check(argc, argv);
 
     MyOption opt = default_opt;
     opt.front_type = a.get<std::string>("fronttype");
-    std::cerr << "FrontType :\t" << opt.front_type << std::endl;
+    opt.db_type = a.get<std::string>("dbtype");
+    opt.transport = a.get<std::string>("transport");
+    opt.dir = a.get<std::string>("dir");
+    opt.shm_latency = a.get<int>("shmlat");
+    opt.shm_bandwidth = a.get<int>("shmbw");
+    opt.notify = a.get<std::string>("notify");
+    opt.worker_num = a.get<int>("workers");
+    opt.poll = a.get<std::string>("poll");
+    opt.profile = a.get<std::string>("profile");
+    opt.read_path = a.get<bool>("readpath");
+    opt.lanes = a.get<int>("lanes");
+    opt.rdma_device = a.get<std::string>("device");
+    opt.rpc = a.get<std::string>("rpc");
+    opt.combine = a.get<int>("combine");
+    opt.combine_bytes = a.get<int>("combinebytes");
+    opt.linger_us = a.get<int>("linger");
+    opt.ingest_workers = a.get<int>("ingest");
+    opt.ingest_merge = a.get<int>("ingestmerge");
+    opt.pmr_chunks = a.get<int>("chunks");
+    opt.spill_chunks = a.get<int>("spill");
+    std::cerr << "FrontType :\t" << opt.front_type << std::endl
+              << "Transport :\t" << opt.transport << std::endl;
+
+    bool restart = a.exist("restart") && opt.transport == "shm";
+    if(opt.transport == "shm") {
+        opt.ipaddr = "127.0.0.1";
+        if(restart) {
+            pid_t pid = fork();
+            if(pid == 0) {
+                PutBeforeRestart(opt);
+            }
+            waitpid(pid, nullptr, 0);
+        }
+        ServeInProcess(opt);
+    }
 
     Testbed test(opt);
+    if(restart) {
+        test.Addtest(TestRestart, "Restart");
+    }
     test.Addtest(TestPut, "Put");
     test.Addtest(TestGet, "Get");
+    test.Addtest(TestMultiGet, "MultiGet");
+    if(opt.rpc == "rc") {
+        test.Addtest(TestScan, "Scan");
+    }
+    if(opt.front_type == "pmraccess") {
+        test.Addtest(TestMultiDelete, "MultiDelete");
+        test.Addtest(TestChunkAllocator, "ChunkAllocator");
+        test.Addtest(TestSpill, "Spill");
+    }
+    if(opt.front_type == "pmraccess" && opt.rpc == "rc") {
+        test.Addtest(TestLargeValue, "LargeValue");
+        test.Addtest(TestIngestOrder, "IngestOrder");
+        // a second client needs chunks of its own, which a buffer shrunk to a few chunks may not have
+        if(opt.pmr_chunks < 0 || opt.spill_chunks < 0 || opt.pmr_chunks + opt.spill_chunks >= 4) {
+            test.Addtest([opt](Client * c) { TestMultiDeleteOthers(c, opt); }, "MultiDeleteOthers");
+        }
+    }
+    test.Addtest(TestOversize, "Oversize");
     // test.Addtest(TestUpdate, "Update");
     // test.Addtest(TestDelete, "Delete");
     